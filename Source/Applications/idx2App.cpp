@@ -54,6 +54,24 @@ ParseDecodeOptions(int Argc, cstr* Argv, params* P)
   }
 
   P->ParallelDecode = OptExists(Argc, Argv, "--parallel");
+
+  // Parse the memory mapping option (--mmap): read the data files through memory mappings
+  P->MapFiles = OptExists(Argc, Argv, "--mmap");
+
+  // Parse the max read gap (--max_read_gap): chunks at most this many bytes apart are read together
+  OptVal(Argc, Argv, "--max_read_gap", &P->MaxReadGap);
+
+  // Parse the number of I/O threads (--io_threads) that read chunks ahead during parallel decoding
+  OptVal(Argc, Argv, "--io_threads", &P->IOThreads);
+
+  // Parse the number of bricks (--prefetch) whose chunks the serial decoder reads ahead on the I/O threads
+  OptVal(Argc, Argv, "--prefetch", &P->PrefetchBricks);
+
+  // Parse the build index option (--build_index): collect the footers of all data files into one index
+  P->BuildFooterIndex = OptExists(Argc, Argv, "--build_index");
+
+  // Parse the float32 bricks option (--float32_bricks): decode float32 data in float32 bricks
+  P->Float32Bricks = OptExists(Argc, Argv, "--float32_bricks");
 }
 
 
@@ -159,12 +177,20 @@ ParseEncodeOptions(int Argc, cstr* Argv, params* P)
   OptVal(Argc, Argv, "--bricks_per_chunk", &P->BricksPerChunk);
   OptVal(Argc, Argv, "--chunks_per_file", &P->ChunksPerFile);
   OptVal(Argc, Argv, "--files_per_dir", &P->FilesPerDir);
+  OptVal(Argc, Argv, "--max_open_files", &P->MaxOpenFiles);
 
   // Parse the optional version (--version)
   OptVal(Argc, Argv, "--version", &P->Version);
   // Parse the optional output directory (--out_dir)
   OptVal(Argc, Argv, "--out_dir", &P->OutDir);
 
+  // Parse the memory budget in MB (--memory_budget): if given, stream the input instead of mapping it
+  i64 MemoryBudgetMB = 0;
+  if (OptVal(Argc, Argv, "--memory_budget", &MemoryBudgetMB))
+    P->MemoryBudget = MemoryBudgetMB << 20;
+
+  // Parse the parallel option (--parallel): encode the bricks using multiple threads
+  P->ParallelEncode = OptExists(Argc, Argv, "--parallel");
 }
 
 
@@ -198,6 +224,9 @@ ParseParams(int Argc, cstr* Argv)
   // Parse the optional output file (--out_file)
   OptVal(Argc, Argv, "--out_file", &P.OutFile);
 
+  // Parse the fused transform option (--fused_transform): lift the three axes of a level together
+  P.FusedTransform = OptExists(Argc, Argv, "--fused_transform");
+
   // Parse the dry run option (--dry): if enabled, skip writing the output file
   P.OutMode =
     OptExists(Argc, Argv, "--dry") ? params::out_mode::NoOutput : params::out_mode::RegularGridFile;
@@ -229,6 +258,7 @@ SetParams(idx2_file* Idx2, params* P)
   SetTolerance(Idx2, P->Tolerance);
   SetFilesPerDirectory(Idx2, P->FilesPerDir);
   SetDir(Idx2, P->OutDir);
+  SetFusedTransform(Idx2, P->FusedTransform);
   return Finalize(Idx2, P);
 }
 
@@ -281,7 +311,58 @@ Idx2App(int Argc, const char* Argv[])
 
     if (Size(P.InputFiles) > 0)
     { // the input contains multiple files
-      idx2_ExitIf(true, "File list input not supported at the moment\n");
+      idx2_ExitIf(P.Version != v2i(1, 0), "File list input requires version 1.0\n");
+      idx2_ExitIf(P.MemoryBudget > 0, "--memory_budget is not supported with a file list input\n");
+      i64 FileBytes = GetFileSize(stref(P.InputFiles[0].Arr));
+      if (FileBytes == Prod<i64>(P.Meta.Dims3) * SizeOf(P.Meta.DType))
+      { // each file is a whole volume (e.g., a time step), which we encode as a separate field
+        idx2_RAII(file_list_copier, Copier);
+        idx2_ExitIfError(Init(&Copier, P));
+        char Field[sizeof(P.Meta.Field)];
+        snprintf(Field, sizeof(Field), "%s", P.Meta.Field);
+        idx2_For (int, I, 0, Size(P.InputFiles))
+        {
+          int Len = snprintf(P.Meta.Field, sizeof(P.Meta.Field), "%s-%d", Field, I);
+          idx2_ExitIf(Len < 0 || Len >= (int)sizeof(P.Meta.Field), "Field name too long: %s-%d\n", Field, I);
+          RemoveDir(idx2_PrintScratch("%s/%s/%s", P.OutDir, P.Meta.Name, P.Meta.Field));
+          Dealloc(&Idx2);
+          Idx2 = idx2_file();
+          idx2_ExitIfError(SetParams(&Idx2, &P));
+          idx2_ExitIfError(NextFile(&Copier));
+          printf("encoding %s as field %s\n", P.InputFiles[I].Arr, P.Meta.Field);
+          if (P.ParallelEncode)
+          {
+            idx2_ExitIfError(ParallelEncode(&Idx2, P, Copier));
+          }
+          else
+          {
+            idx2_ExitIfError(Encode(&Idx2, P, Copier));
+          }
+        }
+      }
+      else
+      { // the files are stacked along Z to form one volume
+        idx2_RAII(stacked_copier, Copier);
+        idx2_ExitIfError(Init(&Copier, P));
+        if (P.ParallelEncode)
+        {
+          idx2_ExitIfError(ParallelEncode(&Idx2, P, Copier));
+        }
+        else
+        {
+          idx2_ExitIfError(Encode(&Idx2, P, Copier));
+        }
+      }
+    }
+    else if (P.MemoryBudget > 0)
+    { // a single raw volume is provided, which we read in pieces to stay within the memory budget
+      idx2_ExitIf(P.Version != v2i(1, 0), "--memory_budget requires version 1.0\n");
+      // the boxes are read in the order of the brick traversal, so we can only encode serially
+      idx2_ExitIf(P.ParallelEncode, "--memory_budget is not supported with --parallel\n");
+      idx2_RAII(stream_copier, Copier);
+      idx2_ExitIfError(Init(&Copier, Idx2, P.InputFile, P.MemoryBudget));
+      idx2_ExitIfError(Encode(&Idx2, P, Copier));
+      printf("num boxes read          = %" PRIi64 "\n", Copier.NBoxesRead);
     }
     else if (Size(P.InputFiles) == 0)
     { // a single raw volume is provided
@@ -291,7 +372,14 @@ Idx2App(int Argc, const char* Argv[])
       brick_copier Copier(&Vol.Vol);
       if (P.Version == v2i(1, 0))
       {
-        idx2_ExitIfError(Encode(&Idx2, P, Copier));
+        if (P.ParallelEncode)
+        {
+          idx2_ExitIfError(ParallelEncode(&Idx2, P, Copier));
+        }
+        else
+        {
+          idx2_ExitIfError(Encode(&Idx2, P, Copier));
+        }
       }
       //else if (P.Version == v2i(2, 0))
       //{
@@ -302,6 +390,7 @@ Idx2App(int Argc, const char* Argv[])
   else if (P.Action == action::Decode)
   {
     idx2_ExitIfError(Init(&Idx2, P));
+    SetFusedTransform(&Idx2, P.FusedTransform);
 
 #if VISUS_IDX2
     // make sure these instances are alive for encoding/decoding operations
@@ -316,6 +405,12 @@ Idx2App(int Argc, const char* Argv[])
     }
 #endif
 
+    if (P.BuildFooterIndex)
+      idx2_ExitIfError(BuildFooterIndex(Idx2));
+    idx2_RAII(footer_index, FooterIndex, , Dealloc(&FooterIndex));
+    if (Load(&FooterIndex, Idx2))
+      SetFooterIndex(&Idx2, &FooterIndex);
+
     if (P.ParallelDecode)
     {
       idx2_ExitIfError(ParallelDecode(Idx2, P));
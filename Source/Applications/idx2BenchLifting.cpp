@@ -0,0 +1,147 @@
+/*
+Benchmark the SIMD lifting (FLiftCdf53Lines/ILiftCdf53Lines) and the fused lifting of whole levels
+(FLiftCdf53XYZ/ILiftCdf53XYZ) against the scalar lifting (FLiftCdf53X/Y/Z, ILiftCdf53X/Y/Z), and
+check that all of them give the same bits.
+Usage: idx2BenchLifting [NRepeats] [BrickSize]
+*/
+#include "../idx2.h"
+#include <stdio.h>
+#include <string.h>
+
+
+using namespace idx2;
+
+
+template <typename t> static void
+LiftScalar(bool Inverse, int Axis, const grid& Grid, const v3i& M3, volume* Vol)
+{
+  switch (Axis)
+  {
+    case 0:
+      Inverse ? ILiftCdf53X<t>(Grid, M3, lift_option::Normal, Vol)
+              : FLiftCdf53X<t>(Grid, M3, lift_option::Normal, Vol);
+      break;
+    case 1:
+      Inverse ? ILiftCdf53Y<t>(Grid, M3, lift_option::Normal, Vol)
+              : FLiftCdf53Y<t>(Grid, M3, lift_option::Normal, Vol);
+      break;
+    case 2:
+      Inverse ? ILiftCdf53Z<t>(Grid, M3, lift_option::Normal, Vol)
+              : FLiftCdf53Z<t>(Grid, M3, lift_option::Normal, Vol);
+      break;
+  };
+}
+
+
+enum class lift_path
+{
+  Scalar,
+  Lines,
+  Fused
+};
+
+
+/* Run all the passes of a forward (or inverse) transform and return the time it took */
+template <typename t> static i64
+Transform(lift_path Path, bool Inverse, const transform_info& Td, const v3i& M3, volume* Vol)
+{
+  timer Timer;
+  StartTimer(&Timer);
+  idx2_For (int, J, 0, Td.StackSize)
+  {
+    int I = Inverse ? Td.StackSize - 1 - J : J;
+    if (Path == lift_path::Fused && CanFuseCdf53XYZ(Td, Inverse ? I - 2 : I, M3))
+    {
+      const auto& G = Td.StackGrids;
+      Inverse ? ILiftCdf53XYZ<t>(G[I - 2], G[I - 1], G[I], M3, lift_option::Normal, Vol)
+              : FLiftCdf53XYZ<t>(G[I], G[I + 1], G[I + 2], M3, lift_option::Normal, Vol);
+      J += 2;
+    }
+    else if (Path == lift_path::Scalar)
+    {
+      LiftScalar<t>(Inverse, Td.StackAxes[I], Td.StackGrids[I], M3, Vol);
+    }
+    else
+    {
+      Inverse ? ILiftCdf53Lines<t>(Td.StackAxes[I], Td.StackGrids[I], M3, lift_option::Normal, Vol)
+              : FLiftCdf53Lines<t>(Td.StackAxes[I], Td.StackGrids[I], M3, lift_option::Normal, Vol);
+    }
+  }
+  return ElapsedTime(&Timer);
+}
+
+
+/*
+Transform a volume of dimensions N3 with NLevels levels, where the data occupies Dims3 and the
+extrapolated samples go up to M3 (as in ExtrapolateCdf53), or Dims3 == M3 == N3 (as for the bricks)
+*/
+template <typename t> static bool
+Bench(cstr Name, const v3i& N3, const v3i& Dims3, const v3i& M3, int NLevels, int NRepeats)
+{
+  transform_info Td;
+  ComputeTransformDetails(&Td, Dims3, NLevels, EncodeTransformOrder("XYZ++"));
+  volume Vols[3]; // scalar, lines, fused
+  idx2_For (int, V, 0, 3)
+    Resize(&Vols[V], N3, dtype_traits<t>::Type);
+  u64 Seed = 12345;
+  idx2_For (i64, I, 0, Prod<i64>(N3))
+  {
+    Seed = Seed * 6364136223846793005ull + 1442695040888963407ull;
+    ((t*)Vols[0].Buffer.Data)[I] = t(i64(Seed >> 11) % 2000001 - 1000000) / t(1000000);
+  }
+  idx2_For (int, V, 1, 3)
+    memcpy(Vols[V].Buffer.Data, Vols[0].Buffer.Data, Size(Vols[0].Buffer));
+
+  i64 Times[3][2] = {}; // [scalar/lines/fused][forward/inverse]
+  bool Same = true;
+  idx2_For (int, R, 0, NRepeats)
+  {
+    idx2_For (int, Inverse, 0, 2)
+    {
+      idx2_For (int, V, 0, 3)
+        Times[V][Inverse] += Transform<t>(lift_path(V), Inverse, Td, M3, &Vols[V]);
+      idx2_For (int, V, 1, 3)
+        Same = Same && memcmp(Vols[0].Buffer.Data, Vols[V].Buffer.Data, Size(Vols[0].Buffer)) == 0;
+    }
+  }
+  idx2_For (int, Inverse, 0, 2)
+  {
+    printf("%-12s %-4s %-7s scalar %8.2f ms   lines %8.2f ms (x%.2f)   fused %8.2f ms (x%.2f)   %s\n",
+           Name,
+           dtype_traits<t>::Type == dtype::float32 ? "f32" : "f64",
+           Inverse ? "inverse" : "forward",
+           Milliseconds(Times[0][Inverse]) / NRepeats,
+           Milliseconds(Times[1][Inverse]) / NRepeats,
+           f64(Times[0][Inverse]) / f64(Max(Times[1][Inverse], i64(1))),
+           Milliseconds(Times[2][Inverse]) / NRepeats,
+           f64(Times[0][Inverse]) / f64(Max(Times[2][Inverse], i64(1))),
+           Same ? "same" : "DIFFERENT");
+  }
+  idx2_For (int, V, 0, 3)
+    Dealloc(&Vols[V]);
+  return Same;
+}
+
+
+int
+main(int Argc, char** Argv)
+{
+  int NRepeats = Argc > 1 ? atoi(Argv[1]) : 10;
+  int MaxBrickSize = Argc > 2 ? atoi(Argv[2]) : 128;
+  bool Same = true;
+  /* brick transforms (2^N + 1 samples, no extrapolation) */
+  for (int N = 32; N <= MaxBrickSize; N *= 2)
+  {
+    char Name[32];
+    snprintf(Name, sizeof(Name), "brick %d", N);
+    v3i N3(N + 1);
+    Same = Bench<f64>(Name, N3, N3, N3, 2, NRepeats) && Same;
+    Same = Bench<f32>(Name, N3, N3, N3, 2, NRepeats) && Same;
+  }
+  /* extrapolation of a partial brick */
+  v3i N3(65), Dims3(61, 50, 37);
+  Same = Bench<f64>("extrapolate", N3, Dims3, N3 - 1, 6, NRepeats) && Same;
+  Same = Bench<f32>("extrapolate", N3, Dims3, N3 - 1, 6, NRepeats) && Same;
+
+  return Same ? 0 : 1;
+}
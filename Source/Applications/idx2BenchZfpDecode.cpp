@@ -0,0 +1,185 @@
+/*
+Benchmark the group-test decoding of zfp bit planes (DecodeBitPlane) against the bit-by-bit loop it
+replaced, and check that both decode the same bit planes. The streams are made the same way as the
+encoder makes its chunks: the 4x4x4 blocks of a field are quantized, zfp transformed and shuffled,
+then bit plane B of every block goes to the stream of bit plane B.
+Usage: idx2BenchZfpDecode [NRepeats] [RawFile NX NY NZ float32|float64]
+Without a file, a synthetic float64 field of 64^3 samples is used.
+*/
+#include "../idx2.h"
+#include "../Core/Function.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+
+using namespace idx2;
+
+
+/* The decoding loop that DecodeBitPlane replaced, which reads one bit at a time */
+static u64
+DecodeBitPlaneBitByBit(int NVals, i8& N, bitstream* BsIn)
+{
+  bitstream Bs = *BsIn;
+  i8 P = N;
+  u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
+  for (; N < NVals;)
+  {
+    if (Read(&Bs))
+    {
+      for (; N + 1 < NVals;)
+        if (Read(&Bs))
+          break;
+        else
+          ++N;
+      X += 1ull << (N++);
+    }
+    else
+    {
+      break;
+    }
+  }
+  *BsIn = Bs;
+  return X;
+}
+
+
+/* Encode the top NBitPlanes bit planes of all the full blocks of Vol into Streams (one per bit plane) */
+static i64
+EncodeBlocks(const volume& Vol, bool Double, int NBitPlanes, bitstream* Streams)
+{
+  const int Prec = 64 - 1 - 3;
+  v3i N3 = Dims(Vol);
+  i64 NBlocks = 0;
+  idx2_For (int, Bp, 0, 64)
+    InitWrite(&Streams[Bp], 1 << 16);
+  v3i B3;
+  idx2_BeginFor3 (B3, v3i(0), N3 / 4 * 4, v3i(4))
+  {
+    f64 Floats[64];
+    i64 Ints[64];
+    u64 UInts[64];
+    v3i S3;
+    int J = 0;
+    idx2_BeginFor3 (S3, v3i(0), v3i(4), v3i(1))
+    {
+      i64 I = Row(N3, B3 + S3);
+      Floats[J++] = Double ? ((const f64*)Vol.Buffer.Data)[I] : ((const f32*)Vol.Buffer.Data)[I];
+    }
+    idx2_EndFor3;
+    buffer_t BufFloats(Floats, 64);
+    buffer_t BufInts(Ints, 64);
+    Double ? QuantizeF64(Prec, BufFloats, &BufInts) : QuantizeF32(Prec, BufFloats, &BufInts);
+    ForwardZfp(Ints, 3);
+    ForwardShuffle(Ints, UInts, 3);
+    i8 N = 0;
+    idx2_InclusiveForBackward (int, Bp, 63, 64 - NBitPlanes)
+    {
+      GrowIfTooFull(&Streams[Bp]);
+      Encode(UInts, 64, Bp, N, &Streams[Bp]);
+    }
+    ++NBlocks;
+  }
+  idx2_EndFor3;
+  idx2_For (int, Bp, 0, 64)
+  {
+    GrowToAccomodate(&Streams[Bp], 8); // the reads go up to a word past the end
+    Flush(&Streams[Bp]);
+  }
+  return NBlocks;
+}
+
+
+/*
+Decode the bit planes of all the blocks in the order of DecodeSubband, and return the time it took.
+The decoded bit planes are hashed into Hash instead of being stored, to leave the memory traffic to
+the streams.
+*/
+template <typename decoder> static i64
+DecodeBlocks(const decoder& Decoder, bitstream* Streams, i64 NBlocks, int NBitPlanes, u64* Hash)
+{
+  bitstream Readers[64];
+  idx2_For (int, Bp, 0, 64)
+    InitRead(&Readers[Bp], ToBuffer(Streams[Bp]));
+  u64 H = 0;
+  timer Timer;
+  StartTimer(&Timer);
+  idx2_For (i64, Block, 0, NBlocks)
+  {
+    i8 N = 0;
+    idx2_InclusiveForBackward (int, Bp, 63, 64 - NBitPlanes)
+      H = H * 0x9e3779b97f4a7c15ull + Decoder(64, N, &Readers[Bp]);
+  }
+  i64 Elapsed = ElapsedTime(&Timer);
+  *Hash = H;
+  return Elapsed;
+}
+
+
+int
+main(int Argc, char** Argv)
+{
+  int NRepeats = Argc > 1 ? atoi(Argv[1]) : 10;
+  volume Vol;
+  bool Double = true;
+  if (Argc > 6)
+  {
+    v3i N3(atoi(Argv[3]), atoi(Argv[4]), atoi(Argv[5]));
+    Double = strcmp(Argv[6], "float64") == 0;
+    auto Ok = ReadVolume(Argv[2], N3, Double ? dtype::float64 : dtype::float32, &Vol);
+    if (!Ok)
+    {
+      fprintf(stderr, "%s\n", ToString(Ok));
+      return 1;
+    }
+  }
+  else
+  {
+    v3i N3(64);
+    Resize(&Vol, N3, dtype::float64);
+    v3i P3;
+    idx2_BeginFor3 (P3, v3i(0), N3, v3i(1))
+    {
+      Vol.At<f64>(P3) = sin(P3.X * 0.05) * cos(P3.Y * 0.07) + 3 * sin(P3.Z * 0.03 + P3.X * 0.01) +
+                        0.001 * sin(P3.X * P3.Y * 0.001);
+    }
+    idx2_EndFor3;
+  }
+
+  /* the top bit planes are almost empty and the bottom ones are almost noise */
+  int NBitPlanes = Double ? 64 : 32;
+  bitstream Streams[64];
+  i64 NBlocks = EncodeBlocks(Vol, Double, NBitPlanes, Streams);
+  i64 NBits = 0;
+  idx2_For (int, Bp, 0, 64)
+    NBits += BitSize(Streams[Bp]);
+
+  /* the lambdas let the decoders be inlined, as they are in Decode */
+  auto Old = [](int NVals, i8& N, bitstream* Bs) { return DecodeBitPlaneBitByBit(NVals, N, Bs); };
+  auto New = [](int NVals, i8& N, bitstream* Bs) { return DecodeBitPlane(NVals, N, Bs); };
+  i64 TimeOld = 0, TimeNew = 0;
+  bool Same = true;
+  idx2_For (int, R, 0, NRepeats)
+  {
+    u64 HashOld = 0, HashNew = 0;
+    TimeOld += DecodeBlocks(Old, Streams, NBlocks, NBitPlanes, &HashOld);
+    TimeNew += DecodeBlocks(New, Streams, NBlocks, NBitPlanes, &HashNew);
+    Same = Same && HashOld == HashNew;
+  }
+
+  f64 NsToSeconds = 1e-9 / NRepeats; // per repetition
+  printf("%lld blocks, %d bit planes, %.2f Mbit\n", (long long)NBlocks, NBitPlanes, NBits * 1e-6);
+  printf("bit by bit     %8.2f ms   %8.2f Mbit/s\n",
+         Milliseconds(TimeOld) / NRepeats,
+         NBits * 1e-6 / (NsToSeconds * f64(TimeOld)));
+  printf("DecodeBitPlane %8.2f ms   %8.2f Mbit/s   (x%.2f)   %s\n",
+         Milliseconds(TimeNew) / NRepeats,
+         NBits * 1e-6 / (NsToSeconds * f64(TimeNew)),
+         f64(TimeOld) / f64(Max(TimeNew, i64(1))),
+         Same ? "same" : "DIFFERENT");
+
+  idx2_For (int, Bp, 0, 64)
+    Dealloc(&Streams[Bp]);
+  Dealloc(&Vol);
+  return Same ? 0 : 1;
+}
@@ -37,9 +37,11 @@
 #include "idx2Common.h"
 #include "idx2Decode.h"
 #include "idx2Encode.h"
+#include "idx2FooterIndex.h"
 #include "idx2Lookup.h"
 #include "v2/idx2Common_v2.h"
 #include "VarInt.h"
 #include "Volume.h"
 #include "Wavelet.h"
+#include "WorkStealing.h"
 #include "Zfp.h"
@@ -172,8 +172,11 @@ ReadLines(FILE* Fp, array<stack_array<char, N>>* Lines)
       return;
 
     stref Src(Temp);
-    if (Temp[Src.Size - 1] == '\n')
-      Temp[Src.Size - 2] = 0; // override the new line character
+    // override the new line characters ("\n" or "\r\n")
+    while (Src.Size > 0 && (Temp[Src.Size - 1] == '\n' || Temp[Src.Size - 1] == '\r'))
+      Temp[--Src.Size] = 0;
+    if (Src.Size == 0) // skip empty lines
+      continue;
     PushBack(Lines);
     stref Dst(Back(*Lines).Arr, N);
     Copy(Src, &Dst, true);
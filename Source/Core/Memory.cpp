@@ -1,5 +1,6 @@
 #include "Memory.h"
 #include "Assert.h"
+#include <atomic>
 #include <string.h>
 
 // TODO: some of these functions can be made inline
@@ -249,6 +250,167 @@ free_list_allocator::DeallocAll()
 }
 
 
+concurrent_free_list_allocator::concurrent_free_list_allocator() = default;
+
+
+concurrent_free_list_allocator::concurrent_free_list_allocator(i64 Bytes, allocator* ParentIn)
+  : MinBytes(Bytes)
+  , MaxBytes(Bytes)
+  , Parent(ParentIn)
+{
+}
+
+
+/* The cache of the calling thread */
+static int
+ThreadCache()
+{
+  static std::atomic<int> NextCache = 0;
+  static thread_local int Cache = NextCache++ % concurrent_free_list_allocator::NCaches;
+  return Cache;
+}
+
+
+bool
+concurrent_free_list_allocator::Alloc(buffer* Buf, i64 Bytes)
+{
+  idx2_Assert(Parent);
+  if (Bytes < MinBytes || Bytes > MaxBytes)
+  {
+    bool Result = Parent->Alloc(Buf, Bytes);
+    Buf->Alloc = this;
+    return Result;
+  }
+
+  cache& C = Caches[ThreadCache()];
+  node* Node = nullptr;
+  {
+    std::unique_lock<std::mutex> Lock(C.Mutex);
+    if (C.Head)
+    {
+      Node = C.Head;
+      C.Head = Node->Next;
+      --C.Count;
+    }
+  }
+  if (!Node)
+  { // refill the cache from the depot
+    node* Batch = nullptr;
+    int NBatch = 0;
+    {
+      std::unique_lock<std::mutex> Lock(DepotMutex);
+      for (; Depot && NBatch < BatchSize; ++NBatch)
+      {
+        node* Next = Depot->Next;
+        Depot->Next = Batch;
+        Batch = Depot;
+        Depot = Next;
+      }
+    }
+    if (Batch)
+    {
+      Node = Batch;
+      std::unique_lock<std::mutex> Lock(C.Mutex);
+      for (node* N = Batch->Next; N;)
+      {
+        node* Next = N->Next;
+        N->Next = C.Head;
+        C.Head = N;
+        ++C.Count;
+        N = Next;
+      }
+    }
+  }
+  if (!Node)
+  {
+    bool Result = Parent->Alloc(Buf, MaxBytes);
+    Buf->Bytes = Bytes;
+    Buf->Alloc = this;
+    return Result;
+  }
+
+  Buf->Data = (byte*)Node;
+  Buf->Bytes = Bytes;
+  Buf->Alloc = this;
+  return true;
+}
+
+
+void
+concurrent_free_list_allocator::Dealloc(buffer* Buf)
+{
+  idx2_Assert(Parent);
+  if (Buf->Bytes < MinBytes || Buf->Bytes > MaxBytes)
+  {
+    Parent->Dealloc(Buf);
+    return;
+  }
+
+  node* Node = (node*)(Buf->Data);
+  Buf->Data = nullptr;
+  Buf->Bytes = 0;
+  Buf->Alloc = nullptr;
+  cache& C = Caches[ThreadCache()];
+  node* Batch = nullptr;
+  {
+    std::unique_lock<std::mutex> Lock(C.Mutex);
+    Node->Next = C.Head;
+    C.Head = Node;
+    if (++C.Count > 2 * BatchSize)
+    { // move the excess to the depot, where the other threads can use it
+      Batch = C.Head;
+      node* Last = Batch;
+      idx2_For (int, I, 1, BatchSize)
+        Last = Last->Next;
+      C.Head = Last->Next;
+      C.Count -= BatchSize;
+      std::unique_lock<std::mutex> DepotLock(DepotMutex);
+      Last->Next = Depot;
+      Depot = Batch;
+    }
+  }
+}
+
+
+static void
+DeallocList(allocator* Parent, i64 Bytes, concurrent_free_list_allocator::node** Head)
+{
+  while (*Head)
+  {
+    auto* Next = (*Head)->Next;
+    buffer Buf((byte*)*Head, Bytes, Parent);
+    Parent->Dealloc(&Buf);
+    *Head = Next;
+  }
+}
+
+
+void
+concurrent_free_list_allocator::DeallocAll()
+{
+  if (!Parent)
+    return;
+
+  idx2_For (int, I, 0, NCaches)
+  {
+    std::unique_lock<std::mutex> Lock(Caches[I].Mutex);
+    DeallocList(Parent, MaxBytes, &Caches[I].Head);
+    Caches[I].Count = 0;
+  }
+  std::unique_lock<std::mutex> Lock(DepotMutex);
+  DeallocList(Parent, MaxBytes, &Depot);
+}
+
+
+void
+Init(concurrent_free_list_allocator* Alloc, i64 Bytes, allocator* Parent)
+{
+  Alloc->DeallocAll();
+  Alloc->MinBytes = Alloc->MaxBytes = Bytes;
+  Alloc->Parent = Parent;
+}
+
+
 fallback_allocator::fallback_allocator() = default;
 
 
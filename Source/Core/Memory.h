@@ -8,6 +8,7 @@
 
 #include "Common.h"
 #include "Macros.h"
+#include <mutex>
 #include <stdlib.h>
 
 
@@ -74,6 +75,12 @@ head of a linked list. Otherwise forward the allocation to some Parent allocator
 */
 struct free_list_allocator;
 
+/*
+A free list allocator that threads can share. Each thread allocates from and frees to its own cache
+of blocks, which exchanges blocks with a common depot in batches when it runs empty or grows large.
+*/
+struct concurrent_free_list_allocator;
+
 /*
 Try to allocate using one allocator first (the Primary), then if that fails, use another allocator
 (the Secondary).
@@ -157,6 +164,34 @@ struct free_list_allocator : public allocator
 };
 
 
+struct concurrent_free_list_allocator : public allocator
+{
+  static constexpr int NCaches = 64;  // the threads are spread over these round robin
+  static constexpr int BatchSize = 8; // number of blocks moved between a cache and the depot at once
+  struct node
+  {
+    node* Next = nullptr;
+  };
+  struct alignas(64) cache
+  {
+    std::mutex Mutex;
+    node* Head = nullptr;
+    int Count = 0;
+  };
+  cache Caches[NCaches];
+  std::mutex DepotMutex;
+  node* Depot = nullptr;
+  i64 MinBytes = 0;
+  i64 MaxBytes = 0;
+  allocator* Parent = nullptr;
+  concurrent_free_list_allocator();
+  concurrent_free_list_allocator(i64 Bytes, allocator* ParentIn = &Mallocator());
+  bool Alloc(buffer* Buf, i64 Bytes) override;
+  void Dealloc(buffer* Buf) override;
+  void DeallocAll() override;
+};
+
+
 struct fallback_allocator : public allocator
 {
   owning_allocator* Primary = nullptr;
@@ -169,6 +204,10 @@ struct fallback_allocator : public allocator
 };
 
 
+/* Return the cached blocks to the parent, then serve blocks of the given size */
+void
+Init(concurrent_free_list_allocator* Alloc, i64 Bytes, allocator* Parent = &Mallocator());
+
 void
 Clone(const buffer& Src, buffer* Dst, allocator* Alloc = &Mallocator());
 
@@ -11,6 +11,9 @@
 #include "Memory.h"
 #include "ScopeGuard.h"
 #include "CircularQueue.h"
+#include <functional>
+#include <queue>
+#include <vector>
 
 
 namespace idx2
@@ -60,6 +63,117 @@ ComputeTransformDetails(transform_info* Td, const v3i& Dims3, int NPasses, u64 T
 }
 
 
+bool
+CanFuseCdf53XYZ(const transform_info& Td, int I, const v3i& M3)
+{
+  if (I < 0 || I + 2 >= Td.StackSize)
+    return false;
+  const grid& GridZ = Td.StackGrids[I + 2];
+  idx2_For (int, A, 0, 3)
+  {
+    const grid& G = Td.StackGrids[I + A];
+    if (Td.StackAxes[I + A] != A || From(G) != From(GridZ) || Strd(G) != Strd(GridZ) || Dims(G).Z != Dims(GridZ).Z)
+      return false;
+    v3i P3 = From(G), D3 = Dims(G), S3 = Strd(G);
+    if (D3[A] < 2)
+      return false;
+    idx2_For (int, B, 0, 3) // the lines across the lifting axis must not be clamped to M3
+    {
+      if (B != A && P3[B] + S3[B] * (D3[B] - 1) > M3[B])
+        return false;
+    }
+  }
+
+  return true;
+}
+
+
+/*
+First list the steps of a level in the order of the separate passes (all the planes lifted along X
+and Y, then the Z steps, or the reverse for the inverse transform). Since each step only touches
+its own planes, the steps that share a plane must run in this order, but the others can run in any
+order. Among the steps that are ready to run, we run the one whose last plane comes first, so the
+whole level is done in one sweep from the first plane to the last.
+*/
+void
+ScheduleCdf53XYZ(bool Inverse, const grid& GridZ, const v3i& M3, lift_option Opt, array<lift_plane_op>* Ops)
+{
+  int P = From(GridZ).Z, D = Dims(GridZ).Z, S = Strd(GridZ).Z, M = M3.Z;
+  idx2_RAII(array<lift_plane_op>, Steps, Reserve(&Steps, 4 * D));
+  auto AddPlanes = [&]() {
+    idx2_For (int, J, 0, D)
+      PushBack(&Steps, lift_plane_op{ lift_step::Zero, true, P + S * J, P + S * J, P + S * J });
+  };
+  auto AddStep = [&](auto Step, int R, int A, int B) {
+    PushBack(&Steps, lift_plane_op{ Step, false, R, A, B });
+  };
+  if (Inverse)
+  {
+    ILiftCdf53Steps(P, D, S, M, Opt, AddStep);
+    AddPlanes();
+  }
+  else
+  {
+    AddPlanes();
+    FLiftCdf53Steps(P, D, S, M, Opt, AddStep);
+  }
+
+  /* list the steps that touch each plane, in order */
+  int NSteps = int(Size(Steps));
+  int NPlanes = M + 1;
+  std::vector<int> First(NPlanes + 1, 0), Next(NPlanes, 0), List;
+  auto ForEachPlane = [&Steps](int I, const auto& Func) {
+    const lift_plane_op& Op = Steps[I];
+    Func(Op.R);
+    if (Op.A != Op.R)
+      Func(Op.A);
+    if (Op.B != Op.R && Op.B != Op.A)
+      Func(Op.B);
+  };
+  idx2_For (int, I, 0, NSteps)
+    ForEachPlane(I, [&](int Z) { ++First[Z + 1]; });
+  idx2_For (int, Z, 0, NPlanes)
+    First[Z + 1] += First[Z];
+  List.resize(First[NPlanes]);
+  idx2_For (int, Z, 0, NPlanes)
+    Next[Z] = First[Z];
+  idx2_For (int, I, 0, NSteps)
+    ForEachPlane(I, [&](int Z) { List[Next[Z]++] = I; });
+  idx2_For (int, Z, 0, NPlanes)
+    Next[Z] = First[Z]; // the next step to run on each plane
+
+  /* a step is ready when it is the next step to run on all of its planes */
+  auto IsReady = [&](int I) {
+    bool Ready = true;
+    ForEachPlane(I, [&](int Z) { Ready = Ready && List[Next[Z]] == I; });
+    return Ready;
+  };
+  auto Key = [&Steps](int I) {
+    const lift_plane_op& Op = Steps[I];
+    return (i64(Max(Max(Op.R, Op.A), Op.B)) << 32) + I;
+  };
+  std::priority_queue<i64, std::vector<i64>, std::greater<i64>> Ready;
+  idx2_For (int, I, 0, NSteps)
+  {
+    if (IsReady(I))
+      Ready.push(Key(I));
+  }
+  Clear(Ops);
+  Reserve(Ops, NSteps);
+  while (!Ready.empty())
+  {
+    int I = int(Ready.top() & 0xFFFFFFFF);
+    Ready.pop();
+    PushBack(Ops, Steps[I]);
+    ForEachPlane(I, [&](int Z) {
+      if (++Next[Z] < First[Z + 1] && IsReady(List[Next[Z]]))
+        Ready.push(Key(List[Next[Z]]));
+    });
+  }
+  idx2_Assert(Size(*Ops) == NSteps);
+}
+
+
 /*
 Extrapolate a volume to (2^N+1) x (2^N+1) x (2^N+1).
 Dims3 are the dimensions of the volume, not Dims(*Vol), which has to be (2^X+1) x (2^Y+1) x (2^Z+1).
@@ -77,38 +191,38 @@ ExtrapolateCdf53(const v3i& Dims3, u64 TransformOrder, volume* Vol)
 }
 
 
-void
-ForwardCdf53(const v3i& M3,
-             int Iter,
-             const array<subband>& Subbands,
-             const transform_info& TransformDetails,
-             volume* Vol,
-             bool CoarsestLevel)
+/* Run the lifting passes of Td on Vol */
+static void
+ForwardLiftCdf53(const transform_info& TransformDetails, const v3i& M3, volume* Vol)
 {
-  idx2_For (int, I, 0, TransformDetails.StackSize)
+  const auto& Grids = TransformDetails.StackGrids;
+  for (int I = 0; I < TransformDetails.StackSize; ++I)
   {
+    if (TransformDetails.FuseLevels && CanFuseCdf53XYZ(TransformDetails, I, M3))
+    {
+#define Body(type) FLiftCdf53XYZ<type>(Grids[I], Grids[I + 1], Grids[I + 2], M3, lift_option::Normal, Vol);
+      idx2_DispatchOnType(Vol->Type);
+#undef Body
+      I += 2;
+      continue;
+    }
     int D = TransformDetails.StackAxes[I];
-#define Body(type)                                                                                 \
-  switch (D)                                                                                       \
-  {                                                                                                \
-    case 0:                                                                                        \
-      FLiftCdf53X<type>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                           \
-      break;                                                                                       \
-    case 1:                                                                                        \
-      FLiftCdf53Y<type>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                           \
-      break;                                                                                       \
-    case 2:                                                                                        \
-      FLiftCdf53Z<type>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                           \
-      break;                                                                                       \
-    default:                                                                                       \
-      idx2_Assert(false);                                                                          \
-      break;                                                                                       \
-  };
+#define Body(type) FLiftCdf53Lines<type>(D, Grids[I], M3, lift_option::Normal, Vol);
     idx2_DispatchOnType(Vol->Type);
 #undef Body
   }
+}
 
-  /* Optionally normalize */
+
+/* Scale the subbands of a forward transform (except subband 0, unless on the coarsest level) */
+static void
+NormalizeCdf53(const v3i& M3,
+               int Iter,
+               const array<subband>& Subbands,
+               const transform_info& TransformDetails,
+               volume* Vol,
+               bool CoarsestLevel)
+{
   idx2_Assert(IsFloatingPoint(Vol->Type));
   for (int I = 0; I < Size(Subbands); ++I)
   {
@@ -138,6 +252,66 @@ ForwardCdf53(const v3i& M3,
 }
 
 
+void
+ForwardCdf53(const v3i& M3,
+             int Iter,
+             const array<subband>& Subbands,
+             const transform_info& TransformDetails,
+             volume* Vol,
+             bool CoarsestLevel)
+{
+  ForwardLiftCdf53(TransformDetails, M3, Vol);
+  NormalizeCdf53(M3, Iter, Subbands, TransformDetails, Vol, CoarsestLevel);
+}
+
+
+/*
+Lifting the data (of dimensions Dims3) instead of the whole volume extrapolates it by one sample
+past its end on each axis, and only leaves the part of subband 0 past the data to extrapolate.
+ExtrapolateCdf53 does that on a copy of subband 0, which is 8 times smaller than the volume (and
+there is nothing to extrapolate when the data fills the volume but for its last sample).
+*/
+void
+ForwardCdf53WithExtrapolation(const v3i& Dims3,
+                              u64 TformOrder,
+                              int Iter,
+                              const array<subband>& Subbands,
+                              const transform_info& TransformDetails,
+                              volume* Vol,
+                              bool CoarsestLevel)
+{
+  v3i N3 = Dims(*Vol);
+  v3i M3(N3.X == 1 ? 1 : N3.X - 1, N3.Y == 1 ? 1 : N3.Y - 1, N3.Z == 1 ? 1 : N3.Z - 1);
+  idx2_Assert(Dims3 <= M3);
+  transform_info Td;
+  ComputeTransformDetails(&Td, Dims3, TransformDetails.NPasses, TformOrder);
+  Td.FuseLevels = TransformDetails.FuseLevels;
+  ForwardLiftCdf53(Td, M3, Vol);
+
+  /* extrapolate subband 0 past the (lifted) data */
+  const grid& Sb0 = Subbands[0].Grid;
+  v3i Sb0Dims3 = Dims(Sb0), DataDims3 = Dims3;
+  idx2_For (int, D, 0, 3)
+  {
+    for (int S = 1; S < Strd(Sb0)[D]; S *= 2)
+      DataDims3[D] = (DataDims3[D] + IsEven(DataDims3[D]) + 1) >> 1;
+  }
+  if (DataDims3 != Sb0Dims3)
+  {
+    idx2_RAII(volume, Coarse, Resize(&Coarse, Sb0Dims3, Vol->Type));
+#define Body(type) CopyGridExtent<type, type>(Sb0, *Vol, extent(Sb0Dims3), &Coarse);
+    idx2_DispatchOnType(Vol->Type);
+#undef Body
+    ExtrapolateCdf53(DataDims3, TformOrder, &Coarse);
+#define Body(type) CopyExtentGrid<type, type>(extent(Sb0Dims3), Coarse, Sb0, Vol);
+    idx2_DispatchOnType(Vol->Type);
+#undef Body
+  }
+
+  NormalizeCdf53(N3, Iter, Subbands, TransformDetails, Vol, CoarsestLevel);
+}
+
+
 /* The reason we need to know if the input is on the coarsest level is because we do not want
 to normalize subband 0 otherwise */
 void
@@ -177,26 +351,20 @@ InverseCdf53(const v3i& M3,
   }
 
   /* perform the inverse transform */
+  const auto& Grids = TransformDetails.StackGrids;
   int I = TransformDetails.StackSize;
   while (I-- > 0)
   {
+    if (TransformDetails.FuseLevels && CanFuseCdf53XYZ(TransformDetails, I - 2, M3))
+    {
+#define Body(type) ILiftCdf53XYZ<type>(Grids[I - 2], Grids[I - 1], Grids[I], M3, lift_option::Normal, Vol);
+      idx2_DispatchOnType(Vol->Type);
+#undef Body
+      I -= 2;
+      continue;
+    }
     int D = TransformDetails.StackAxes[I];
-#define Body(type)                                                                                 \
-  switch (D)                                                                                       \
-  {                                                                                                \
-    case 0:                                                                                        \
-      ILiftCdf53X<f64>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                            \
-      break;                                                                                       \
-    case 1:                                                                                        \
-      ILiftCdf53Y<f64>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                            \
-      break;                                                                                       \
-    case 2:                                                                                        \
-      ILiftCdf53Z<f64>(TransformDetails.StackGrids[I], M3, lift_option::Normal, Vol);                            \
-      break;                                                                                       \
-    default:                                                                                       \
-      idx2_Assert(false);                                                                          \
-      break;                                                                                       \
-  };
+#define Body(type) ILiftCdf53Lines<type>(D, Grids[I], M3, lift_option::Normal, Vol);
     idx2_DispatchOnType(Vol->Type);
 #undef Body
   }
@@ -240,25 +408,8 @@ ForwardCdf53(const v3i& Dims3,
     }
     else
     {
-#define Body(type)                                                                                 \
-  switch (D)                                                                                       \
-  {                                                                                                \
-    case 0:                                                                                        \
-      idx2_Assert(Dims3.X > 1);                                                                    \
-      FLiftCdf53X<type>(G, M3, lift_option::Normal, Vol);                                          \
-      break;                                                                                       \
-    case 1:                                                                                        \
-      idx2_Assert(Dims3.Y > 1);                                                                    \
-      FLiftCdf53Y<type>(G, M3, lift_option::Normal, Vol);                                          \
-      break;                                                                                       \
-    case 2:                                                                                        \
-      idx2_Assert(Dims3.Z > 1);                                                                    \
-      FLiftCdf53Z<type>(G, M3, lift_option::Normal, Vol);                                          \
-      break;                                                                                       \
-    default:                                                                                       \
-      idx2_Assert(false);                                                                          \
-      break;                                                                                       \
-  };
+      idx2_Assert(Dims3[D] > 1);
+#define Body(type) FLiftCdf53Lines<type>(D, G, M3, lift_option::Normal, Vol);
       idx2_DispatchOnType(Vol->Type);
 #undef Body
       R3[D] = D3[D] + IsEven(D3[D]);
@@ -382,22 +533,7 @@ InverseCdf53(const v3i& Dims3,
   while (Iteration-- > 0)
   {
     int D = StackAxes[Iteration];
-#define Body(type)                                                                                 \
-  switch (D)                                                                                       \
-  {                                                                                                \
-    case 0:                                                                                        \
-      ILiftCdf53X<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol);                       \
-      break;                                                                                       \
-    case 1:                                                                                        \
-      ILiftCdf53Y<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol);                       \
-      break;                                                                                       \
-    case 2:                                                                                        \
-      ILiftCdf53Z<f64>(StackGrids[Iteration], M3, lift_option::Normal, Vol);                       \
-      break;                                                                                       \
-    default:                                                                                       \
-      idx2_Assert(false);                                                                          \
-      break;                                                                                       \
-  };
+#define Body(type) ILiftCdf53Lines<type>(D, StackGrids[Iteration], M3, lift_option::Normal, Vol);
     idx2_DispatchOnType(Vol->Type);
 #undef Body
   }
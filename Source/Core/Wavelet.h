@@ -51,6 +51,7 @@ struct transform_info
   u64 TformOrder;
   int StackSize;
   int NPasses;
+  bool FuseLevels = false; // lift the X, Y and Z passes of each level together (see FLiftCdf53XYZ)
 };
 
 void
@@ -87,6 +88,34 @@ ILiftCdf53Y(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 template <typename t> void
 ILiftCdf53Z(const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
 
+/*
+Same as the FLiftCdf53X/Y/Z and ILiftCdf53X/Y/Z functions (along Axis = 0/1/2) and with bit-exact
+results, but the Y and Z lines of a plane are lifted together, vectorized across X (with AVX2 or
+AVX-512 when enabled, otherwise with plain loops that the compiler can vectorize). The X lines are
+lifted one at a time by the same code, which is still faster than the scalar functions.
+*/
+template <typename t> void
+FLiftCdf53Lines(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+template <typename t> void
+ILiftCdf53Lines(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol);
+
+/*
+Lift one level along X, Y and Z (the three passes are GridX, GridY and GridZ), with the same results
+as FLiftCdf53Lines along X, then Y, then Z (ILiftCdf53Lines along Z, then Y, then X), but in one
+sweep over the Z planes of the volume: a Z lifting step runs as soon as the planes it reads are
+lifted along X and Y (forward), and a plane is lifted along Y and X as soon as its Z steps are done
+(inverse), so only a few planes at a time need to stay in the cache.
+*/
+template <typename t> void
+FLiftCdf53XYZ(const grid& GridX, const grid& GridY, const grid& GridZ, const v3i& M3, lift_option Opt, volume* Vol);
+template <typename t> void
+ILiftCdf53XYZ(const grid& GridX, const grid& GridY, const grid& GridZ, const v3i& M3, lift_option Opt, volume* Vol);
+
+/* Return true if the passes I, I + 1 and I + 2 of Td are the X, Y and Z passes of one level, which
+FLiftCdf53XYZ and ILiftCdf53XYZ can lift together */
+bool
+CanFuseCdf53XYZ(const transform_info& Td, int I, const v3i& M3);
+
 
 void
 ExtrapolateCdf53(const v3i& Dims3, u64 TransformOrder, volume* Vol);
@@ -115,6 +144,20 @@ ForwardCdf53(const v3i& M3,
              const transform_info& Td,
              volume* Vol,
              bool Normalize = false);
+
+/*
+Same as ExtrapolateCdf53(Dims3, TformOrder, Vol) followed by ForwardCdf53(Dims(*Vol), ...), up to
+rounding, but without the separate extrapolation pass over the whole volume. Vol must be zero past
+Dims3.
+*/
+void
+ForwardCdf53WithExtrapolation(const v3i& Dims3,
+                              u64 TformOrder,
+                              int Iter,
+                              const array<subband>& Subbands,
+                              const transform_info& Td,
+                              volume* Vol,
+                              bool Normalize = false);
 void
 InverseCdf53(const v3i& M3,
              int Iter,
@@ -166,6 +209,10 @@ struct wav_grids
 #include "Math.h"
 #include "Memory.h"
 #include "Volume.h"
+#include <type_traits>
+#if defined(__AVX512F__) || (defined(idx2_Avx2) && defined(__AVX2__))
+#include <immintrin.h>
+#endif
 //#include <stlab/concurrency/future.hpp>
 
 
@@ -322,6 +369,494 @@ idx2_ILiftCdf53(Z, X, Y) // Y inverse lifting
 idx2_ILiftCdf53(Y, X, Z) // Z inverse lifting
 
 
+/* The SIMD vector type used to lift lines of t (Width == 1 means plain loops) */
+template <typename t> struct lift_simd
+{
+  static constexpr int Width = 1;
+};
+
+#if defined(__AVX512F__)
+template <> struct lift_simd<f64>
+{
+  using v = __m512d;
+  static constexpr int Width = 8;
+  static v Load(const f64* P) { return _mm512_loadu_pd(P); }
+  static void Store(f64* P, v A) { _mm512_storeu_pd(P, A); }
+  static v Set1(f64 A) { return _mm512_set1_pd(A); }
+  static v Add(v A, v B) { return _mm512_add_pd(A, B); }
+  static v Sub(v A, v B) { return _mm512_sub_pd(A, B); }
+  static v Mul(v A, v B) { return _mm512_mul_pd(A, B); }
+};
+template <> struct lift_simd<f32>
+{
+  using v = __m512;
+  static constexpr int Width = 16;
+  static v Load(const f32* P) { return _mm512_loadu_ps(P); }
+  static void Store(f32* P, v A) { _mm512_storeu_ps(P, A); }
+  static v Set1(f32 A) { return _mm512_set1_ps(A); }
+  static v Add(v A, v B) { return _mm512_add_ps(A, B); }
+  static v Sub(v A, v B) { return _mm512_sub_ps(A, B); }
+  static v Mul(v A, v B) { return _mm512_mul_ps(A, B); }
+};
+#elif defined(idx2_Avx2) && defined(__AVX2__)
+template <> struct lift_simd<f64>
+{
+  using v = __m256d;
+  static constexpr int Width = 4;
+  static v Load(const f64* P) { return _mm256_loadu_pd(P); }
+  static void Store(f64* P, v A) { _mm256_storeu_pd(P, A); }
+  static v Set1(f64 A) { return _mm256_set1_pd(A); }
+  static v Add(v A, v B) { return _mm256_add_pd(A, B); }
+  static v Sub(v A, v B) { return _mm256_sub_pd(A, B); }
+  static v Mul(v A, v B) { return _mm256_mul_pd(A, B); }
+};
+template <> struct lift_simd<f32>
+{
+  using v = __m256;
+  static constexpr int Width = 8;
+  static v Load(const f32* P) { return _mm256_loadu_ps(P); }
+  static void Store(f32* P, v A) { _mm256_storeu_ps(P, A); }
+  static v Set1(f32 A) { return _mm256_set1_ps(A); }
+  static v Add(v A, v B) { return _mm256_add_ps(A, B); }
+  static v Sub(v A, v B) { return _mm256_sub_ps(A, B); }
+  static v Mul(v A, v B) { return _mm256_mul_ps(A, B); }
+};
+#endif
+
+
+/*
+The lifting steps, applied to L lanes at a time (lane J of a row R is R[J * Ls]). The SIMD versions
+only handle contiguous lanes and multiply by 0.5 and 0.25, which for floating point numbers gives
+exactly the same results as dividing by 2 and 4.
+*/
+/* R0 = 2 * R1 - R2 (R0 and R1 may be the same) */
+template <typename t> idx2_Inline void
+LiftExtrapolate(t* R0, const t* R1, const t* R2, int L, i64 Ls)
+{
+  using simd = lift_simd<t>;
+  int J = 0;
+  if constexpr (simd::Width > 1)
+  {
+    for (; Ls == 1 && J + simd::Width <= L; J += simd::Width)
+    {
+      auto B = simd::Load(R1 + J);
+      simd::Store(R0 + J, simd::Sub(simd::Add(B, B), simd::Load(R2 + J)));
+    }
+  }
+  for (; J < L; ++J)
+    R0[J * Ls] = 2 * R1[J * Ls] - R2[J * Ls];
+}
+
+/* V -= (A + B) / 2 (forward predict) or V += (A + B) / 2 (inverse predict) */
+template <bool Inverse, typename t> idx2_Inline void
+LiftPredict(t* idx2_Restrict V, const t* idx2_Restrict A, const t* idx2_Restrict B, int L, i64 Ls)
+{
+  using simd = lift_simd<t>;
+  int J = 0;
+  if constexpr (simd::Width > 1)
+  {
+    auto Half = simd::Set1(t(0.5));
+    for (; Ls == 1 && J + simd::Width <= L; J += simd::Width)
+    {
+      auto P = simd::Mul(simd::Add(simd::Load(A + J), simd::Load(B + J)), Half);
+      auto X = simd::Load(V + J);
+      simd::Store(V + J, Inverse ? simd::Add(X, P) : simd::Sub(X, P));
+    }
+  }
+  for (; J < L; ++J)
+  {
+    if (Inverse)
+      V[J * Ls] += (A[J * Ls] + B[J * Ls]) / 2;
+    else
+      V[J * Ls] -= (A[J * Ls] + B[J * Ls]) / 2;
+  }
+}
+
+/* R += V / 4 (forward update) or R -= V / 4 (inverse update) */
+template <bool Inverse, typename t> idx2_Inline void
+LiftUpdate(t* idx2_Restrict R, const t* idx2_Restrict V, int L, i64 Ls)
+{
+  using simd = lift_simd<t>;
+  int J = 0;
+  if constexpr (simd::Width > 1)
+  {
+    auto Quarter = simd::Set1(t(0.25));
+    for (; Ls == 1 && J + simd::Width <= L; J += simd::Width)
+    {
+      auto U = simd::Mul(simd::Load(V + J), Quarter);
+      auto X = simd::Load(R + J);
+      simd::Store(R + J, Inverse ? simd::Sub(X, U) : simd::Add(X, U));
+    }
+  }
+  for (; J < L; ++J)
+  {
+    if (Inverse)
+      R[J * Ls] -= V[J * Ls] / 4;
+    else
+      R[J * Ls] += V[J * Ls] / 4;
+  }
+}
+
+/* R = V / 4 */
+template <typename t> idx2_Inline void
+LiftAssignQuarter(t* idx2_Restrict R, const t* idx2_Restrict V, int L, i64 Ls)
+{
+  for (int J = 0; J < L; ++J)
+    R[J * Ls] = V[J * Ls] / 4;
+}
+
+/* R = (A + B) / 2 (R and A may be the same) */
+template <typename t> idx2_Inline void
+LiftAverage(t* R, const t* A, const t* B, int L, i64 Ls)
+{
+  for (int J = 0; J < L; ++J)
+    R[J * Ls] = (A[J * Ls] + B[J * Ls]) / 2;
+}
+
+/* R = 0 */
+template <typename t> idx2_Inline void
+LiftZero(t* R, int L, i64 Ls)
+{
+  for (int J = 0; J < L; ++J)
+    R[J * Ls] = 0;
+}
+
+
+/* The steps of the lifting, which act on whole rows (see LiftStep) */
+enum class lift_step : u8
+{
+  Extrapolate,    // R = 2 * A - B
+  Predict,        // R -= (A + B) / 2
+  InversePredict, // R += (A + B) / 2
+  Update,         // R += A / 4
+  InverseUpdate,  // R -= A / 4
+  AssignQuarter,  // R = A / 4
+  Average,        // R = (A + B) / 2
+  Zero            // R = 0
+};
+
+
+/* A step known at compile time, which FLiftCdf53Steps and ILiftCdf53Steps pass to their callback */
+template <lift_step S> using lift_step_c = std::integral_constant<lift_step, S>;
+
+
+template <lift_step Step, typename t> idx2_Inline void
+LiftStep(t* R, const t* A, const t* B, int L, i64 Ls)
+{
+  if constexpr (Step == lift_step::Extrapolate)
+    LiftExtrapolate(R, A, B, L, Ls);
+  else if constexpr (Step == lift_step::Predict)
+    LiftPredict<false>(R, A, B, L, Ls);
+  else if constexpr (Step == lift_step::InversePredict)
+    LiftPredict<true>(R, A, B, L, Ls);
+  else if constexpr (Step == lift_step::Update)
+    LiftUpdate<false>(R, A, L, Ls);
+  else if constexpr (Step == lift_step::InverseUpdate)
+    LiftUpdate<true>(R, A, L, Ls);
+  else if constexpr (Step == lift_step::AssignQuarter)
+    LiftAssignQuarter(R, A, L, Ls);
+  else if constexpr (Step == lift_step::Average)
+    LiftAverage(R, A, B, L, Ls);
+  else
+    LiftZero(R, L, Ls);
+}
+
+
+/* Same as above, for a step known at run time */
+template <typename t> void
+LiftStep(lift_step Step, t* R, const t* A, const t* B, int L, i64 Ls)
+{
+  switch (Step)
+  {
+    case lift_step::Extrapolate:    LiftStep<lift_step::Extrapolate>(R, A, B, L, Ls); break;
+    case lift_step::Predict:        LiftStep<lift_step::Predict>(R, A, B, L, Ls); break;
+    case lift_step::InversePredict: LiftStep<lift_step::InversePredict>(R, A, B, L, Ls); break;
+    case lift_step::Update:         LiftStep<lift_step::Update>(R, A, B, L, Ls); break;
+    case lift_step::InverseUpdate:  LiftStep<lift_step::InverseUpdate>(R, A, B, L, Ls); break;
+    case lift_step::AssignQuarter:  LiftStep<lift_step::AssignQuarter>(R, A, B, L, Ls); break;
+    case lift_step::Average:        LiftStep<lift_step::Average>(R, A, B, L, Ls); break;
+    case lift_step::Zero:           LiftStep<lift_step::Zero>(R, A, B, L, Ls); break;
+  };
+}
+
+
+/*
+Call Step(lift_step_c<S>(), R, A, B) for the steps S of the forward lifting of a line, in the same
+order as FLiftCdf53X. R, A and B are positions along the line (the unused ones are set to R). P, D, S and M
+are the lifting axis' components of From(Grid), Dims(Grid), Strd(Grid) and M3.
+*/
+template <typename step> void
+FLiftCdf53Steps(int P, int D, int S, int M, lift_option Opt, const step& Step)
+{
+  int X0 = Min(P + S * D, M);       /* extrapolated position */
+  int X1 = Min(P + S * (D - 1), M); /* last position */
+  int X2 = P + S * (D - 2);         /* second last position */
+  int X3 = P + S * (D - 3);         /* third last position */
+  bool Ext = IsEven(D);
+  if (Ext) // store the extrapolated value at the boundary position
+    Step(lift_step_c<lift_step::Extrapolate>(), X0, X1, X2);
+  /* predict (excluding last odd position) */
+  for (int X = P + S; X < P + S * (D - 2); X += 2 * S)
+    Step(lift_step_c<lift_step::Predict>(), X, X - S, X + S);
+  if (!Ext) // no extrapolation, predict at the last odd position
+    Step(lift_step_c<lift_step::Predict>(), X2, X1, X3);
+  else if (X1 < M)
+    Step(lift_step_c<lift_step::Zero>(), X1, X1, X1);
+  /* update (excluding last odd position) */
+  if (Opt != lift_option::NoUpdate)
+  {
+    for (int X = P + S; X < P + S * (D - 2); X += 2 * S)
+    {
+      Step(lift_step_c<lift_step::Update>(), X - S, X, X - S);
+      Step(lift_step_c<lift_step::Update>(), X + S, X, X + S);
+    }
+    if (!Ext)
+    { // no extrapolation, update at the last odd position
+      Step(lift_step_c<lift_step::Update>(), X3, X2, X3);
+      if (Opt == lift_option::Normal)
+        Step(lift_step_c<lift_step::Update>(), X1, X2, X1);
+      else if (Opt == lift_option::PartialUpdateLast)
+        Step(lift_step_c<lift_step::AssignQuarter>(), X1, X2, X1);
+    }
+  }
+}
+
+
+/* Call Step(lift_step_c<S>(), R, A, B) for the steps S of the inverse lifting of a line, in the
+same order as ILiftCdf53X (see FLiftCdf53Steps) */
+template <typename step> void
+ILiftCdf53Steps(int P, int D, int S, int M, lift_option Opt, const step& Step)
+{
+  int X0 = Min(P + S * D, M);       /* extrapolated position */
+  int X1 = Min(P + S * (D - 1), M); /* last position */
+  int X2 = P + S * (D - 2);         /* second last position */
+  int X3 = P + S * (D - 3);         /* third last position */
+  bool Ext = IsEven(D);
+  /* inverse update (excluding last odd position) */
+  if (Opt != lift_option::NoUpdate)
+  {
+    for (int X = P + S; X < P + S * (D - 2); X += 2 * S)
+    {
+      Step(lift_step_c<lift_step::InverseUpdate>(), X - S, X, X - S);
+      Step(lift_step_c<lift_step::InverseUpdate>(), X + S, X, X + S);
+    }
+    if (!Ext)
+    { // no extrapolation, inverse update at the last odd position
+      Step(lift_step_c<lift_step::InverseUpdate>(), X3, X2, X3);
+      if (Opt == lift_option::Normal)
+        Step(lift_step_c<lift_step::InverseUpdate>(), X1, X2, X1);
+    }
+    else // extrapolation, need to "fix" the last position (odd)
+    {
+      Step(lift_step_c<lift_step::Average>(), X1, X0, X2);
+    }
+  }
+  /* inverse predict (excluding last odd position) */
+  for (int X = P + S; X < P + S * (D - 2); X += 2 * S)
+    Step(lift_step_c<lift_step::InversePredict>(), X, X - S, X + S);
+  if (!Ext) // no extrapolation, inverse predict at the last odd position
+    Step(lift_step_c<lift_step::InversePredict>(), X2, X1, X3);
+}
+
+
+/*
+Forward lift L lines at once, in the same order as FLiftCdf53X. Sample X of line J is at
+F[X * Pitch + J * Ls]. P, D, S and M are as in FLiftCdf53Steps.
+*/
+template <typename t> void
+FLiftCdf53Lanes(t* F, i64 Pitch, i64 Ls, int L, int P, int D, int S, int M, lift_option Opt)
+{
+  if (L == 1) // a single line (as for the X pass), where the loops over the lanes can go away
+  {
+    FLiftCdf53Steps(P, D, S, M, Opt, [=](auto Step, int R, int A, int B) {
+      LiftStep<decltype(Step)::value>(F + R * Pitch, F + A * Pitch, F + B * Pitch, 1, Ls);
+    });
+    return;
+  }
+  FLiftCdf53Steps(P, D, S, M, Opt, [=](auto Step, int R, int A, int B) {
+    LiftStep<decltype(Step)::value>(F + R * Pitch, F + A * Pitch, F + B * Pitch, L, Ls);
+  });
+}
+
+
+/* Inverse lift L lines at once, in the same order as ILiftCdf53X (see FLiftCdf53Lanes) */
+template <typename t> void
+ILiftCdf53Lanes(t* F, i64 Pitch, i64 Ls, int L, int P, int D, int S, int M, lift_option Opt)
+{
+  if (L == 1) // a single line (as for the X pass), where the loops over the lanes can go away
+  {
+    ILiftCdf53Steps(P, D, S, M, Opt, [=](auto Step, int R, int A, int B) {
+      LiftStep<decltype(Step)::value>(F + R * Pitch, F + A * Pitch, F + B * Pitch, 1, Ls);
+    });
+    return;
+  }
+  ILiftCdf53Steps(P, D, S, M, Opt, [=](auto Step, int R, int A, int B) {
+    LiftStep<decltype(Step)::value>(F + R * Pitch, F + A * Pitch, F + B * Pitch, L, Ls);
+  });
+}
+
+
+/*
+Call Lift(F, Pitch, Ls, L) on the lines of Grid along Axis that lie in the plane at position O of
+the outer axis (Z for the X and Y passes, Y for the Z pass). For the Y and Z passes, the lines of the
+plane are lifted together (their lanes go along X, so they are contiguous on the finest level). The
+X lines are lifted one at a time, since lanes across Y would be a whole row apart. The lines past M3
+are clamped to M3, as in the scalar functions, and are lifted again one at a time.
+*/
+template <typename t, typename func> void
+ForEachLiftBatchInPlane(int Axis, const grid& Grid, const v3i& M3, volume* Vol, int O, const func& Lift)
+{
+  v3i P3 = From(Grid), D3 = Dims(Grid), S3 = Strd(Grid), N3 = Dims(*Vol);
+  t* F = (t*)Vol->Buffer.Data;
+  i64 Pitch3[3] = { 1, N3.X, i64(N3.X) * N3.Y };
+  int Outer = Axis == 2 ? 1 : 2;
+  int Inner = Axis == 0 ? 1 : 0;
+  int NLanes = Min(D3[Inner], (M3[Inner] - P3[Inner]) / S3[Inner] + 1);
+  i64 Ls = S3[Inner] * Pitch3[Inner];
+  t* Base = F + Min(O, M3[Outer]) * Pitch3[Outer] + P3[Inner] * Pitch3[Inner];
+  if (Axis == 0)
+  {
+    idx2_For (int, I, 0, NLanes)
+      Lift(Base + I * Ls, Pitch3[Axis], Ls, 1);
+  }
+  else
+  {
+    Lift(Base, Pitch3[Axis], Ls, NLanes);
+  }
+  idx2_For (int, I, NLanes, D3[Inner])
+    Lift(Base + (M3[Inner] - P3[Inner]) * Pitch3[Inner], Pitch3[Axis], Ls, 1);
+}
+
+
+/* Call Lift(F, Pitch, Ls, L) on all the lines of Grid along Axis (see ForEachLiftBatchInPlane) */
+template <typename t, typename func> void
+ForEachLiftBatch(int Axis, const grid& Grid, const v3i& M3, volume* Vol, const func& Lift)
+{
+  int Outer = Axis == 2 ? 1 : 2;
+  int P = From(Grid)[Outer], D = Dims(Grid)[Outer], S = Strd(Grid)[Outer];
+  for (int O = P; O < P + S * D; O += S)
+    ForEachLiftBatchInPlane<t>(Axis, Grid, M3, Vol, O, Lift);
+}
+
+
+template <typename t> void
+FLiftCdf53Lines(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol)
+{
+  v3i P3 = From(Grid), D3 = Dims(Grid), S3 = Strd(Grid), N3 = Dims(*Vol);
+  idx2_Assert(Axis >= 0 && Axis < 3);
+  int P = P3[Axis], D = D3[Axis], S = S3[Axis], M = M3[Axis];
+  if (D == 1)
+    return;
+  idx2_Assert(M <= N3[Axis]);
+  idx2_Assert(IsPow2(S3.X) && IsPow2(S3.Y) && IsPow2(S3.Z));
+  idx2_Assert(D >= 2);
+  idx2_Assert(IsEven(P));
+  idx2_Assert(P + S * (D - 2) < M);
+  idx2_Assert(!IsEven(D) || M < N3[Axis]);
+  idx2_Unused(N3);
+  ForEachLiftBatch<t>(Axis, Grid, M3, Vol, [=](t* F, i64 Pitch, i64 Ls, int L) {
+    FLiftCdf53Lanes(F, Pitch, Ls, L, P, D, S, M, Opt);
+  });
+}
+
+
+template <typename t> void
+ILiftCdf53Lines(int Axis, const grid& Grid, const v3i& M3, lift_option Opt, volume* Vol)
+{
+  v3i P3 = From(Grid), D3 = Dims(Grid), S3 = Strd(Grid), N3 = Dims(*Vol);
+  idx2_Assert(Axis >= 0 && Axis < 3);
+  int P = P3[Axis], D = D3[Axis], S = S3[Axis], M = M3[Axis];
+  if (D == 1)
+    return;
+  idx2_Assert(M <= N3[Axis]);
+  idx2_Assert(IsPow2(S3.X) && IsPow2(S3.Y) && IsPow2(S3.Z));
+  idx2_Assert(D >= 2);
+  idx2_Assert(IsEven(P));
+  idx2_Assert(P + S * (D - 2) < M);
+  idx2_Assert(!IsEven(D) || M < N3[Axis]);
+  idx2_Unused(N3);
+  ForEachLiftBatch<t>(Axis, Grid, M3, Vol, [=](t* F, i64 Pitch, i64 Ls, int L) {
+    ILiftCdf53Lanes(F, Pitch, Ls, L, P, D, S, M, Opt);
+  });
+}
+
+
+/*
+A step of FLiftCdf53XYZ or ILiftCdf53XYZ: either the Z lifting step Step applied to the planes R, A
+and B (see LiftStep), or the lifting of plane R along X and Y.
+*/
+struct lift_plane_op
+{
+  lift_step Step;
+  bool LiftXY;
+  int R, A, B;
+};
+
+/* Order the steps so that they sweep over the planes (see FLiftCdf53XYZ) */
+void
+ScheduleCdf53XYZ(bool Inverse, const grid& GridZ, const v3i& M3, lift_option Opt, array<lift_plane_op>* Ops);
+
+
+template <typename t> void
+LiftCdf53XYZ(bool Inverse, const grid& GridX, const grid& GridY, const grid& GridZ, const v3i& M3, lift_option Opt, volume* Vol)
+{
+  array<lift_plane_op> Ops;
+  idx2_CleanUp(Dealloc(&Ops));
+  ScheduleCdf53XYZ(Inverse, GridZ, M3, Opt, &Ops);
+
+  /* lift the lines of plane Z along Axis */
+  auto LiftLines = [&](int Axis, const grid& Grid, int Z) {
+    int P = From(Grid)[Axis], D = Dims(Grid)[Axis], S = Strd(Grid)[Axis], M = M3[Axis];
+    ForEachLiftBatchInPlane<t>(Axis, Grid, M3, Vol, Z, [=](t* F, i64 Pitch, i64 Ls, int L) {
+      if (Inverse)
+        ILiftCdf53Lanes(F, Pitch, Ls, L, P, D, S, M, Opt);
+      else
+        FLiftCdf53Lanes(F, Pitch, Ls, L, P, D, S, M, Opt);
+    });
+  };
+
+  v3i P3 = From(GridZ), D3 = Dims(GridZ), S3 = Strd(GridZ), N3 = Dims(*Vol);
+  t* F = (t*)Vol->Buffer.Data;
+  i64 Pitch = i64(N3.X) * N3.Y;
+  idx2_For (i64, I, 0, Size(Ops))
+  {
+    const lift_plane_op& Op = Ops[I];
+    if (Op.LiftXY && !Inverse)
+    {
+      LiftLines(0, GridX, Op.R);
+      LiftLines(1, GridY, Op.R);
+    }
+    else if (Op.LiftXY)
+    {
+      LiftLines(1, GridY, Op.R);
+      LiftLines(0, GridX, Op.R);
+    }
+    else
+    {
+      idx2_For (int, Y, 0, D3.Y)
+      {
+        t* Row = F + i64(P3.Y + S3.Y * Y) * N3.X + P3.X;
+        LiftStep(Op.Step, Row + Op.R * Pitch, Row + Op.A * Pitch, Row + Op.B * Pitch, D3.X, S3.X);
+      }
+    }
+  }
+}
+
+
+template <typename t> void
+FLiftCdf53XYZ(const grid& GridX, const grid& GridY, const grid& GridZ, const v3i& M3, lift_option Opt, volume* Vol)
+{
+  LiftCdf53XYZ<t>(false, GridX, GridY, GridZ, M3, Opt, Vol);
+}
+
+
+template <typename t> void
+ILiftCdf53XYZ(const grid& GridX, const grid& GridY, const grid& GridZ, const v3i& M3, lift_option Opt, volume* Vol)
+{
+  LiftCdf53XYZ<t>(true, GridX, GridY, GridZ, M3, Opt, Vol);
+}
+
+
 } // namespace idx2
 
 #undef idx2_FLiftCdf53
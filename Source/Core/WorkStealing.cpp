@@ -0,0 +1,212 @@
+#include "WorkStealing.h"
+#include "Assert.h"
+#include "Macros.h"
+#include "Math.h"
+#include <memory>
+
+
+namespace idx2
+{
+
+
+/* The pool and the queue of the worker running on this thread (if any) */
+static thread_local work_stealing_pool* CurrentPool_ = nullptr;
+static thread_local int CurrentQueue_ = -1;
+
+
+/* Take the newest task of the worker's own queue, or else the oldest task of another queue (a
+thread outside of the pool has no queue and passes Worker = -1) */
+static bool
+PopTask(work_stealing_pool* Pool, int Worker, std::function<void()>* Task)
+{
+  if (Worker >= 0)
+  {
+    work_queue& Q = Pool->Queues[Worker];
+    std::unique_lock<std::mutex> Lock(Q.Mutex);
+    if (!Q.Tasks.empty())
+    {
+      *Task = std::move(Q.Tasks.back());
+      Q.Tasks.pop_back();
+      --Pool->NQueued;
+      return true;
+    }
+  }
+  idx2_For (int, I, 0, Pool->NThreads)
+  {
+    int Victim = (Max(Worker, 0) + I) % Pool->NThreads;
+    if (Victim == Worker)
+      continue;
+    work_queue& Q = Pool->Queues[Victim];
+    std::unique_lock<std::mutex> Lock(Q.Mutex);
+    if (!Q.Tasks.empty())
+    {
+      *Task = std::move(Q.Tasks.front());
+      Q.Tasks.pop_front();
+      --Pool->NQueued;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static void
+RunTask(work_stealing_pool* Pool, std::function<void()>* Task)
+{
+  (*Task)();
+  *Task = nullptr; // release the captures before reporting the task as done
+  if (--Pool->NPending == 0)
+  {
+    std::unique_lock<std::mutex> Lock(Pool->Mutex);
+    Pool->AllTasksDone.notify_all();
+  }
+}
+
+
+static void
+WorkerLoop(work_stealing_pool* Pool, int Worker)
+{
+  CurrentPool_ = Pool;
+  CurrentQueue_ = Worker;
+  std::function<void()> Task;
+  while (true)
+  {
+    if (PopTask(Pool, Worker, &Task))
+    {
+      RunTask(Pool, &Task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> Lock(Pool->Mutex);
+    Pool->TaskAvailable.wait(Lock, [Pool] { return Pool->Stop || Pool->NQueued > 0; });
+    if (Pool->Stop && Pool->NQueued == 0)
+      return;
+  }
+}
+
+
+void
+Init(work_stealing_pool* Pool, int NThreads)
+{
+  if (NThreads <= 0)
+    NThreads = Max(int(std::thread::hardware_concurrency()), 1);
+  Pool->NThreads = NThreads;
+  Pool->Stop = false;
+  Pool->Queues = new work_queue[NThreads];
+  Pool->Threads = new std::thread[NThreads];
+  idx2_For (int, I, 0, NThreads)
+    Pool->Threads[I] = std::thread(WorkerLoop, Pool, I);
+}
+
+
+void
+Dealloc(work_stealing_pool* Pool)
+{
+  if (!Pool->Threads)
+    return;
+
+  WaitForTasks(Pool);
+  {
+    std::unique_lock<std::mutex> Lock(Pool->Mutex);
+    Pool->Stop = true;
+  }
+  Pool->TaskAvailable.notify_all();
+  idx2_For (int, I, 0, Pool->NThreads)
+    Pool->Threads[I].join();
+  delete[] Pool->Threads;
+  delete[] Pool->Queues;
+  Pool->Threads = nullptr;
+  Pool->Queues = nullptr;
+  Pool->NThreads = 0;
+}
+
+
+void
+Push(work_stealing_pool* Pool, std::function<void()>&& Task)
+{
+  idx2_Assert(Pool->Threads);
+  int Worker = CurrentPool_ == Pool ? CurrentQueue_ : int(Pool->NextQueue++ % Pool->NThreads);
+  ++Pool->NPending;
+  {
+    work_queue& Q = Pool->Queues[Worker];
+    std::unique_lock<std::mutex> Lock(Q.Mutex);
+    Q.Tasks.push_back(std::move(Task));
+    ++Pool->NQueued;
+  }
+  std::unique_lock<std::mutex> Lock(Pool->Mutex); // so that no worker misses the notification
+  Pool->TaskAvailable.notify_one();
+}
+
+
+void
+WaitForTasks(work_stealing_pool* Pool)
+{
+  std::unique_lock<std::mutex> Lock(Pool->Mutex);
+  Pool->AllTasksDone.wait(Lock, [Pool] { return Pool->NPending == 0; });
+}
+
+
+/* The ranges of one ParallelFor, shared by the calling thread and the helper tasks it pushes */
+struct parallel_for_state
+{
+  std::atomic<i64> NextRange = 0;
+  std::atomic<i64> NRangesDone = 0;
+  std::mutex Mutex;
+  std::condition_variable AllRangesDone;
+};
+
+
+/* Run the ranges not taken yet, until there are none left */
+static void
+RunRanges(parallel_for_state* State,
+          i64 Begin,
+          i64 End,
+          i64 Grain,
+          i64 NRanges,
+          const std::function<void(i64, i64)>& Func)
+{
+  for (i64 R = State->NextRange++; R < NRanges; R = State->NextRange++)
+  {
+    i64 From = Begin + R * Grain, To = Min(From + Grain, End);
+    Func(From, To);
+    if (++State->NRangesDone == NRanges)
+    {
+      std::unique_lock<std::mutex> Lock(State->Mutex);
+      State->AllRangesDone.notify_all();
+    }
+  }
+}
+
+
+void
+ParallelFor(work_stealing_pool* Pool, i64 Begin, i64 End, i64 Grain, const std::function<void(i64, i64)>& Func)
+{
+  Grain = Max(Grain, i64(1));
+  i64 NRanges = (End - Begin + Grain - 1) / Grain;
+  if (NRanges <= 1 || !Pool->Threads)
+  {
+    if (End > Begin)
+      Func(Begin, End);
+    return;
+  }
+
+  /* the helpers only touch Func after taking a range, and a helper that runs after all the ranges
+  are taken returns right away, which is why only the state has to outlive this call */
+  auto State = std::make_shared<parallel_for_state>();
+  i64 NHelpers = Min(NRanges - 1, i64(Pool->NThreads));
+  idx2_For (i64, H, 0, NHelpers)
+  {
+    Push(Pool, [State, &Func, Begin, End, Grain, NRanges]() {
+      RunRanges(State.get(), Begin, End, Grain, NRanges, Func);
+    });
+  }
+  RunRanges(State.get(), Begin, End, Grain, NRanges, Func);
+
+  /* the ranges left are being run by the helpers, which do not depend on this thread */
+  std::unique_lock<std::mutex> Lock(State->Mutex);
+  State->AllRangesDone.wait(Lock, [&State, NRanges] { return State->NRangesDone == NRanges; });
+}
+
+
+} // namespace idx2
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+namespace idx2
+{
+
+
+/* The tasks of one worker. The owner pushes and pops at the back, thieves take from the front. */
+struct work_queue
+{
+  std::mutex Mutex;
+  std::deque<std::function<void()>> Tasks;
+};
+
+
+/*
+A thread pool where each worker has its own queue. A task pushed from a worker goes to that
+worker's queue and is run before the older tasks (so a tree of tasks is walked depth first), while
+the idle workers steal the oldest tasks of the others (which tend to be the largest subtrees).
+*/
+struct work_stealing_pool
+{
+  work_queue* Queues = nullptr;
+  std::thread* Threads = nullptr;
+  int NThreads = 0;
+  std::atomic<i64> NQueued = 0;  // tasks in the queues
+  std::atomic<i64> NPending = 0; // tasks pushed but not finished
+  std::atomic<u32> NextQueue = 0; // where the tasks pushed from outside of the pool go
+  std::mutex Mutex;
+  std::condition_variable TaskAvailable;
+  std::condition_variable AllTasksDone;
+  bool Stop = false;
+};
+
+
+/* Start the workers (one per hardware thread if NThreads <= 0) */
+void
+Init(work_stealing_pool* Pool, int NThreads = 0);
+
+/* Wait for the tasks already pushed then stop the workers */
+void
+Dealloc(work_stealing_pool* Pool);
+
+void
+Push(work_stealing_pool* Pool, std::function<void()>&& Task);
+
+/* Block until all the tasks (including the ones pushed by other tasks) have finished */
+void
+WaitForTasks(work_stealing_pool* Pool);
+
+/*
+Split [Begin, End) into ranges of at most Grain elements, run Func(From, To) on each of them on the
+pool, and return once all of them are done. The calling thread runs the ranges that no worker has
+taken yet, then blocks until the others are done, so this can be called from within a task.
+*/
+void
+ParallelFor(work_stealing_pool* Pool, i64 Begin, i64 End, i64 Grain, const std::function<void(i64, i64)>& Func);
+
+
+} // namespace idx2
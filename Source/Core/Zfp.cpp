@@ -1,6 +1,7 @@
 #include "Zfp.h"
 #include "Algorithm.h"
 #include "BitStream.h"
+#include <string.h>
 
 
 namespace idx2
@@ -207,4 +208,188 @@ Decode(u64* Block, int B, i64 S, i8& N, i8& M, bitstream* Bs)
 }
 
 
+#if defined(idx2_Avx2) && defined(__AVX2__)
+/* Transpose 4 groups of 4 i64 in place (rows to lanes, or lanes to rows) */
+static idx2_Inline void
+Transpose4x4(__m256i* V)
+{
+  __m256i T0 = _mm256_unpacklo_epi64(V[0], V[1]), T1 = _mm256_unpackhi_epi64(V[0], V[1]);
+  __m256i T2 = _mm256_unpacklo_epi64(V[2], V[3]), T3 = _mm256_unpackhi_epi64(V[2], V[3]);
+  V[0] = _mm256_permute2x128_si256(T0, T2, 0x20);
+  V[1] = _mm256_permute2x128_si256(T1, T3, 0x20);
+  V[2] = _mm256_permute2x128_si256(T0, T2, 0x31);
+  V[3] = _mm256_permute2x128_si256(T1, T3, 0x31);
+}
+
+
+/* Load the 64 coefficients of 4 blocks so that V[I] holds coefficient I of all the blocks */
+template <typename t> static idx2_Inline void
+LoadBatch(const t* const* Blocks, __m256i* V)
+{
+  for (int I = 0; I < 64; I += 4)
+  {
+    idx2_For (int, B, 0, 4)
+      V[I + B] = _mm256_loadu_si256((const __m256i*)(Blocks[B] + I));
+    Transpose4x4(V + I);
+  }
+}
+
+
+/* The inverse of LoadBatch (V is destroyed) */
+template <typename t> static idx2_Inline void
+StoreBatch(__m256i* V, t* const* Blocks)
+{
+  for (int I = 0; I < 64; I += 4)
+  {
+    Transpose4x4(V + I);
+    idx2_For (int, B, 0, 4)
+      _mm256_storeu_si256((__m256i*)(Blocks[B] + I), V[I + B]);
+  }
+}
+
+
+/* Arithmetic shift right by one of i64 lanes (AVX2 has no _mm256_srai_epi64) */
+static idx2_Inline __m256i
+Sra1(__m256i X)
+{
+  const __m256i Sign = _mm256_set1_epi64x(i64(1ull << 63));
+  return _mm256_or_si256(_mm256_srli_epi64(X, 1), _mm256_and_si256(X, Sign));
+}
+
+
+/* FLift on vectors of i64 */
+static idx2_Inline void
+FLiftAvx2(__m256i* P, int S)
+{
+  __m256i X = P[0 * S], Y = P[1 * S], Z = P[2 * S], W = P[3 * S];
+  X = Sra1(_mm256_add_epi64(X, W));
+  W = _mm256_sub_epi64(W, X);
+  Z = Sra1(_mm256_add_epi64(Z, Y));
+  Y = _mm256_sub_epi64(Y, Z);
+  X = Sra1(_mm256_add_epi64(X, Z));
+  Z = _mm256_sub_epi64(Z, X);
+  W = Sra1(_mm256_add_epi64(W, Y));
+  Y = _mm256_sub_epi64(Y, W);
+  W = _mm256_add_epi64(W, Sra1(Y));
+  Y = _mm256_sub_epi64(Y, Sra1(W));
+  P[0 * S] = X;
+  P[1 * S] = Y;
+  P[2 * S] = Z;
+  P[3 * S] = W;
+}
+
+
+/* ILift on vectors of i64 */
+static idx2_Inline void
+ILiftAvx2(__m256i* P, int S)
+{
+  __m256i X = P[0 * S], Y = P[1 * S], Z = P[2 * S], W = P[3 * S];
+  Y = _mm256_add_epi64(Y, Sra1(W));
+  W = _mm256_sub_epi64(W, Sra1(Y));
+  Y = _mm256_add_epi64(Y, W);
+  W = _mm256_sub_epi64(_mm256_slli_epi64(W, 1), Y);
+  Z = _mm256_add_epi64(Z, X);
+  X = _mm256_sub_epi64(_mm256_slli_epi64(X, 1), Z);
+  Y = _mm256_add_epi64(Y, Z);
+  Z = _mm256_sub_epi64(_mm256_slli_epi64(Z, 1), Y);
+  W = _mm256_add_epi64(W, X);
+  X = _mm256_sub_epi64(_mm256_slli_epi64(X, 1), W);
+  P[0 * S] = X;
+  P[1 * S] = Y;
+  P[2 * S] = Z;
+  P[3 * S] = W;
+}
+#endif
+
+
+void
+ForwardZfpBatch(const i64* const* IBlocks, u64* const* UBlocks, int NBlocks)
+{
+  idx2_Assert(NBlocks > 0 && NBlocks <= ZfpBatchSize);
+#if defined(idx2_Avx2) && defined(__AVX2__)
+  /* the missing blocks repeat the first block and their results are discarded */
+  u64 Discard[ZfpBatchSize - 1][64];
+  const i64* Ins[ZfpBatchSize];
+  u64* Outs[ZfpBatchSize];
+  idx2_For (int, B, 0, ZfpBatchSize)
+  {
+    Ins[B] = B < NBlocks ? IBlocks[B] : IBlocks[0];
+    Outs[B] = B < NBlocks ? UBlocks[B] : Discard[B - 1];
+  }
+  __m256i V[64], U[64];
+  LoadBatch(Ins, V);
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      FLiftAvx2(V + 4 * Y + 16 * Z, 1);
+  /* transform along Y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      FLiftAvx2(V + 16 * Z + 1 * X, 4);
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      FLiftAvx2(V + 1 * X + 4 * Y, 16);
+  /* reorder and convert to negabinary */
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; ++I)
+    U[I] = _mm256_xor_si256(_mm256_add_epi64(V[Perm3[I]], Mask), Mask);
+  StoreBatch(U, Outs);
+#else
+  idx2_For (int, B, 0, NBlocks)
+  {
+    i64 Block[64];
+    memcpy(Block, IBlocks[B], sizeof(Block));
+    ForwardZfp(Block, 3);
+    ForwardShuffle(Block, UBlocks[B], 3);
+  }
+#endif
+}
+
+
+void
+InverseZfpBatch(const u64* const* UBlocks, i64* const* IBlocks, int NBlocks)
+{
+  idx2_Assert(NBlocks > 0 && NBlocks <= ZfpBatchSize);
+#if defined(idx2_Avx2) && defined(__AVX2__)
+  /* the missing blocks repeat the first block and their results are discarded */
+  i64 Discard[ZfpBatchSize - 1][64];
+  const u64* Ins[ZfpBatchSize];
+  i64* Outs[ZfpBatchSize];
+  idx2_For (int, B, 0, ZfpBatchSize)
+  {
+    Ins[B] = B < NBlocks ? UBlocks[B] : UBlocks[0];
+    Outs[B] = B < NBlocks ? IBlocks[B] : Discard[B - 1];
+  }
+  __m256i U[64], V[64];
+  LoadBatch(Ins, U);
+  /* convert from negabinary and undo the reordering */
+  const __m256i Mask = _mm256_set1_epi64x(i64(traits<u64>::NBinaryMask));
+  for (int I = 0; I < 64; ++I)
+    V[Perm3[I]] = _mm256_sub_epi64(_mm256_xor_si256(U[I], Mask), Mask);
+  /* transform along Z */
+  for (int Y = 0; Y < 4; ++Y)
+    for (int X = 0; X < 4; ++X)
+      ILiftAvx2(V + 1 * X + 4 * Y, 16);
+  /* transform along y */
+  for (int X = 0; X < 4; ++X)
+    for (int Z = 0; Z < 4; ++Z)
+      ILiftAvx2(V + 16 * Z + 1 * X, 4);
+  /* transform along X */
+  for (int Z = 0; Z < 4; ++Z)
+    for (int Y = 0; Y < 4; ++Y)
+      ILiftAvx2(V + 4 * Y + 16 * Z, 1);
+  StoreBatch(V, Outs);
+#else
+  idx2_For (int, B, 0, NBlocks)
+  {
+    u64 Block[64];
+    memcpy(Block, UBlocks[B], sizeof(Block));
+    InverseShuffle(Block, IBlocks[B], 3);
+    InverseZfp(IBlocks[B], 3);
+  }
+#endif
+}
+
+
 } // namespace idx2
@@ -67,6 +67,22 @@ template <typename t, typename u, int S> void
 InverseShuffle2D(u* UBlock, t* IBlock);
 
 
+/* Number of 3D zfp blocks that ForwardZfpBatch and InverseZfpBatch transform together */
+constexpr int ZfpBatchSize = 4;
+
+/*
+ForwardZfp(P, 3) followed by ForwardShuffle(P, U, 3) on NBlocks <= ZfpBatchSize blocks at once.
+The blocks are transposed so that each SIMD lane holds one block (and each vector holds the same
+coefficient of all blocks). IBlocks are left untouched.
+*/
+void
+ForwardZfpBatch(const i64* const* IBlocks, u64* const* UBlocks, int NBlocks);
+
+/* InverseShuffle(U, P, 3) followed by InverseZfp(P, 3) on NBlocks <= ZfpBatchSize blocks at once */
+void
+InverseZfpBatch(const u64* const* UBlocks, i64* const* IBlocks, int NBlocks);
+
+
 /* Pad partial block of width N < 4 and stride S */
 template <typename t> void
 PadBlock1D(t* P, int N, int S);
@@ -766,16 +782,15 @@ Decode(t* Block, int B, i64 S, i8& N, bitstream* Bs)
 }
 
 
-// NOTE: this is the one being used
-template <typename t> void
-Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */ i8& N, bitstream* idx2_Restrict BsIn)
+/*
+Emit the group-test codes of the bit plane X (bit I of X is the bit of coefficient I), given the
+number N of coefficients that are already significant
+*/
+idx2_Inline void
+EncodeBitPlane(u64 X, int NVals, i8& N, bitstream* idx2_Restrict BsIn)
 {
-  static_assert(is_unsigned<t>::Value);
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
-  u64 X = 0;
-  for (int I = 0; I < NVals; ++I)
-    X += u64((Block[I] >> B) & 1u) << I;
   //  i8 P = (i8)Min((i64)N, S - BitSize(Bs));
   i8 P = N;
   if (P > 0)
@@ -813,6 +828,73 @@ Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */ i8& N, bitstream* i
 }
 
 
+// NOTE: this is the one being used
+template <typename t> void
+Encode(t* idx2_Restrict Block, int NVals, int B, /*i64 S, */ i8& N, bitstream* idx2_Restrict BsIn)
+{
+  static_assert(is_unsigned<t>::Value);
+  idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
+  u64 X = 0;
+  for (int I = 0; I < NVals; ++I)
+    X += u64((Block[I] >> B) & 1u) << I;
+  EncodeBitPlane(X, NVals, N, BsIn);
+}
+
+
+#if defined(idx2_Avx2) && defined(__AVX2__)
+/*
+Transpose the 64 coefficients of a block into its 64 bit planes, so that bit I of BitPlanes[B] is bit
+B of Block[I] (the inverse of TransposeRecursive, up to the order of the bit planes). This replaces
+one call of the bit gathering loop in Encode per bit plane.
+*/
+idx2_Inline void
+TransposeBitPlanesAvx2(const u64* idx2_Restrict Block, u64* idx2_Restrict BitPlanes)
+{
+  /* gather byte K of two (Pair) then four (Quad) coefficients within each 128-bit lane */
+  const __m256i Pair = _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+                                        0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+  const __m256i Quad = _mm256_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+                                        0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+  idx2_For (int, H, 0, 2)
+  { // 32 coefficients at a time
+    /* V[I] holds byte K of the coefficients 4I to 4I + 3 in its 32-bit word K */
+    __m256i V[8];
+    idx2_For (int, I, 0, 8)
+    {
+      __m256i X = _mm256_loadu_si256((const __m256i*)(Block + 32 * H + 4 * I));
+      X = _mm256_shuffle_epi8(X, Pair);
+      X = _mm256_permute4x64_epi64(X, _MM_SHUFFLE(3, 1, 2, 0));
+      V[I] = _mm256_shuffle_epi8(X, Quad);
+    }
+    /* transpose the 8x8 32-bit words, so that T[K] holds byte K of the 32 coefficients */
+    __m256i A0 = _mm256_unpacklo_epi32(V[0], V[1]), A1 = _mm256_unpackhi_epi32(V[0], V[1]);
+    __m256i A2 = _mm256_unpacklo_epi32(V[2], V[3]), A3 = _mm256_unpackhi_epi32(V[2], V[3]);
+    __m256i A4 = _mm256_unpacklo_epi32(V[4], V[5]), A5 = _mm256_unpackhi_epi32(V[4], V[5]);
+    __m256i A6 = _mm256_unpacklo_epi32(V[6], V[7]), A7 = _mm256_unpackhi_epi32(V[6], V[7]);
+    __m256i B0 = _mm256_unpacklo_epi64(A0, A2), B1 = _mm256_unpackhi_epi64(A0, A2);
+    __m256i B2 = _mm256_unpacklo_epi64(A1, A3), B3 = _mm256_unpackhi_epi64(A1, A3);
+    __m256i B4 = _mm256_unpacklo_epi64(A4, A6), B5 = _mm256_unpackhi_epi64(A4, A6);
+    __m256i B6 = _mm256_unpacklo_epi64(A5, A7), B7 = _mm256_unpackhi_epi64(A5, A7);
+    __m256i T[8] = {
+      _mm256_permute2x128_si256(B0, B4, 0x20), _mm256_permute2x128_si256(B1, B5, 0x20),
+      _mm256_permute2x128_si256(B2, B6, 0x20), _mm256_permute2x128_si256(B3, B7, 0x20),
+      _mm256_permute2x128_si256(B0, B4, 0x31), _mm256_permute2x128_si256(B1, B5, 0x31),
+      _mm256_permute2x128_si256(B2, B6, 0x31), _mm256_permute2x128_si256(B3, B7, 0x31)
+    };
+    /* move bit J of each byte to the top and collect the top bits */
+    u32 Lo[64];
+    idx2_For (int, K, 0, 8)
+    {
+      idx2_For (int, J, 0, 8)
+        Lo[8 * K + J] = (u32)_mm256_movemask_epi8(_mm256_slli_epi64(T[K], 7 - J));
+    }
+    idx2_For (int, B, 0, 64)
+      BitPlanes[B] = H == 0 ? u64(Lo[B]) : BitPlanes[B] | (u64(Lo[B]) << 32);
+  }
+}
+#endif
+
+
 #if defined(idx2_Avx2) && defined(__AVX2__)
 template <typename t> idx2_Inline void
 TransposeAvx2(u64 X, int B, t* idx2_Restrict Block)
@@ -957,8 +1039,15 @@ TransposeAvx2(u64 X, int B, t* idx2_Restrict Block)
 #endif
 
 
-idx2_Inline void
-DecodeTest(u64* idx2_Restrict Block, int NVals, i8& N, bitstream* idx2_Restrict BsIn)
+/*
+Decode the group-test codes of a bit plane written by EncodeBitPlane, and return the bit plane (bit
+I is the bit of coefficient I). Instead of reading the bits one at a time, each group test and the
+run of insignificant coefficients after it are decoded from one word of the stream, with a count of
+trailing zeros. Only the read position is written back to BsIn (copying the whole bitstream back
+stalls on the small stores to the local copy).
+*/
+idx2_Inline u64
+DecodeBitPlane(int NVals, i8& N, bitstream* idx2_Restrict BsIn)
 {
   idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
   bitstream Bs = *BsIn;
@@ -966,22 +1055,54 @@ DecodeTest(u64* idx2_Restrict Block, int NVals, i8& N, bitstream* idx2_Restrict
   u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
   for (; N < NVals;)
   {
-    if (Read(&Bs))
+    Refill(&Bs); // at least 57 bits are available
+    u64 Bits = Bs.BitBuf >> Bs.BitPos;
+    if (!(Bits & 1u)) // the group test: no more significant coefficients
     {
-      for (; N + 1 < NVals;)
-        if (Read(&Bs))
-          break;
-        else
-          ++N;
-      X += 1ull << (N++);
+      Consume(&Bs, 1);
+      break;
+    }
+    /* skip the insignificant coefficients before the next significant one (the last coefficient
+    is significant without a bit being written for it) */
+    int Limit = NVals - 1 - N;
+    int Zeros = Lsb(Bits >> 1, 64);
+    if (Zeros < Min(Limit, 63 - Bs.BitPos))
+    { // the common case: the run ends within the word
+      Consume(&Bs, Zeros + 2);
+      N += (i8)Zeros;
     }
     else
-    {
-      break;
+    { // the run reaches the last coefficient or goes past the word
+      Consume(&Bs, 1);
+      for (; Limit > 0; Limit = NVals - 1 - N)
+      {
+        Refill(&Bs);
+        int Count = Min(Limit, 64 - Bs.BitPos);
+        u64 Run = Peek(&Bs, Count);
+        if (Run)
+        {
+          i8 RunZeros = Lsb(Run);
+          Consume(&Bs, RunZeros + 1);
+          N += RunZeros;
+          break;
+        }
+        Consume(&Bs, Count);
+        N += (i8)Count;
+      }
     }
+    X += 1ull << (N++);
   }
-  *Block = X;
-  *BsIn = Bs;
+  BsIn->BitPtr = Bs.BitPtr;
+  BsIn->BitBuf = Bs.BitBuf;
+  BsIn->BitPos = Bs.BitPos;
+  return X;
+}
+
+
+idx2_Inline void
+DecodeTest(u64* idx2_Restrict Block, int NVals, i8& N, bitstream* idx2_Restrict BsIn)
+{
+  *Block = DecodeBitPlane(NVals, N, BsIn);
 }
 
 
@@ -995,30 +1116,8 @@ Decode(t* idx2_Restrict Block,
        bool BypassDecode = false)
 {
   static_assert(is_unsigned<t>::Value);
-  idx2_Assert(NVals <= 64); // e.g. 4x4x4, 4x4, 8x8
-  bitstream Bs = *BsIn;
-  //  i8 P = (i8)Min((i64)N, S - BitSize(Bs));
-  i8 P = N;
-  u64 X = P > 0 ? ReadLong(&Bs, P) : 0;
-  for (; /*BitSize(Bs) < S &&*/ N < NVals;)
-  {
-    if (Read(&Bs))
-    {
-      for (; /*BitSize(Bs) < S &&*/ N + 1 < NVals;)
-        if (Read(&Bs))
-          break;
-        else
-          ++N;
-      // if (BitSize(Bs) >= S)
-      //   break;
-      X += 1ull << (N++);
-    }
-    else
-    {
-      break;
-    }
-  }
-    //  TransposeRecursive();
+  u64 X = DecodeBitPlane(NVals, N, BsIn);
+  //  TransposeRecursive();
 //  int K = Msb(X);
 //  if (K >= 0) {
 //    for (int I = 0; I < K; ++I)
@@ -1055,7 +1154,6 @@ Decode(t* idx2_Restrict Block,
         Block[I] += (t)(X & 1u) << B;
     #endif
   }
-  *BsIn = Bs;
 }
 
 
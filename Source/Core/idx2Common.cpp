@@ -30,7 +30,7 @@
 namespace idx2
 {
 
-free_list_allocator BrickAlloc_;
+concurrent_free_list_allocator BrickAlloc_;
 
 
 void
@@ -137,6 +137,41 @@ SetDir(idx2_file* Idx2, stref Dir)
 }
 
 
+void
+SetChunkLruCache(idx2_file* Idx2, chunk_lru_cache* Cache)
+{
+  Idx2->ChunkLruCache = Cache;
+}
+
+
+void
+SetBrickLruCache(idx2_file* Idx2, brick_lru_cache* Cache)
+{
+  Idx2->BrickLruCache = Cache;
+}
+
+
+void
+SetFooterIndex(idx2_file* Idx2, const footer_index* Index)
+{
+  Idx2->FooterIndex = Index;
+}
+
+
+void
+SetDecodeProgress(idx2_file* Idx2, decode_progress* Progress)
+{
+  Idx2->DecodeProgress = Progress;
+}
+
+
+void
+SetFusedTransform(idx2_file* Idx2, bool Fused)
+{
+  Idx2->TransformDetails.FuseLevels = Fused;
+}
+
+
 void
 SetDownsamplingFactor(idx2_file* Idx2, const v3i& DownsamplingFactor3)
 {
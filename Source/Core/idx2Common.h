@@ -64,6 +64,11 @@ namespace idx2
 
 /* ---------------------- TYPES ----------------------*/
 
+struct chunk_lru_cache;
+struct brick_lru_cache;
+struct decode_progress;
+struct footer_index;
+
 struct file_id
 {
   stref Name;
@@ -88,6 +93,8 @@ struct params
   int FilesPerDir = 64;
   int BitPlanesPerChunk = 1;
   int BitPlanesPerFile = 16;
+  i64 MemoryBudget = 0; // in bytes; if 0, the whole input file is memory mapped
+  int MaxOpenFiles = 256; // max number of output files kept open at the same time during encoding
   /* decode exclusive */
   extent DecodeExtent;
   v3i DownsamplingFactor3 = v3i(0); // DownsamplingFactor = [1, 1, 2] means half X, half Y, quarter Z
@@ -105,6 +112,15 @@ struct params
   };
   out_mode OutMode = out_mode::RegularGridMem;
   bool ParallelDecode = false;
+  bool MapFiles = false; // read the chunks through memory mappings of the data files
+  // chunks at most this many bytes apart in a file are read together (if negative, one at a time)
+  i64 MaxReadGap = i64(64) << 10;
+  int IOThreads = 4; // ParallelDecode reads chunks ahead on this many threads (0 to disable)
+  int PrefetchBricks = 0; // Decode reads the chunks of this many upcoming bricks ahead (0 to disable)
+  bool BuildFooterIndex = false; // write the footer index of the dataset before decoding
+  bool Float32Bricks = false; // decode float32 data in float32 bricks (faster but less accurate)
+  bool ParallelEncode = false;
+  bool FusedTransform = false; // lift the three axes of each level of the wavelet transform together
 };
 
 
@@ -172,6 +188,10 @@ struct idx2_file
   transform_info TransformDetailsExtrapolate; // used only for extrapolation
   stref Dir; // the directory containing the idx2 dataset
   v2d ValueRange = v2d(traits<f64>::Max, traits<f64>::Min);
+  chunk_lru_cache* ChunkLruCache = nullptr; // if set, decoded chunks are kept here across decodes
+  brick_lru_cache* BrickLruCache = nullptr; // if set, decoded bricks are kept here across decodes
+  const footer_index* FooterIndex = nullptr; // if set, the file footers are not read from the files
+  decode_progress* DecodeProgress = nullptr; // if set, Decode refines the result of the previous Decode
 
 #if VISUS_IDX2
 
@@ -185,7 +205,7 @@ struct idx2_file
 
 
 /* ---------------------- GLOBALS ----------------------*/
-extern free_list_allocator BrickAlloc_;
+extern concurrent_free_list_allocator BrickAlloc_; // used by Encode
 
 
 /* ---------------------- FUNCTIONS ----------------------*/
@@ -212,6 +232,27 @@ SetName(idx2_file* Idx2, cstr Name);
 void
 SetField(idx2_file* Idx2, cstr Field);
 
+/* Keep the decoded chunks of the dataset in Cache (owned by the caller) across decodes */
+void
+SetChunkLruCache(idx2_file* Idx2, chunk_lru_cache* Cache);
+
+/* Keep the decoded bricks in Cache (owned by the caller), so that later decodes can reuse them */
+void
+SetBrickLruCache(idx2_file* Idx2, brick_lru_cache* Cache);
+
+/* Locate the chunks using Index (owned by the caller) instead of the footers of the data files */
+void
+SetFooterIndex(idx2_file* Idx2, const footer_index* Index);
+
+/* Keep the decoded bit planes in Progress (owned by the caller), so that the next Decode only adds to them */
+void
+SetDecodeProgress(idx2_file* Idx2, decode_progress* Progress);
+
+/* Lift the X, Y and Z passes of each level of the brick transforms together (see FLiftCdf53XYZ),
+which is faster on large bricks and gives the same results */
+void
+SetFusedTransform(idx2_file* Idx2, bool Fused);
+
 void
 SetVersion(idx2_file* Idx2, const v2i& Ver);
 
@@ -23,8 +23,14 @@ void
 Init(decode_data* D, const idx2_file* Idx2, allocator* Alloc)
 {
   Init(&D->BrickPool, Idx2);
-  D->Alloc = Alloc ? Alloc : &BrickAlloc_;
+  Init(&D->BrickAlloc, Prod<i64>(Idx2->BrickDimsExt3) * SizeOf(D->BrickType));
+  D->Alloc = Alloc ? Alloc : &D->BrickAlloc;
   Init(&D->FileCacheTable);
+  Init(&D->PrefetchedChunks, 8);
+  Init(&D->PinnedChunks, 8);
+  Init(&D->PinnedChunkExps, 8);
+  idx2_For (int, I, 0, D->NFileCacheShards)
+    Init(&D->FileCacheShards[I]);
 #if VISUS_IDX2
   Init(&D->FileCache);
 #endif
@@ -34,15 +40,90 @@ Init(decode_data* D, const idx2_file* Idx2, allocator* Alloc)
 void
 Dealloc(decode_data* D)
 {
+  Dealloc(&D->ThreadPool);
+  if (D->IOThreadPool) // the remaining reads are not needed, but they refer to D
+    D->IOThreadPool->wait_for_tasks();
+  Dealloc(&D->BrickPool); // before the allocator releases the bricks it has cached
   D->Alloc->DeallocAll();
-  Dealloc(&D->BrickPool);
   DeallocFileCacheTable(&D->FileCacheTable);
+  Dealloc(&D->PrefetchedChunks);
+  idx2_ForEach (It, D->PinnedChunks)
+    Release(*It.Val);
+  Dealloc(&D->PinnedChunks);
+  idx2_ForEach (It, D->PinnedChunkExps)
+    Release(*It.Val);
+  Dealloc(&D->PinnedChunkExps);
+  idx2_For (int, I, 0, D->NFileCacheShards)
+    Dealloc(&D->FileCacheShards[I]);
 #if VISUS_IDX2
   Dealloc(&D->FileCache);
 #endif
 }
 
 
+void
+Init(decode_progress* Progress)
+{
+  Init(&Progress->Bricks, 8);
+}
+
+
+void
+Clear(decode_progress* Progress)
+{
+  idx2_ForEach (It, Progress->Bricks)
+  {
+    idx2_For (int, Sb, 0, 8)
+      Dealloc(&It.Val->Subbands[Sb]);
+  }
+  Clear(&Progress->Bricks);
+}
+
+
+void
+Dealloc(decode_progress* Progress)
+{
+  Clear(Progress);
+  Dealloc(&Progress->Bricks);
+}
+
+
+/* Return the blocks of a subband of a brick in Progress, adding them if the subband is new */
+static array<block_progress>*
+GetSubbandProgress(decode_progress* Progress, i8 Level, u64 Brick, i8 Subband, int BlockCount)
+{
+  u64 BrickKey = GetBrickKey(Level, Brick);
+  auto BrickIt = Lookup(Progress->Bricks, BrickKey);
+  if (!BrickIt)
+    Insert(&BrickIt, BrickKey, brick_progress());
+  array<block_progress>* Blocks = &BrickIt.Val->Subbands[Subband];
+  if (Size(*Blocks) == 0)
+    Resize(Blocks, BlockCount);
+  idx2_Assert(Size(*Blocks) == BlockCount);
+  return Blocks;
+}
+
+
+void
+SetReadParams(decode_data* D, const idx2_file& Idx2, const params& P)
+{
+  D->MapFiles = P.MapFiles;
+  D->MaxReadGap = P.MaxReadGap;
+  D->DecodeExtent = P.DecodeExtent;
+  // DecodeSubband stops at the first bit plane below Exponent(Tolerance) + 57 that begins a chunk
+  f64 Tolerance = Max(Idx2.Tolerance, P.DecodeTolerance);
+  D->MinBpKey = i16((Exponent(Tolerance) + 56 + BitPlaneKeyBias_) / Idx2.BitPlanesPerChunk);
+  // with Float32Bricks, float32 data is decoded and inverse transformed in float32, except for the
+  // bricks of HashMap output, which are float64 (see WriteBricks). It is off by default because the
+  // rounding in the inverse lifting costs accuracy: at full precision the max error against the
+  // source grows by up to about 67% (from 3.58e-7 to 5.96e-7 on our float32 test volumes)
+  bool Float32 = P.Float32Bricks && Idx2.DType == dtype::float32 &&
+                 P.OutMode != params::out_mode::HashMap;
+  D->BrickType = Float32 ? dtype::float32 : dtype::float64;
+  Init(&D->BrickAlloc, Prod<i64>(Idx2.BrickDimsExt3) * SizeOf(D->BrickType));
+}
+
+
 error<idx2_err_code>
 Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf);
 
@@ -78,6 +159,21 @@ DecompressBufZstd(const buffer& Input, bitstream* Output)
 }
 
 
+/* Start loading the chunks of the traversal from *Next up to (but not including) End (see Decode) */
+static void
+PrefetchUpcomingChunks(const idx2_file& Idx2,
+                       decode_data* D,
+                       i8 Level,
+                       const array<u64>& UpcomingBricks,
+                       i64 End,
+                       i64* Next)
+{
+  End = Min(End, Size(UpcomingBricks));
+  for (; *Next < End; ++*Next)
+    PrefetchBrickChunks(Idx2, D, UpcomingBricks[*Next], Level);
+}
+
+
 /* decode the subband of a brick */
 // TODO: we can detect the precision and switch to the avx2 version that uses float for better
 // performance
@@ -113,6 +209,60 @@ DecodeSubband(const idx2_file& Idx2,
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
   Clear(StreamsPtr);
 
+  /* the blocks continue from the bit planes decoded by the previous decodes */
+  array<block_progress>* Progress = nullptr;
+  if (Idx2.DecodeProgress && Idx2.BitPlanesPerChunk == 1)
+    Progress = GetSubbandProgress(Idx2.DecodeProgress, Ds.Level, Brick, Ds.Subband, BlockCount);
+  int BlockIdx = 0;
+
+  /* dequantize a block and copy its samples to the brick */
+  auto WriteBlock = [&](i64* BlockInts, i16 EMax, int NDims, const v3i& D3, const v3i& BlockDims3) {
+    const int NVals = 1 << (2 * NDims);
+    const int Prec = NBitPlanes - 1 - NDims;
+    f64 BlockFloats[4 * 4 * 4];
+    buffer_t BufFloats(BlockFloats, NVals);
+    buffer_t BufInts(BlockInts, NVals);
+    Dequantize(EMax, Prec, BufInts, &BufFloats);
+    v3i S3;
+    int J = 0;
+    v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
+    timer DataTimer;
+    StartTimer(&DataTimer);
+    volume& BVol = BrickVol->Vol;
+#define Body(type)                                                                                 \
+  idx2_BeginFor3 (S3, v3i(0), BlockDims3, v3i(1))                                                  \
+  { /* sample loop */                                                                              \
+    idx2_Assert(D3 + S3 < SbDims3);                                                                \
+    BVol.At<type>(From3, Strd3, D3 + S3) = type(BlockFloats[J++]);                                 \
+  }                                                                                                \
+  idx2_EndFor3; /* end sample loop */
+    idx2_DispatchOnFloat(BVol.Type);
+#undef Body
+    D->DataMovementTime_ += ElapsedTime(&DataTimer);
+  };
+
+  /* the significant 3D blocks are inverse zfp transformed together (see InverseZfpBatch) */
+  u64 BatchUInts[ZfpBatchSize][4 * 4 * 4];
+  i64 BatchInts[ZfpBatchSize][4 * 4 * 4];
+  v3i BatchD3s[ZfpBatchSize], BatchDims3s[ZfpBatchSize];
+  i16 BatchEMaxes[ZfpBatchSize];
+  int BatchSize = 0;
+  auto WriteBatch = [&]() {
+    if (BatchSize == 0)
+      return;
+    const u64* UBlocks[ZfpBatchSize];
+    i64* IBlocks[ZfpBatchSize];
+    idx2_For (int, B, 0, BatchSize)
+    {
+      UBlocks[B] = BatchUInts[B];
+      IBlocks[B] = BatchInts[B];
+    }
+    InverseZfpBatch(UBlocks, IBlocks, BatchSize);
+    idx2_For (int, B, 0, BatchSize)
+      WriteBlock(BatchInts[B], BatchEMaxes[B], 3, BatchD3s[B], BatchDims3s[B]);
+    BatchSize = 0;
+  };
+
   bool SubbandSignificant = false; // whether there is any significant block on this subband
   idx2_InclusiveFor (u32, Block, 0, LastBlock)
   { // zfp block loop
@@ -130,12 +280,9 @@ DecodeSubband(const idx2_file& Idx2,
 
     const int NDims = NumDims(BlockDims3);
     const int NVals = 1 << (2 * NDims);
-    const int Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts[4 * 4 * 4] = {};
-    buffer_t BufUInts(BlockUInts, Prod(BlockDims3));
+    u64 LocalUInts[4 * 4 * 4];
+    u64* BlockUInts = NDims == 3 ? BatchUInts[BatchSize] : LocalUInts;
+    Fill(BlockUInts, BlockUInts + 4 * 4 * 4, 0ull);
 
     // we read the exponent for the block
     i16 EMax = SizeOf(Idx2.DType) > 4
@@ -146,7 +293,16 @@ DecodeSubband(const idx2_file& Idx2,
     int NBitPlanesDecoded = Exponent(Tolerance) - 6 - EMax + 1;
     i8 NBps = 0;
     int Bpc = Idx2.BitPlanesPerChunk;
-    idx2_InclusiveForBackward (i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane)
+    i8 NextBp = NBitPlanes - 1;
+    block_progress* Prog = Progress ? &(*Progress)[BlockIdx++] : nullptr;
+    if (Prog)
+    {
+      memcpy(BlockUInts, Prog->UInts, sizeof(Prog->UInts));
+      N = Prog->N;
+      NBps = Prog->NBps;
+      NextBp = Prog->NextBp;
+    }
+    idx2_InclusiveForBackward (i8, Bp, NextBp, NBitPlanes - EndBitPlane)
     { // bit plane loop
       i16 RealBp = Bp + EMax;
       i16 BpKey = (RealBp + BitPlaneKeyBias_) / Bpc; // make it so that the BpKey is positive
@@ -191,18 +347,27 @@ DecodeSubband(const idx2_file& Idx2,
       if (!TooHighPrecision)
         ++NBps;
       auto SizeBegin = BitSize(*Stream);
-      if (NBitPlanesDecoded <= 8)
+      if (NBitPlanesDecoded <= 8 || Prog) // the progress keeps the bit planes in place
         Decode(BlockUInts, NVals, Bp, N, Stream, BypassDecode); // use AVX2
       else // delay the transpose of bits to later
         DecodeTest(&BlockUInts[NBitPlanes - 1 - Bp], NVals, N, Stream);
       auto SizeEnd = BitSize(*Stream);
       D->BytesDecoded_ += SizeEnd - SizeBegin;
+      NextBp = Bp - 1;
     } // end bit plane loop
 
+    if (Prog)
+    {
+      memcpy(Prog->UInts, BlockUInts, sizeof(Prog->UInts));
+      Prog->N = N;
+      Prog->NBps = NBps;
+      Prog->NextBp = NextBp;
+    }
+
     /* do inverse zfp transform but only if any bit plane is decoded */
     if (NBps > 0 && !BypassDecode)
     {
-      if (NBitPlanesDecoded > 8)
+      if (NBitPlanesDecoded > 8 && !Prog)
         TransposeRecursive(BlockUInts, NBps);
 
       // if the subband is not 0 or if this is the last level, we count this block
@@ -210,24 +375,24 @@ DecodeSubband(const idx2_file& Idx2,
       bool CurrBlockSignificant = (Ds.Subband > 0 || Ds.Level + 1 == Idx2.NLevels);
       SubbandSignificant = SubbandSignificant || CurrBlockSignificant;
       ++D->NSignificantBlocks;
-      InverseShuffle(BlockUInts, (i64*)BlockFloats, NDims);
-      InverseZfp((i64*)BlockFloats, NDims);
-      Dequantize(EMax, Prec, BufInts, &BufFloats);
-      v3i S3;
-      int J = 0;
-      v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
-      timer DataTimer;
-      StartTimer(&DataTimer);
-      volume& BVol = BrickVol->Vol;
-      idx2_BeginFor3 (S3, v3i(0), BlockDims3, v3i(1))
-      { // sample loop
-        idx2_Assert(D3 + S3 < SbDims3);
-        BVol.At<f64>(From3, Strd3, D3 + S3) = BlockFloats[J++];
+      if (NDims == 3)
+      {
+        BatchD3s[BatchSize] = D3;
+        BatchDims3s[BatchSize] = BlockDims3;
+        BatchEMaxes[BatchSize] = EMax;
+        if (++BatchSize == ZfpBatchSize)
+          WriteBatch();
+      }
+      else
+      {
+        i64 BlockInts[4 * 4 * 4];
+        InverseShuffle(BlockUInts, BlockInts, NDims);
+        InverseZfp(BlockInts, NDims);
+        WriteBlock(BlockInts, EMax, NDims, D3, BlockDims3);
       }
-      idx2_EndFor3; // end sample loop
-      D->DataMovementTime_ += ElapsedTime(&DataTimer);
     }
   }
+  WriteBatch();
   D->NInsignificantSubbands += (SubbandSignificant == false);
   //printf("%d\n", AnyBlockDecoded);
 
@@ -244,6 +409,8 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, decode_state
   auto BrickIt = Lookup(D->BrickPool.BrickTable, GetBrickKey(Level, Brick));
   idx2_Assert(BrickIt);
   volume& BVol = BrickIt.Val->Vol;
+  u64 BrickKey = GetBrickKey(Level, Brick);
+  bool Cached = Idx2.BrickLruCache && LookupBrick(Idx2.BrickLruCache, Idx2, BrickKey, Tolerance, BrickIt.Val);
 
   idx2_Assert(Size(Idx2.Subbands) <= 8);
 
@@ -290,7 +457,12 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, decode_state
       grid SbGridNonExt = S.Grid;
       SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent PGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3); // parent grid
-      CopyExtentGrid<f64, f64>(PGrid, PbIt.Val->Vol, SbGridNonExt, &BVol);
+      if (!Cached)
+      {
+#define Body(type) CopyExtentGrid<type, type>(PGrid, PbIt.Val->Vol, SbGridNonExt, &BVol);
+        idx2_DispatchOnFloat(BVol.Type);
+#undef Body
+      }
       if (Last3 == Brick3)
       { // last child
         bool DeleteBrick = true;
@@ -304,6 +476,9 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, decode_state
       }
     }
 
+    if (Cached) // the parent is still deleted after its last child above
+      continue;
+
     /* now we decode the subband */
     Ds.Subband = Sb;
     auto Result = DecodeSubband(Idx2, D, Ds, Tolerance, S.Grid, &Streams, BrickIt.Val);
@@ -313,8 +488,13 @@ DecodeBrick(const idx2_file& Idx2, const params& P, decode_data* D, decode_state
       return Error(Result);
   } // end subband loop
 
+  if (Cached)
+    return idx2_Error(idx2_err_code::NoError);
+
   bool CoarsestLevel = Level + 1 == Idx2.NLevels;
   InverseCdf53(Idx2.BrickDimsExt3, Ds.Level, Idx2.Subbands, Idx2.TransformDetails, &BVol, CoarsestLevel);
+  if (Idx2.BrickLruCache)
+    Insert(Idx2.BrickLruCache, Idx2, BrickKey, Tolerance, *BrickIt.Val);
 
   //printf("%d\n", AnySubbandDecoded);
   return idx2_Error(idx2_err_code::NoError);
@@ -354,15 +534,21 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
     OutVolMem.Type = Idx2.DType;
   }
 
-  const int BrickBytes = Prod(Idx2.BrickDimsExt3) * sizeof(f64);
-  // TODO: make the free list allocator threadsafe
-  //BrickAlloc_ = free_list_allocator(BrickBytes);
   // TODO: move the decode_data into idx2_file itself
-  //idx2_RAII(decode_data, D, Init(&D, &BrickAlloc_));
-  idx2_RAII(decode_data, D, Init(&D, &Idx2, &Mallocator())); // for now the allocator seems not a bottleneck
+  idx2_RAII(decode_data, D, Init(&D, &Idx2));
+  SetReadParams(&D, Idx2, P);
+  if (P.PrefetchBricks > 0 && P.IOThreads > 0)
+    D.IOThreadPool.reset(new BS::thread_pool(P.IOThreads));
   //  D.QualityLevel = Dw->GetQuality();
   f64 Tolerance = Max(Idx2.Tolerance, P.DecodeTolerance);
   //  i64 CountZeroes = 0;
+  if (Idx2.DecodeProgress && Idx2.DecodeProgress->DownsamplingFactor3 != Idx2.DownsamplingFactor3)
+  { // the blocks skipped by the previous decodes have no bit planes, so we start over
+    Clear(Idx2.DecodeProgress);
+    Idx2.DecodeProgress->DownsamplingFactor3 = Idx2.DownsamplingFactor3;
+  }
+  // one brick of each chunk of a level, in the order the traversal visits the chunks
+  idx2_RAII(array<u64>, UpcomingBricks, , Dealloc(&UpcomingBricks));
 
   decode_state Ds;
   idx2_InclusiveForBackward (i8, Level, Idx2.NLevels - 1, 0)
@@ -400,6 +586,25 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
     extent VolExtentInChunks(Vcf3, Vcl3 - Vcf3 + 1);
     extent VolExtentInFiles(Vff3, Vfl3 - Vff3 + 1);
 
+    /* the chunks are visited in a fixed order, so we can list them first and read them ahead */
+    i64 ChunksAhead = 0, ChunkIdx = 0, NextPrefetch = 0;
+    if (D.IOThreadPool)
+    {
+      ChunksAhead = Max(1, (P.PrefetchBricks + Idx2.BricksPerChunk[Level] - 1) / Idx2.BricksPerChunk[Level]);
+      Clear(&UpcomingBricks);
+      idx2_FileTraverse(
+        idx2_ChunkTraverse(
+          PushBack(&UpcomingBricks, GetLinearBrick(Idx2, Level, ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[Level]));
+          ,
+          64,
+          Idx2.ChunksOrderInFile[Level],
+          FileTop.FileFrom3 * Idx2.ChunksPerFile3s[Level],
+          Idx2.ChunksPerFile3s[Level],
+          ExtentInChunks,
+          VolExtentInChunks);
+        , 64, Idx2.FilesOrder[Level], v3i(0), Idx2.NFiles3[Level], ExtentInFiles, VolExtentInFiles);
+    }
+
     idx2_FileTraverse(
       //      u64 FileAddr = FileTop.Address;
       //      idx2_Assert(FileAddr == GetLinearFile(Idx2, Level, FileTop.FileFrom3));
@@ -407,14 +612,16 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
         //        u64 ChunkAddr = (FileAddr * Idx2.ChunksPerFiles[Level]) + ChunkTop.Address;
         //        idx2_Assert(ChunkAddr == GetLinearChunk(Idx2, Level, ChunkTop.ChunkFrom3));
         //D.ChunkInFile = ChunkTop.ChunkInFile;
+        if (D.IOThreadPool)
+          PrefetchUpcomingChunks(Idx2, &D, Level, UpcomingBricks, ++ChunkIdx + ChunksAhead, &NextPrefetch);
         idx2_BrickTraverse(
           Ds.BrickInChunk = Top.BrickInChunk;
           //          u64 BrickAddr = (ChunkAddr * Idx2.BricksPerChunks[Level]) + Top.Address;
           //          idx2_Assert(BrickAddr == GetLinearBrick(Idx2, Level, Top.BrickFrom3));
           brick_volume BVol;
-          Resize(&BVol.Vol, Idx2.BrickDimsExt3, dtype::float64, D.Alloc);
+          Resize(&BVol.Vol, Idx2.BrickDimsExt3, D.BrickType, D.Alloc);
           // TODO: for progressive decompression, copy the data from BrickTable to BrickVol
-          Fill(idx2_Range(f64, BVol.Vol), 0.0); // TODO: use memset
+          memset(BVol.Vol.Buffer.Data, 0, Size(BVol.Vol.Buffer));
           Ds.Level = Level;
           Ds.Brick3 = Top.BrickFrom3;
           Ds.Brick = GetLinearBrick(Idx2, Level, Top.BrickFrom3);
@@ -437,8 +644,10 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
                 P.OutMode == params::out_mode::RegularGridMem)
             {
               auto OutputVol = P.OutMode == params::out_mode::RegularGridFile ? &OutVol.Vol : &OutVolMem;
-              auto CopyFunc = OutputVol->Type == dtype::float32 ? (CopyGridGrid<f64, f32>)
-                                                                : (CopyGridGrid<f64, f64>);
+              bool F32Out = OutputVol->Type == dtype::float32;
+              auto CopyFunc = BVol.Vol.Type == dtype::float32
+                                ? (F32Out ? CopyGridGrid<f32, f32> : CopyGridGrid<f32, f64>)
+                                : (F32Out ? CopyGridGrid<f64, f32> : CopyGridGrid<f64, f64>);
               CopyFunc(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), OutputVol);
               Dealloc(&BVol);
               Delete(&D.BrickPool.BrickTable, BrickKey);
@@ -487,6 +696,10 @@ Decode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
   printf("final size of brick hashmap = %" PRIi64 "\n", Size(D.BrickPool.BrickTable));
   printf("number of significant blocks = %" PRIi64 "\n", D.NSignificantBlocks.load());
   printf("number of insignificant subbands = %" PRIi64 "\n", D.NInsignificantSubbands.load());
+  if (Idx2.ChunkLruCache)
+    PrintStatistics(Idx2.ChunkLruCache);
+  if (Idx2.BrickLruCache)
+    PrintStatistics(Idx2.BrickLruCache);
 
   return idx2_Error(err_code::NoError);
 }
@@ -5,9 +5,11 @@
 #include "idx2Common.h"
 #include "idx2Read.h"
 #include "idx2SparseBricks.h"
+#include "WorkStealing.h"
 #include "thread-pool/BS_thread_pool.hpp"
 #include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 
 
@@ -28,21 +30,66 @@ struct decode_state
 };
 
 
+/* The bit planes of a zfp block decoded so far, which the next Decode continues from */
+struct block_progress
+{
+  u64 UInts[4 * 4 * 4] = {};
+  i8 N = 0;      // number of significant coefficients so far
+  i8 NBps = 0;   // number of bit planes decoded within the tolerance
+  i8 NextBp = idx2_BitSizeOf(u64) - 1; // the next bit plane to decode
+};
+
+
+struct brick_progress
+{
+  array<block_progress> Subbands[8]; // the coded blocks of each subband, in decode order
+};
+
+
+/*
+The decoding state that Decode keeps across calls (attached with SetDecodeProgress), so that decoding
+a region again at a smaller tolerance only reads and decodes the bit planes the previous decodes did
+not. The blocks can only resume at a chunk boundary, so this requires one bit plane per chunk (the
+default); with more, the bricks are decoded from scratch. The blocks skipped because of downsampling
+are not kept, so changing the downsampling factor starts over.
+*/
+struct decode_progress
+{
+  hash_table<u64, brick_progress> Bricks; // [brick key] -> decoded blocks of the brick
+  v3i DownsamplingFactor3 = v3i(0);
+};
+
+
 struct decode_data
 {
+  static constexpr int NFileCacheShards = 64; // must be a power of two
   allocator* Alloc = nullptr;
-  file_cache_table FileCacheTable;
+  concurrent_free_list_allocator BrickAlloc; // the default Alloc, which recycles the bricks
+  dtype BrickType = dtype::float64; // float32 for float32 data with Float32Bricks (see SetReadParams)
+  file_cache_table FileCacheTable; // used by Decode
+  file_cache_shard FileCacheShards[NFileCacheShards]; // used by ParallelDecode
 #if (VISUS_IDX2)
   file_cache FileCache; // if using openvisus, we need to cache only the chunks, not the files
 #endif
   brick_pool BrickPool;
-  BS::thread_pool ThreadPool;
-
-  std::mutex FileCacheMutex;
+  work_stealing_pool ThreadPool; // runs the brick tasks of ParallelDecode
+  // loads chunks ahead of the bricks that need them (see PrefetchBrickChunks)
+  std::unique_ptr<BS::thread_pool> IOThreadPool;
+  std::mutex PrefetchMutex;
+  hash_table<u64, bool> PrefetchedChunks; // (level, chunk) keys of the chunks already prefetched
+  // chunks that Decode uses from Idx2->ChunkLruCache (or from FileCacheShards while prefetching),
+  // held until the decode ends
+  hash_table<u64, shared_chunk<chunk_cache>*> PinnedChunks;
+  hash_table<u64, shared_chunk<chunk_exp_cache>*> PinnedChunkExps;
+  bool MapFiles = false; // see params::MapFiles
+  i64 MaxReadGap = -1;    // see params::MaxReadGap
+  extent DecodeExtent;    // chunks outside of this extent are not needed
+  i16 MinBpKey = 0;       // chunks of lower bit planes are not needed
+
+  std::mutex FileCacheMutex; // only guards FileCache (when reading through external_read)
   std::mutex BrickPoolMutex;
   std::mutex Mutex;
-  std::condition_variable AllTasksDone;
-  i64 NTasks = 0;
+  error<idx2_err_code> TaskError; // the first error of the ParallelDecode tasks
 
   std::atomic<u64> DecodeIOTime_ = 0;
   std::atomic<u64> BytesExps_ = 0;
@@ -56,12 +103,27 @@ struct decode_data
 
 /* ---------------------- FUNCTIONS ----------------------*/
 
+void
+Init(decode_progress* Progress);
+
+void
+Dealloc(decode_progress* Progress);
+
+/* Forget the decoded bit planes, so that the next Decode starts from scratch */
+void
+Clear(decode_progress* Progress);
+
+/* The bricks are allocated from Alloc, or from D->BrickAlloc if it is null */
 void
 Init(decode_data* D, const idx2_file* Idx2, allocator* Alloc = nullptr);
 
 void
 Dealloc(decode_data* D);
 
+/* Set the options of the decode (e.g., how the chunks are read) from the params */
+void
+SetReadParams(decode_data* D, const idx2_file& Idx2, const params& P);
+
 void
 DecompressChunk(bitstream* ChunkStream, chunk_cache* ChunkCache, u64 ChunkAddress, int L);
 
@@ -12,7 +12,9 @@
 #include "idx2Write.h"
 #include "sexpr.h"
 #include "zstd/zstd.h"
+#include "thread-pool/BS_thread_pool.hpp"
 #include <algorithm>
+#include <vector>
 
 
 namespace idx2
@@ -37,11 +39,41 @@ CompressBufZstd(const buffer& Input, bitstream* Output)
 }
 
 
+/* Roll the channels of the current subband over to a new chunk if this brick starts one */
 static void
-EncodeBrickSubbandExponents(idx2_file* Idx2,
-                            encode_data* E,
-                            const v3i& NBlocks3,
-                            const u64 Brick)
+EncodeBrickSubbandChunks(idx2_file* Idx2, encode_data* E, const u64 Brick)
+{
+  /* done once per bit plane key, in the order the bit planes first become significant */
+  idx2_For (int, I, 0, Size(E->LastSigBlock))
+  {
+    i16 BpKey = E->LastSigBlock[I].BitPlane;
+    u32 ChannelKey = GetChannelKey(BpKey, E->Level, E->Subband);
+    auto ChannelIt = Lookup(E->Channels, ChannelKey);
+    if (!ChannelIt)
+    {
+      channel Channel;
+      Init(&Channel);
+      Insert(&ChannelIt, ChannelKey, Channel);
+    }
+    idx2_Assert(ChannelIt);
+    channel* C = ChannelIt.Val;
+
+    /* write chunk if this brick is after the last chunk */
+    bool BrickNotEmpty = Size(C->BrickStream) > 0;
+    bool NewChunk = Brick >= (C->LastChunk + 1) * Idx2->BricksPerChunk[E->Level];
+    if (NewChunk)
+    {
+      if (BrickNotEmpty)
+        WriteChunk(*Idx2, E, C, E->Level, E->Subband, BpKey);
+      C->NBricks = 0;
+      C->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunk[E->Level]);
+    }
+  }
+}
+
+
+static void
+EncodeBrickSubbandExponents(idx2_file* Idx2, encode_data* E, const u64 Brick)
 {
 
   /* query the right sub channel for the block exponents */
@@ -81,59 +113,102 @@ EncodeBrickSubbandExponents(idx2_file* Idx2,
 
 
 static void
-EncodeBrickSubbandMetadata(idx2_file* Idx2,
-                           encode_data* E,
-                           const v3i& NBlocks3,
-                           const v3i& SbDims3,
-                           const u64 Brick,
-                           const u32 LastBlock)
-{
-  /* pass 2: encode the brick meta info */
-  idx2_InclusiveFor (u32, Block, 0, LastBlock)
+EncodeBrickSubbandMetadata(encode_data* E, const u64 Brick)
+{
+  /* pass 2: encode the brick meta info, once per bit plane key */
+  idx2_For (int, I, 0, Size(E->LastSigBlock))
   {
-    v3i Z3(DecodeMorton3(Block));
-    idx2_NextMorton(Block, Z3, NBlocks3);
-    v3i D3 = Z3 * Idx2->BlockDims3;
-    v3i BlockDims3 = Min(Idx2->BlockDims3, SbDims3 - D3);
-    bool CodedInNextLevel =
-      E->Subband == 0 && E->Level + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
-    if (CodedInNextLevel)
-      continue;
-    /* done at most once per brick, by the last significant block */
-    idx2_For (int, I, 0, Size(E->LastSigBlock))
+    i16 BpKey = E->LastSigBlock[I].BitPlane;
+    u32 ChannelKey = GetChannelKey(BpKey, E->Level, E->Subband);
+    auto ChannelIt = Lookup(E->Channels, ChannelKey);
+    idx2_Assert(ChannelIt);
+    channel* C = ChannelIt.Val;
+    bitstream* Bs = &E->BlockStreams[I];
+    /* write brick delta */
+    if (C->NBricks == 0)
+    { // start of a chunk
+      GrowToAccomodate(&C->BrickDeltasStream, 8);
+      WriteVarByte(&C->BrickDeltasStream, Brick);
+    }
+    else
     {
-      i16 BpKey = E->LastSigBlock[I].BitPlane;
-      if (Block != E->LastSigBlock[I].Block)
-        continue;
-
-      u32 ChannelKey = GetChannelKey(BpKey, E->Level, E->Subband);
-      auto ChannelIt = Lookup(E->Channels, ChannelKey);
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
-      /* write brick delta */
-      if (C->NBricks == 0)
-      { // start of a chunk
-        GrowToAccomodate(&C->BrickDeltasStream, 8);
-        WriteVarByte(&C->BrickDeltasStream, Brick);
+      GrowToAccomodate(&C->BrickDeltasStream, (Brick - C->LastBrick - 1 + 8) / 8);
+      WriteUnary(&C->BrickDeltasStream, u32(Brick - C->LastBrick - 1));
+    }
+    /* write brick size */
+    i64 BrickSize = Size(*Bs);
+    GrowToAccomodate(&C->BrickSizeStream, 4);
+    WriteVarByte(&C->BrickSizeStream, BrickSize);
+    /* write brick data */
+    GrowToAccomodate(&C->BrickStream, BrickSize);
+    WriteStream(&C->BrickStream, Bs);
+    //BlockStat.Add((f64)Size(*Bs));
+    ++C->NBricks;
+    C->LastBrick = Brick;
+  } // end bit plane loop
+}
+
+
+/* zfp encode the bit planes of a block, whose transformed coefficients are in BlockUInts */
+static void
+EncodeBlockBitPlanes(idx2_file* Idx2, encode_data* E, u32 Block, i16 EMax, int NVals, u64* BlockUInts)
+{
+  const i8 NBitPlanes = idx2_BitSizeOf(u64);
+#if defined(idx2_Avx2) && defined(__AVX2__)
+  /* extract all the bit planes of the block at once (the padding coefficients are zero) */
+  u64 BitPlanes[4 * 4 * 4];
+  Fill(BlockUInts + NVals, BlockUInts + 4 * 4 * 4, 0ull);
+  TransposeBitPlanesAvx2(BlockUInts, BitPlanes);
+#endif
+
+  i8 N = 0; // number of significant coefficients in the block so far
+  i8 EndBitPlane = Min(i8(BitSizeOf(Idx2->DType)), NBitPlanes);
+  int Bpc = Idx2->BitPlanesPerChunk;
+  idx2_InclusiveForBackward (i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane)
+  { // bit plane loop
+    i16 RealBp = Bp + EMax;
+    i16 BpKey = (RealBp + BitPlaneKeyBias_) / Bpc; // make it so that the BpKey is positive
+    bool TooHighPrecision = NBitPlanes - 6 > RealBp - Exponent(Idx2->Tolerance) + 1;
+    if (TooHighPrecision)
+    {
+      if ((RealBp + BitPlaneKeyBias_) % Bpc == 0) // make sure we encode full "block" of BpKey
+        break;
+    }
+
+    /* record the last significant block on this bit plane */
+    int I = 0;
+    for (; I < Size(E->LastSigBlock); ++I)
+    {
+      if (E->LastSigBlock[I].BitPlane == BpKey)
+      {
+        idx2_Assert(Block > E->LastSigBlock[I].Block);
+        E->LastSigBlock[I].Block = Block;
+        break;
       }
-      else
+    }
+
+    /* first block that becomes significant on this bit plane gets a fresh block stream */
+    if (I == Size(E->LastSigBlock))
+    {
+      PushBack(&E->LastSigBlock, block_sig{ Block, BpKey });
+      if (Size(E->BlockStreams) < Size(E->LastSigBlock))
       {
-        GrowToAccomodate(&C->BrickDeltasStream, (Brick - C->LastBrick - 1 + 8) / 8);
-        WriteUnary(&C->BrickDeltasStream, u32(Brick - C->LastBrick - 1));
+        bitstream Bs;
+        InitWrite(&Bs, 256);
+        PushBack(&E->BlockStreams, Bs);
       }
-      /* write brick size */
-      i64 BrickSize = Size(C->BlockStream);
-      GrowToAccomodate(&C->BrickSizeStream, 4);
-      WriteVarByte(&C->BrickSizeStream, BrickSize);
-      /* write brick data */
-      GrowToAccomodate(&C->BrickStream, BrickSize);
-      WriteStream(&C->BrickStream, &C->BlockStream);
-      //BlockStat.Add((f64)Size(C->BlockStream));
-      Rewind(&C->BlockStream);
-      ++C->NBricks;
-      C->LastBrick = Brick;
-    } // end bit plane loop
-  }   // end zfp block loop
+      Rewind(&E->BlockStreams[I]);
+    }
+
+    /* encode the block */
+    bitstream* Bs = &E->BlockStreams[I];
+    GrowIfTooFull(Bs);
+#if defined(idx2_Avx2) && defined(__AVX2__)
+    EncodeBitPlane(BitPlanes[Bp], NVals, N, Bs);
+#else
+    Encode(BlockUInts, NVals, Bp, N, Bs);
+#endif
+  } // end bit plane loop
 }
 
 
@@ -143,7 +218,6 @@ EncodeSubbandBlocks(idx2_file* Idx2,
                     const grid& SbGrid,
                     const v3i& SbDims3,
                     const v3i& NBlocks3,
-                    const u64 Brick,
                     const u32 LastBlock,
                     volume* BrickVol)
 {
@@ -153,6 +227,28 @@ EncodeSubbandBlocks(idx2_file* Idx2,
   Clear(&E->SubbandExps);
   Reserve(&E->SubbandExps, Prod(NBlocks3));
 
+  /* the 3D blocks are quantized into a batch, then zfp transformed together and encoded in order */
+  i64 BatchInts[ZfpBatchSize][4 * 4 * 4];
+  u64 BatchUInts[ZfpBatchSize][4 * 4 * 4];
+  u32 BatchBlocks[ZfpBatchSize];
+  i16 BatchEMaxes[ZfpBatchSize];
+  int BatchSize = 0;
+  auto EncodeBatch = [&]() {
+    if (BatchSize == 0)
+      return;
+    const i64* IBlocks[ZfpBatchSize];
+    u64* UBlocks[ZfpBatchSize];
+    idx2_For (int, B, 0, BatchSize)
+    {
+      IBlocks[B] = BatchInts[B];
+      UBlocks[B] = BatchUInts[B];
+    }
+    ForwardZfpBatch(IBlocks, UBlocks, BatchSize);
+    idx2_For (int, B, 0, BatchSize)
+      EncodeBlockBitPlanes(Idx2, E, BatchBlocks[B], BatchEMaxes[B], 4 * 4 * 4, BatchUInts[B]);
+    BatchSize = 0;
+  };
+
   /* pass 1: compress the blocks */
   idx2_InclusiveFor (u32, Block, 0, LastBlock)
   { // zfp block loop
@@ -163,17 +259,16 @@ EncodeSubbandBlocks(idx2_file* Idx2,
     const i8 NDims = (i8)NumDims(BlockDims3);
     const int NVals = 1 << (2 * NDims);
     const i8 Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts[4 * 4 * 4];
-    buffer_t BufUInts(BlockUInts, NVals);
     bool CodedInNextLevel =
       E->Subband == 0 && E->Level + 1 < Idx2->NLevels && BlockDims3 == Idx2->BlockDims3;
     if (CodedInNextLevel)
       continue;
 
-    /* copy the samples to the local buffer and zfp transform them */
+    /* copy the samples to the local buffer and quantize them */
+    f64 BlockFloats[4 * 4 * 4];
+    buffer_t BufFloats(BlockFloats, NVals);
+    i64* BlockInts = NDims == 3 ? BatchInts[BatchSize] : (i64*)BlockFloats;
+    buffer_t BufInts(BlockInts, NVals);
     v3i S3;
     int J = 0;
     v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
@@ -183,76 +278,111 @@ EncodeSubbandBlocks(idx2_file* Idx2,
       BlockFloats[J++] = BrickVol->At<f64>(From3, Strd3, D3 + S3);
     }
     idx2_EndFor3; // end sample loop
-    /* zfp transform and shuffle */
     const i16 EMax = SizeOf(Idx2->DType) > 4 ? (i16)QuantizeF64(Prec, BufFloats, &BufInts)
                                              : (i16)QuantizeF32(Prec, BufFloats, &BufInts);
     PushBack(&E->SubbandExps, EMax);
-    ForwardZfp((i64*)BlockFloats, NDims);
-    ForwardShuffle((i64*)BlockFloats, BlockUInts, NDims);
-
-    /* zfp encode */
-    i8 N = 0; // number of significant coefficients in the block so far
-    i8 EndBitPlane = Min(i8(BitSizeOf(Idx2->DType)), NBitPlanes);
-    int Bpc = Idx2->BitPlanesPerChunk;
-    idx2_InclusiveForBackward (i8, Bp, NBitPlanes - 1, NBitPlanes - EndBitPlane)
-    { // bit plane loop
-      i16 RealBp = Bp + EMax;
-      i16 BpKey = (RealBp + BitPlaneKeyBias_) / Bpc; // make it so that the BpKey is positive
-      bool TooHighPrecision = NBitPlanes - 6 > RealBp - Exponent(Idx2->Tolerance) + 1;
-      if (TooHighPrecision)
-      {
-        if ((RealBp + BitPlaneKeyBias_) % Bpc == 0) // make sure we encode full "block" of BpKey
-          break;
-      }
 
-      u32 ChannelKey = GetChannelKey(BpKey, E->Level, E->Subband);
-      auto ChannelIt = Lookup(E->Channels, ChannelKey);
-      if (!ChannelIt)
-      {
-        channel Channel;
-        Init(&Channel);
-        Insert(&ChannelIt, ChannelKey, Channel);
-      }
-      idx2_Assert(ChannelIt);
-      channel* C = ChannelIt.Val;
+    /* zfp transform, shuffle, and encode */
+    if (NDims == 3)
+    {
+      BatchBlocks[BatchSize] = Block;
+      BatchEMaxes[BatchSize] = EMax;
+      if (++BatchSize == ZfpBatchSize)
+        EncodeBatch();
+    }
+    else
+    {
+      EncodeBatch(); // the blocks before this one are encoded first
+      u64 BlockUInts[4 * 4 * 4];
+      ForwardZfp(BlockInts, NDims);
+      ForwardShuffle(BlockInts, BlockUInts, NDims);
+      EncodeBlockBitPlanes(Idx2, E, Block, EMax, NVals, BlockUInts);
+    }
+  } // end zfp block loop
+  EncodeBatch();
+}
 
-      /* record the last significant block on this bit plane */
-      // u32 BlockDelta = Block;
-      int I = 0;
-      for (; I < Size(E->LastSigBlock); ++I)
-      {
-        if (E->LastSigBlock[I].BitPlane == BpKey)
-        {
-          idx2_Assert(Block > E->LastSigBlock[I].Block);
-          // BlockDelta = Block - E->BlockSigs[I].Block - 1;
-          E->LastSigBlock[I].Block = Block;
-          break;
-        }
-      }
 
-      /* write chunk if this brick is after the last chunk */
-      // first block that becomes significant on this bit plane
-      // TODO: need to think about the logic of LastSigBlock in conjunction with BpKey
-      bool FirstSigBlock = (I == Size(E->LastSigBlock));
-      bool BrickNotEmpty = Size(C->BrickStream) > 0;
-      bool NewChunk = Brick >= (C->LastChunk + 1) * Idx2->BricksPerChunk[E->Level];
-      if (FirstSigBlock)
+/*
+Record the encoded subband (held in E->SubbandExps, E->LastSigBlock, and E->BlockStreams)
+in E->SubbandLog, so that it can be written to the channels later by ReplaySubbandLog.
+*/
+static void
+LogSubband(encode_data* E, const u64 Brick)
+{
+  bitstream* Log = E->SubbandLog;
+  GrowToAccomodate(Log, 32 + 2 * Size(E->SubbandExps) + 16 * Size(E->LastSigBlock));
+  WriteVarByte(Log, E->Level);
+  WriteVarByte(Log, E->Subband);
+  WriteVarByte(Log, Brick);
+  WriteVarByte(Log, Size(E->SubbandExps));
+  idx2_For (int, I, 0, Size(E->SubbandExps))
+    Write(Log, u16(E->SubbandExps[I]), 16);
+  WriteVarByte(Log, Size(E->LastSigBlock));
+  idx2_For (int, I, 0, Size(E->LastSigBlock))
+  {
+    bitstream* Bs = &E->BlockStreams[I];
+    Flush(Bs);
+    GrowToAccomodate(Log, 16 + Size(*Bs));
+    WriteVarByte(Log, E->LastSigBlock[I].BitPlane);
+    WriteVarByte(Log, Size(*Bs));
+    WriteBuffer(Log, ToBuffer(*Bs));
+  }
+}
+
+
+static void
+WriteSubband(idx2_file* Idx2, encode_data* E, const u64 Brick)
+{
+  EncodeBrickSubbandChunks(Idx2, E, Brick);
+  EncodeBrickSubbandExponents(Idx2, E, Brick);
+  EncodeBrickSubbandMetadata(E, Brick);
+}
+
+
+/* Write all the subbands recorded by LogSubband to the channels of E, in the recorded order */
+static void
+ReplaySubbandLog(idx2_file* Idx2, encode_data* E, bitstream* SubbandLog)
+{
+  Flush(SubbandLog);
+  const i64 LogBytes = Size(*SubbandLog);
+  if (LogBytes == 0)
+    return;
+  bitstream Reader;
+  bitstream* Log = &Reader;
+  InitRead(Log, ToBuffer(*SubbandLog));
+  while (Size(*Log) < LogBytes)
+  {
+    E->Level = (i8)ReadVarByte(Log);
+    E->Subband = (i8)ReadVarByte(Log);
+    const u64 Brick = ReadVarByte(Log);
+    const i64 NExps = ReadVarByte(Log);
+    Clear(&E->SubbandExps);
+    Reserve(&E->SubbandExps, NExps);
+    idx2_For (i64, I, 0, NExps)
+      PushBack(&E->SubbandExps, i16(Read(Log, 16)));
+    const i64 NKeys = ReadVarByte(Log);
+    Clear(&E->LastSigBlock);
+    idx2_For (i64, I, 0, NKeys)
+    {
+      const i16 BpKey = (i16)ReadVarByte(Log);
+      const i64 Bytes = ReadVarByte(Log);
+      SeekToNextByte(Log);
+      if (Size(E->BlockStreams) <= I)
       {
-        if (NewChunk)
-        {
-          if (BrickNotEmpty)
-            WriteChunk(*Idx2, E, C, E->Level, E->Subband, BpKey);
-          C->NBricks = 0;
-          C->LastChunk = Brick >> Log2Ceil(Idx2->BricksPerChunk[E->Level]);
-        }
-        PushBack(&E->LastSigBlock, block_sig{ Block, BpKey });
+        bitstream Bs;
+        InitWrite(&Bs, 256);
+        PushBack(&E->BlockStreams, Bs);
       }
-
-      /* encode the block */
-      GrowIfTooFull(&C->BlockStream);
-      Encode(BlockUInts, NVals, Bp, N, &C->BlockStream);
-    } // end bit plane loop
-  } // end zfp block loop
+      bitstream* Bs = &E->BlockStreams[I];
+      Rewind(Bs);
+      GrowToAccomodate(Bs, Bytes);
+      WriteBuffer(Bs, buffer(Log->BitPtr, Bytes));
+      SeekToByte(Log, Size(*Log) + Bytes);
+      PushBack(&E->LastSigBlock, block_sig{ 0, BpKey });
+    }
+    WriteSubband(Idx2, E, Brick);
+  }
 }
 
 
@@ -265,10 +395,11 @@ EncodeSubband(idx2_file* Idx2, encode_data* E, const grid& SbGrid, volume* Brick
   const v3i NBlocks3 = (SbDims3 + Idx2->BlockDims3 - 1) / Idx2->BlockDims3;
   const u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
 
-  EncodeSubbandBlocks(Idx2, E, SbGrid, SbDims3, NBlocks3, Brick, LastBlock, BrickVol);
-  EncodeBrickSubbandExponents(Idx2, E, NBlocks3, Brick);
-  EncodeBrickSubbandMetadata(Idx2, E, NBlocks3, SbDims3, Brick, LastBlock);
-
+  EncodeSubbandBlocks(Idx2, E, SbGrid, SbDims3, NBlocks3, LastBlock, BrickVol);
+  if (E->SubbandLog)
+    LogSubband(E, Brick);
+  else
+    WriteSubband(Idx2, E, Brick);
 }
 
 
@@ -287,12 +418,15 @@ EncodeBrick(idx2_file* Idx2, const params& P, encode_data* E, bool IncrementLeve
   volume& BVol = BIt.Val->Vol;
   idx2_Assert(BVol.Buffer);
 
-  // TODO: we do not need to pre-extrapolate, instead just compute and store the extrapolated values
-  ExtrapolateCdf53(Dims(BIt.Val->ExtentLocal), Idx2->TransformOrder, &BVol);
-
-  /* do wavelet transform */
+  /* do wavelet transform (extrapolating the brick past its data on the fly) */
   bool CoarsestLevel = Level + 1 == Idx2->NLevels; // only normalize
-  ForwardCdf53(Idx2->BrickDimsExt3, E->Level, Idx2->Subbands, Idx2->TransformDetails, &BVol, CoarsestLevel);
+  ForwardCdf53WithExtrapolation(Dims(BIt.Val->ExtentLocal),
+                                Idx2->TransformOrder,
+                                E->Level,
+                                Idx2->Subbands,
+                                Idx2->TransformDetails,
+                                &BVol,
+                                CoarsestLevel);
 
   /* recursively encode the brick, one subband at a time */
   idx2_For (i8, Sb, 0, Size(Idx2->Subbands))
@@ -386,35 +520,315 @@ brick_copier::Copy(const extent& ExtentGlobal, const extent& ExtentLocal, brick_
 }
 
 
+/* Read the samples in the given extent from the file into the box */
+static void
+ReadBox(stream_copier* Copier, const extent& BoxExtent)
+{
+  const v3i From3 = From(BoxExtent), Dims3 = Dims(BoxExtent);
+  const v3i& N3 = Copier->Dims3;
+  const i64 S = SizeOf(Copier->DType);
+  Resize(&Copier->Box, Dims3, Copier->DType);
+  /* rows of the box that are adjacent in the file are read together */
+  bool FullX = Dims3.X == N3.X, FullXY = FullX && Dims3.Y == N3.Y;
+  i64 RunLength = FullXY ? Prod<i64>(Dims3) : FullX ? i64(Dims3.X) * Dims3.Y : Dims3.X;
+  i64 NRuns = Prod<i64>(Dims3) / RunLength;
+  idx2_For (i64, R, 0, NRuns)
+  {
+    i64 Y = FullX ? 0 : R % Dims3.Y;
+    i64 Z = FullXY ? 0 : FullX ? R : R / Dims3.Y;
+    i64 Offset = (((From3.Z + Z) * N3.Y + From3.Y + Y) * N3.X + From3.X) * S;
+    idx2_ExitIf(idx2_FSeek(Copier->Fp, Offset, SEEK_SET) != 0, "Cannot seek in the input file\n");
+    size_t NRead = fread(Copier->Box.Buffer.Data + R * RunLength * S, S, RunLength, Copier->Fp);
+    idx2_ExitIf(NRead != size_t(RunLength), "Cannot read the input file\n");
+  }
+  Copier->BoxExtent = BoxExtent;
+  ++Copier->NBoxesRead;
+}
+
+
+v2d
+stream_copier::Copy(const extent& ExtentGlobal, const extent& ExtentLocal, brick_volume* Brick)
+{
+  /* bricks never straddle two boxes, so we only need to check if the brick is in the current box */
+  bool InBox = Dims(BoxExtent) > 0 && From(BoxExtent) <= From(ExtentGlobal) &&
+               To(ExtentGlobal) <= To(BoxExtent);
+  if (!InBox)
+  {
+    v3i BoxFrom3 = (From(ExtentGlobal) / BoxDims3) * BoxDims3;
+    ReadBox(this, Crop(extent(BoxFrom3, BoxDims3), extent(Dims3)));
+  }
+
+  extent ExtentInBox(From(ExtentGlobal) - From(BoxExtent), Dims(ExtentGlobal));
+  v2d MinMax;
+  if (DType == dtype::float32)
+    MinMax = (CopyExtentExtentMinMax<f32, f64>(ExtentInBox, Box, ExtentLocal, &Brick->Vol));
+  else if (DType == dtype::float64)
+    MinMax = (CopyExtentExtentMinMax<f64, f64>(ExtentInBox, Box, ExtentLocal, &Brick->Vol));
+
+  return MinMax;
+}
+
+
+error<idx2_err_code>
+Init(stream_copier* Copier, const idx2_file& Idx2, cstr FileName, i64 MemoryBudget)
+{
+  Copier->Dims3 = Idx2.Dims3;
+  Copier->DType = Idx2.DType;
+  if (GetFileSize(FileName) < Prod<i64>(Idx2.Dims3) * SizeOf(Idx2.DType))
+    return idx2_Error(idx2_err_code::SizeMismatched, "%s is too small\n", FileName);
+
+  /* set aside the memory for the bricks being encoded (at most one open brick per level) */
+  const i64 BrickBytes = Prod<i64>(Idx2.BrickDimsExt3) * sizeof(f64);
+  const i64 BoxBudget = MemoryBudget - (Idx2.NLevels + 1) * BrickBytes;
+
+  /* the boxes are the subtrees after the first NSplits splits of the brick traversal */
+  const auto& Order = Idx2.BricksOrderStr[0];
+  const v3i& NBricks3 = Idx2.NBricks3[0];
+  v3i NBricksInBox3((int)NextPow2(NBricks3.X), (int)NextPow2(NBricks3.Y), (int)NextPow2(NBricks3.Z));
+  int NSplits = 0;
+  while (Prod<i64>(Min(NBricksInBox3 * Idx2.BrickDims3, Idx2.Dims3)) * SizeOf(Idx2.DType) > BoxBudget)
+  {
+    if (NSplits == Order.Len)
+      return idx2_Error(idx2_err_code::OutOfMemory, "memory budget too small for one brick\n");
+    int D = Order[NSplits++] - 'X';
+    NBricksInBox3[D] >>= 1;
+  }
+  Copier->BoxDims3 = NBricksInBox3 * Idx2.BrickDims3;
+  Copier->BoxExtent = extent();
+  Copier->Box.Type = Idx2.DType;
+  Resize(&Copier->Box, Min(Copier->BoxDims3, Idx2.Dims3), Idx2.DType);
+  Copier->NBoxesRead = 0;
+
+  Copier->Fp = fopen(FileName, "rb");
+  if (!Copier->Fp)
+    return idx2_Error(idx2_err_code::FileNotFound, "%s\n", FileName);
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+void
+Dealloc(stream_copier* Copier)
+{
+  if (Copier->Fp)
+    fclose(Copier->Fp);
+  Copier->Fp = nullptr;
+  Dealloc(&Copier->Box);
+}
+
+
+/*
+Touch the pages of file F on a background thread, so that they are in memory by the time the bricks
+need them. Only one file is read ahead at a time: if the previous one is still being read, this is
+retried on the next copy.
+*/
+static void
+ReadFileAhead(stacked_copier* Copier, int F)
+{
+  std::unique_lock<std::mutex> Lock(Copier->ReadAheadMutex);
+  if (F < Copier->NextReadAhead || F >= Size(Copier->Files))
+    return;
+  if (Copier->ReadAhead.valid() &&
+      Copier->ReadAhead.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    return;
+
+  Copier->NextReadAhead = F + 1;
+  const buffer Buf = Copier->Files[F].Vol.Buffer;
+  Copier->ReadAhead = std::async(std::launch::async, [Buf]() {
+    const i64 PageBytes = 4096;
+    volatile byte Sink = 0;
+    for (i64 I = 0; I < Size(Buf); I += PageBytes)
+      Sink = Sink + Buf.Data[I];
+  });
+}
+
+
+v2d
+stacked_copier::Copy(const extent& ExtentGlobal, const extent& ExtentLocal, brick_volume* Brick)
+{
+  v2d MinMax(traits<f64>::Max, traits<f64>::Min);
+  const v3i From3 = From(ExtentGlobal), Dims3 = Dims(ExtentGlobal);
+  const int FirstFile = From3.Z / SlicesPerFile;
+  const int LastFile = (From3.Z + Dims3.Z - 1) / SlicesPerFile;
+  ReadFileAhead(this, LastFile + 1);
+  /* a brick may span more than one file */
+  idx2_InclusiveFor (int, F, FirstFile, LastFile)
+  {
+    const volume& Vol = Files[F].Vol;
+    extent FileExtent(v3i(0, 0, F * SlicesPerFile), Dims(Vol));
+    extent Part = Crop(ExtentGlobal, FileExtent);
+    extent PartInFile(From(Part) - From(FileExtent), Dims(Part));
+    extent PartLocal(From(ExtentLocal) + From(Part) - From3, Dims(Part));
+    v2d PartMinMax = MinMax;
+    if (Vol.Type == dtype::float32)
+      PartMinMax = (CopyExtentExtentMinMax<f32, f64>(PartInFile, Vol, PartLocal, &Brick->Vol));
+    else if (Vol.Type == dtype::float64)
+      PartMinMax = (CopyExtentExtentMinMax<f64, f64>(PartInFile, Vol, PartLocal, &Brick->Vol));
+    MinMax.Min = Min(MinMax.Min, PartMinMax.Min);
+    MinMax.Max = Max(MinMax.Max, PartMinMax.Max);
+  }
+
+  return MinMax;
+}
+
+
+error<>
+Init(stacked_copier* Copier, const params& P)
+{
+  const v3i& Dims3 = P.Meta.Dims3;
+  const i64 SliceBytes = i64(Dims3.X) * Dims3.Y * SizeOf(P.Meta.DType);
+  const i64 FileBytes = GetFileSize(stref(P.InputFiles[0].Arr));
+  if (FileBytes % SliceBytes != 0 || (FileBytes / SliceBytes) * Size(P.InputFiles) != Dims3.Z)
+    return idx2_Error(err_code::SizeMismatched, "files do not stack up to the volume dimensions\n");
+
+  Copier->SlicesPerFile = int(FileBytes / SliceBytes);
+  Copier->NextReadAhead = 1; // the first file is read by the first bricks
+  Init(&Copier->Files, 0);
+  Reserve(&Copier->Files, Size(P.InputFiles));
+  idx2_For (int, I, 0, Size(P.InputFiles))
+  {
+    PushBack(&Copier->Files, mmap_volume());
+    v3i FileDims3(Dims3.X, Dims3.Y, Copier->SlicesPerFile);
+    idx2_PropagateIfError(
+      MapVolume(P.InputFiles[I].Arr, FileDims3, P.Meta.DType, &Back(Copier->Files), map_mode::Read));
+  }
+
+  return idx2_Error(err_code::NoError);
+}
+
+
+void
+Dealloc(stacked_copier* Copier)
+{
+  if (Copier->ReadAhead.valid()) // the pages are read from the mappings
+    Copier->ReadAhead.wait();
+  idx2_ForEach (FileIt, Copier->Files)
+    Unmap(FileIt);
+  Dealloc(&Copier->Files);
+}
+
+
+/* Read the given file (into the volume not in use) on a background thread */
+static std::future<error<>>
+ReadFileAsync(file_list_copier* Copier, int FileIdx)
+{
+  cstr FileName = (*Copier->FileNames)[FileIdx].Arr;
+  volume* Vol = &Copier->Vols[FileIdx % 2];
+  const v3i Dims3 = Copier->Dims3;
+  const dtype DType = Copier->DType;
+  return std::async(std::launch::async,
+                    [FileName, Dims3, DType, Vol]() { return ReadVolume(FileName, Dims3, DType, Vol); });
+}
+
+
+error<>
+Init(file_list_copier* Copier, const params& P)
+{
+  Copier->FileNames = &P.InputFiles;
+  Copier->Dims3 = P.Meta.Dims3;
+  Copier->DType = P.Meta.DType;
+  Copier->Current = -1;
+  if (GetFileSize(stref(P.InputFiles[0].Arr)) != Prod<i64>(P.Meta.Dims3) * SizeOf(P.Meta.DType))
+    return idx2_Error(err_code::SizeMismatched, "file size does not match the volume dimensions\n");
+
+  Copier->NextRead = ReadFileAsync(Copier, 0);
+  return idx2_Error(err_code::NoError);
+}
+
+
+error<>
+NextFile(file_list_copier* Copier)
+{
+  idx2_Assert(Copier->Current + 1 < Size(*Copier->FileNames));
+  idx2_PropagateIfError(Copier->NextRead.get());
+  ++Copier->Current;
+  Copier->Volume = &Copier->Vols[Copier->Current % 2];
+  /* the other volume is no longer in use, so we can start reading the next file into it */
+  if (Copier->Current + 1 < Size(*Copier->FileNames))
+    Copier->NextRead = ReadFileAsync(Copier, Copier->Current + 1);
+
+  return idx2_Error(err_code::NoError);
+}
+
+
+void
+Dealloc(file_list_copier* Copier)
+{
+  if (Copier->NextRead.valid())
+    Copier->NextRead.wait();
+  Dealloc(&Copier->Vols[0]);
+  Dealloc(&Copier->Vols[1]);
+  Copier->Volume = nullptr;
+}
+
+
+/* Copy a brick at level 0 from the input and encode it (and the parent bricks that it completes) */
+static v2d
+EncodeBrickAtLevel0(idx2_file* Idx2,
+                    const params& P,
+                    brick_copier& Copier,
+                    encode_data* E,
+                    const v3i& Brick3)
+{
+  // BVol = local brick storage (we will copy brick data from the input to this)
+  brick_volume BVol;
+  Resize(&BVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E->Alloc);
+  Fill(idx2_Range(f64, BVol.Vol), 0.0);
+  extent BrickExtent(Brick3 * Idx2->BrickDims3, Idx2->BrickDims3);
+  // BrickExtentCrop = the true extent of the brick (boundary bricks are cropped)
+  extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
+  BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
+  v2d MinMax = Copier.Copy(BrickExtentCrop, BVol.ExtentLocal, &BVol);
+  //    Copy(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol);
+  E->Level = 0;
+  E->Bricks3[E->Level] = Brick3;
+  E->Brick[E->Level] = GetLinearBrick(*Idx2, E->Level, E->Bricks3[E->Level]);
+  u64 BrickKey = GetBrickKey(E->Level, E->Brick[E->Level]);
+  Insert(&E->BrickPool, BrickKey, BVol);
+  EncodeBrick(Idx2, P, E);
+  return MinMax;
+}
+
+
+/* Dump the bit streams to files, write the meta file, and print the stats */
+static error<idx2_err_code>
+FinishEncode(idx2_file* Idx2, const params& P, encode_data* E)
+{
+  timer Timer;
+  StartTimer(&Timer);
+  idx2_PropagateIfError(FlushChunks(*Idx2, E));
+  idx2_PropagateIfError(FlushChunkExponents(*Idx2, E));
+  TotalTime_ += Seconds(ElapsedTime(&Timer));
+
+  cstr MetaFileName = idx2_PrintScratch("%s/%s/%s.idx2", P.OutDir, P.Meta.Name, P.Meta.Field);
+  WriteMetaFile(*Idx2, P, MetaFileName);
+  printf("num channels            = %" PRIi64 "\n", Size(E->Channels));
+  printf("num sub channels        = %" PRIi64 "\n", Size(E->SubChannels));
+  MetaFileName = idx2_PrintScratch("%s/%s/%s.idx2", P.OutDir, P.Meta.Name, P.Meta.Field);
+  PrintStats(MetaFileName);
+  printf("total time              = %f seconds\n", TotalTime_);
+  //  _ASSERTE( _CrtCheckMemory( ) );
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
 error<idx2_err_code>
 Encode(idx2_file* Idx2, const params& P, brick_copier& Copier)
 {
+  ResetStats();
+  TotalTime_ = 0;
   const int BrickBytes = Prod(Idx2->BrickDimsExt3) * sizeof(f64);
-  BrickAlloc_ = free_list_allocator(BrickBytes);
+  Init(&BrickAlloc_, BrickBytes);
   idx2_RAII(encode_data, E, Init(&E));
+  E.Writer.FileCache.MaxOpenFiles = P.MaxOpenFiles;
   idx2_BrickTraverse(
     timer Timer; StartTimer(&Timer);
     //    idx2_Assert(GetLinearBrick(*Idx2, 0, Top.BrickFrom3) == Top.Address);
     //    idx2_Assert(GetSpatialBrick(*Idx2, 0, Top.Address) == Top.BrickFrom3);
-    // BVol = local brick storage (we will copy brick data from the input to this)
-    brick_volume BVol;
-    Resize(&BVol.Vol, Idx2->BrickDimsExt3, dtype::float64, E.Alloc);
-    Fill(idx2_Range(f64, BVol.Vol), 0.0);
-    extent BrickExtent(Top.BrickFrom3 * Idx2->BrickDims3, Idx2->BrickDims3);
-    // BrickExtentCrop = the true extent of the brick (boundary bricks are cropped)
-    extent BrickExtentCrop = Crop(BrickExtent, extent(Idx2->Dims3));
-    BVol.ExtentLocal = Relative(BrickExtentCrop, BrickExtent);
-    v2d MinMax = Copier.Copy(BrickExtentCrop, BVol.ExtentLocal, &BVol);
+    v2d MinMax = EncodeBrickAtLevel0(Idx2, P, Copier, &E, Top.BrickFrom3);
+    idx2_Assert(E.Brick[0] == Top.Address);
     Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, MinMax.Min);
     Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, MinMax.Max);
-    //    Copy(BrickExtentCrop, Vol, BVol.ExtentLocal, &BVol.Vol);
-    E.Level = 0;
-    E.Bricks3[E.Level] = Top.BrickFrom3;
-    E.Brick[E.Level] = GetLinearBrick(*Idx2, E.Level, E.Bricks3[E.Level]);
-    idx2_Assert(E.Brick[E.Level] == Top.Address);
-    u64 BrickKey = GetBrickKey(E.Level, E.Brick[E.Level]);
-    Insert(&E.BrickPool, BrickKey, BVol);
-    EncodeBrick(Idx2, P, &E);
     TotalTime_ += Seconds(ElapsedTime(&Timer));
     ,
     128,
@@ -425,22 +839,116 @@ Encode(idx2_file* Idx2, const params& P, brick_copier& Copier)
     extent(Idx2->NBricks3[E.Level])
   );
 
-  /* dump the bit streams to files */
+  return FinishEncode(Idx2, P, &E);
+}
+
+
+/* The output of encoding all the bricks under one brick at the coarsest level */
+struct encoded_subtree
+{
+  bitstream SubbandLog;
+  v2d MinMax = v2d(traits<f64>::Max, traits<f64>::Min);
+};
+
+
+/* Encode the bricks Bricks3[Begin, End) at level 0, recording the encoded subbands in a log */
+static encoded_subtree
+EncodeSubtree(idx2_file* Idx2,
+              const params& P,
+              brick_copier& Copier,
+              const array<v3i>& Bricks3,
+              i64 Begin,
+              i64 End)
+{
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * sizeof(f64);
+  free_list_allocator Alloc(BrickBytes);
+  encoded_subtree Subtree;
+  InitWrite(&Subtree.SubbandLog, 16384);
+  idx2_RAII(encode_data, E, Init(&E, &Alloc));
+  E.SubbandLog = &Subtree.SubbandLog;
+  idx2_For (i64, I, Begin, End)
+  {
+    v2d MinMax = EncodeBrickAtLevel0(Idx2, P, Copier, &E, Bricks3[I]);
+    Subtree.MinMax.Min = Min(Subtree.MinMax.Min, MinMax.Min);
+    Subtree.MinMax.Max = Max(Subtree.MinMax.Max, MinMax.Max);
+  }
+  idx2_Assert(Size(E.BrickPool) == 0);
+
+  return Subtree;
+}
+
+
+/*
+Encode the subtrees rooted at the bricks of the coarsest level in parallel. The worker threads only
+transform and compress; the main thread writes their output to the channels in the same order as
+Encode does, so the output files are byte-identical. The copier must be safe to call concurrently.
+*/
+error<idx2_err_code>
+ParallelEncode(idx2_file* Idx2, const params& P, brick_copier& Copier)
+{
+  /* list the bricks at level 0 in traversal order, and find where each subtree starts */
+  idx2_RAII(array<v3i>, Bricks3, Init(&Bricks3, 0));
+  idx2_RAII(array<i64>, Subtrees, Init(&Subtrees, 0));
+  idx2_RAII(array<u64>, Roots, Init(&Roots, 0));
+  v3i Factor3(1); // the number of bricks at level 0 (per dimension) under a brick at the coarsest level
+  idx2_For (int, L, 1, Idx2->NLevels)
+    Factor3 = Factor3 * Idx2->GroupBrick3;
+  idx2_BrickTraverse(
+    u64 Root = GetLinearBrick(*Idx2, Idx2->NLevels - 1, Top.BrickFrom3 / Factor3);
+    if (Size(Roots) == 0 || Root != Back(Roots))
+    {
+      PushBack(&Roots, Root);
+      PushBack(&Subtrees, Size(Bricks3));
+    }
+    PushBack(&Bricks3, Top.BrickFrom3);
+    ,
+    128,
+    Idx2->BricksOrder[0],
+    v3i(0),
+    Idx2->NBricks3[0],
+    extent(Idx2->NBricks3[0]),
+    extent(Idx2->NBricks3[0])
+  );
+  PushBack(&Subtrees, Size(Bricks3));
+  /* each subtree must be visited exactly once for it to be encoded independently */
+  std::sort(Begin(Roots), End(Roots));
+  if (std::adjacent_find(Begin(Roots), End(Roots)) != End(Roots))
+    return Encode(Idx2, P, Copier);
+
+  ResetStats();
+  TotalTime_ = 0;
+  const int BrickBytes = Prod(Idx2->BrickDimsExt3) * sizeof(f64);
+  Init(&BrickAlloc_, BrickBytes);
+  idx2_RAII(encode_data, E, Init(&E));
+  E.Writer.FileCache.MaxOpenFiles = P.MaxOpenFiles;
+
   timer Timer;
   StartTimer(&Timer);
-  idx2_PropagateIfError(FlushChunks(*Idx2, &E));
-  idx2_PropagateIfError(FlushChunkExponents(*Idx2, &E));
+  const i64 NSubtrees = Size(Subtrees) - 1;
+  BS::thread_pool ThreadPool;
+  /* bound the number of subtrees in flight, since the logs are kept in memory until replayed */
+  const i64 MaxInFlight = 2 * ThreadPool.get_thread_count();
+  std::vector<std::future<encoded_subtree>> Futures(NSubtrees);
+  auto Submit = [&](i64 S) {
+    Futures[S] = ThreadPool.submit([&, S]() {
+      return EncodeSubtree(Idx2, P, Copier, Bricks3, Subtrees[S], Subtrees[S + 1]);
+    });
+  };
+  idx2_For (i64, S, 0, Min(MaxInFlight, NSubtrees))
+    Submit(S);
+  idx2_For (i64, S, 0, NSubtrees)
+  {
+    encoded_subtree Subtree = Futures[S].get();
+    if (S + MaxInFlight < NSubtrees)
+      Submit(S + MaxInFlight);
+    ReplaySubbandLog(Idx2, &E, &Subtree.SubbandLog);
+    Dealloc(&Subtree.SubbandLog);
+    Idx2->ValueRange.Min = Min(Idx2->ValueRange.Min, Subtree.MinMax.Min);
+    Idx2->ValueRange.Max = Max(Idx2->ValueRange.Max, Subtree.MinMax.Max);
+  }
   TotalTime_ += Seconds(ElapsedTime(&Timer));
 
-  cstr MetaFileName = idx2_PrintScratch("%s/%s/%s.idx2", P.OutDir, P.Meta.Name, P.Meta.Field);
-  WriteMetaFile(*Idx2, P, MetaFileName);
-  printf("num channels            = %" PRIi64 "\n", Size(E.Channels));
-  printf("num sub channels        = %" PRIi64 "\n", Size(E.SubChannels));
-  MetaFileName = idx2_PrintScratch("%s/%s/%s.idx2", P.OutDir, P.Meta.Name, P.Meta.Field);
-  PrintStats(MetaFileName);
-  printf("total time              = %f seconds\n", TotalTime_);
-  //  _ASSERTE( _CrtCheckMemory( ) );
-  return idx2_Error(idx2_err_code::NoError);
+  return FinishEncode(Idx2, P, &E);
 }
 
 
@@ -461,12 +969,14 @@ Init(encode_data* E, allocator* Alloc)
   InitWrite(&E->CompressedChunkAddresses, 16384);
   InitWrite(&E->ChunkStream, 16384);
   InitWrite(&E->ChunkExpStream, 32768);
+  Init(&E->Writer.FileCache.Files, 8);
 }
 
 
 void
 Dealloc(encode_data* E)
 {
+  Dealloc(&E->Writer);
   E->Alloc->DeallocAll();
   Dealloc(&E->BrickPool);
   idx2_ForEach (ChannelIt, E->Channels)
@@ -488,6 +998,9 @@ Dealloc(encode_data* E)
   Dealloc(&E->ChunkExpStream);
   Dealloc(&E->LastSigBlock);
   Dealloc(&E->SubbandExps);
+  idx2_For (int, I, 0, Size(E->BlockStreams))
+    Dealloc(&E->BlockStreams[I]);
+  Dealloc(&E->BlockStreams);
   //Dealloc(&E->BlockStream);
 }
 
@@ -498,7 +1011,6 @@ Init(channel* C)
   InitWrite(&C->BrickStream, 16384);
   InitWrite(&C->BrickDeltasStream, 32);
   InitWrite(&C->BrickSizeStream, 256);
-  InitWrite(&C->BlockStream, 256);
 }
 
 
@@ -508,7 +1020,6 @@ Dealloc(channel* C)
   Dealloc(&C->BrickDeltasStream);
   Dealloc(&C->BrickSizeStream);
   Dealloc(&C->BrickStream);
-  Dealloc(&C->BlockStream);
 }
 
 
@@ -2,10 +2,15 @@
 
 #include "Array.h"
 #include "BitStream.h"
+#include "CircularQueue.h"
 #include "HashTable.h"
 #include "Memory.h"
 #include "idx2Common.h"
 #include "idx2SparseBricks.h"
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
 
 
 namespace idx2
@@ -43,8 +48,6 @@ struct channel
   bitstream BrickDeltasStream; // store data for many bricks
   bitstream BrickSizeStream;    // store data for many bricks
   bitstream BrickStream;       // store data for many bricks
-  /* block-related streams, to be reset once per brick */
-  bitstream BlockStream; // store data for many blocks
   u64 LastChunk = 0;     // current chunk
   u64 LastBrick = 0;
   i32 NBricks = 0;
@@ -84,6 +87,58 @@ struct sub_channel_info
 };
 
 
+/* A buffer to be appended to a file (given by its id) by the chunk writer */
+struct write_request
+{
+  u64 FileId = 0;
+  buffer Buf;
+};
+
+
+/* A file open for appending, and when it was last used */
+struct open_file
+{
+  FILE* Fp = nullptr;
+  u64 LastUse = 0;
+};
+
+
+/*
+An LRU cache of files open for appending, keyed by file id. At most MaxOpenFiles files are open at the
+same time, so files are opened and closed about once each instead of once per chunk.
+*/
+struct open_file_cache
+{
+  hash_table<u64, open_file> Files;
+  int MaxOpenFiles = 256;
+  u64 Clock = 0;
+};
+
+
+/*
+Append buffers to files on a background thread, in the order they are pushed, so that the encoder
+does not wait on the file system. The queue is bounded (in count and in bytes), so a slow file system
+makes the encoder wait instead of buffering the whole output in memory.
+*/
+struct chunk_writer
+{
+  const idx2_file* Idx2 = nullptr;
+  // used by the writer thread, and by the encoder thread only after WaitForWrites
+  open_file_cache FileCache;
+  std::thread Thread;
+  std::mutex Mutex;
+  std::condition_variable CanPush; // there is room in the queue
+  std::condition_variable CanPop;  // the queue is not empty (or the writer is stopping)
+  std::condition_variable Idle;    // the queue is empty and nothing is being written
+  circular_queue<write_request, 256> Queue;
+  i64 QueuedBytes = 0;
+  i64 MaxQueuedBytes = i64(64) << 20;
+  bool Busy = false;
+  bool Stop = false;
+  bool Failed = false;
+};
+
+
 /* We use this to pass data between different stages of the encoder */
 struct encode_data
 {
@@ -111,9 +166,14 @@ struct encode_data
   // can be used to do certain things only *once* per bit plane
   array<block_sig> LastSigBlock;
   array<i16> SubbandExps;
+  // encoded blocks of the current subband, one stream for each entry in LastSigBlock
+  array<bitstream> BlockStreams;
+  // if not null, encoded subbands are recorded here instead of being written to the channels
+  bitstream* SubbandLog = nullptr;
   //bitstream BlockStream; // only used by v0.1
   array<t2<u32, channel*>> SortedChannels;
   array<sub_channel_info> SortedSubChannels;
+  chunk_writer Writer;
 };
 
 
@@ -134,6 +194,59 @@ struct brick_copier
 };
 
 
+/*
+Copy brick data from a raw file without mapping the whole file in memory. The file is read one box at
+a time, where a box is the extent of the largest subtree of bricks (in the order that the bricks are
+encoded) that fits in the memory budget, so that every sample is read from the file exactly once.
+*/
+struct stream_copier : public brick_copier
+{
+  FILE* Fp = nullptr;
+  v3i Dims3 = v3i(0);
+  dtype DType = dtype::__Invalid__;
+  v3i BoxDims3 = v3i(0); // dims of an (uncropped) box, in samples
+  extent BoxExtent;      // extent of the box currently in memory
+  volume Box;
+  i64 NBoxesRead = 0;
+
+  v2d // {Min, Max} values of brick
+  Copy(const extent& ExtentGlobal, const extent& ExtentLocal, brick_volume* Brick) override;
+};
+
+
+/*
+Copy brick data from a volume stored as a list of raw files stacked along Z, each file holding the
+same number of consecutive Z slices. The files are memory mapped. When a brick reaches a file, the
+file after it is read ahead (its pages are touched) by a background thread.
+*/
+struct stacked_copier : public brick_copier
+{
+  array<mmap_volume> Files;
+  int SlicesPerFile = 0;
+  int NextReadAhead = 1; // the files before this one have been read ahead (or are being read)
+  std::future<void> ReadAhead;
+  std::mutex ReadAheadMutex; // the bricks may be copied concurrently (see ParallelEncode)
+
+  v2d // {Min, Max} values of brick
+  Copy(const extent& ExtentGlobal, const extent& ExtentLocal, brick_volume* Brick) override;
+};
+
+
+/*
+Copy brick data from a list of raw files of the same dimensions (e.g., one file per time step), one
+file at a time. The next file is read by a background thread while the current one is being encoded.
+*/
+struct file_list_copier : public brick_copier
+{
+  const array<stack_array<char, 256>>* FileNames = nullptr;
+  v3i Dims3 = v3i(0);
+  dtype DType = dtype::__Invalid__;
+  volume Vols[2]; // the current file and the next file
+  std::future<error<>> NextRead;
+  int Current = -1;
+};
+
+
 /* FUNCTIONS */
 
 void
@@ -143,10 +256,38 @@ CompressBufZstd(const buffer& Input, bitstream* Output);
 error<idx2_err_code>
 Encode(idx2_file* Idx2, const params& P, brick_copier& Copier);
 
+/* Same as Encode, but the bricks under each brick at the coarsest level are encoded in parallel */
+error<idx2_err_code>
+ParallelEncode(idx2_file* Idx2, const params& P, brick_copier& Copier);
+
 /* Encode a brick. Use this when the input data is not in the form of a big volume. */
 error<idx2_err_code>
 EncodeBrick(idx2_file* Idx2, const params& P, const v3i& BrickPos3);
 
+/* MemoryBudget (in bytes) bounds the memory used for the input samples and the bricks being encoded */
+error<idx2_err_code>
+Init(stream_copier* Copier, const idx2_file& Idx2, cstr FileName, i64 MemoryBudget);
+
+void
+Dealloc(stream_copier* Copier);
+
+error<>
+Init(stacked_copier* Copier, const params& P);
+
+void
+Dealloc(stacked_copier* Copier);
+
+/* Start reading the first file in P.InputFiles */
+error<>
+Init(file_list_copier* Copier, const params& P);
+
+/* Make the next file current (waiting for it to be read), and start reading the one after it */
+error<>
+NextFile(file_list_copier* Copier);
+
+void
+Dealloc(file_list_copier* Copier);
+
 void
 Init(encode_data* E, allocator* Alloc = nullptr);
 
@@ -0,0 +1,222 @@
+#include "idx2FooterIndex.h"
+#include "Array.h"
+#include "BitStream.h"
+#include "FileSystem.h"
+#include "InputOutput.h"
+#include "VarInt.h"
+#include "idx2Decode.h"
+#include "idx2Lookup.h"
+#include <algorithm>
+
+
+namespace idx2
+{
+
+
+static constexpr char FooterIndexMagic_[8] = { 'i', 'd', 'x', '2', 'f', 't', 'r', '1' };
+
+
+struct footer_index_header
+{
+  char Magic[8] = {};
+  i64 NFiles = 0;
+  i64 NChunks = 0;
+  i64 NExpChunks = 0;
+};
+
+
+/* Print the path into Path rather than ScratchBuf, which idx2_Error overwrites */
+static cstr
+FooterIndexPath(const idx2_file& Idx2, char* Path, int Size)
+{
+  snprintf(Path, size_t(Size), "%.*s/%s/%s/Footers.idx",
+           Idx2.Dir.Size, Idx2.Dir.ConstPtr, Idx2.Name, Idx2.Field);
+  return Path;
+}
+
+
+/* Read the chunk addresses and sizes at the end of a file (see ReadFile and ReadFileExponents) */
+static error<idx2_err_code>
+ReadFooters(const file_id& FileId,
+            footer_file* File,
+            array<footer_chunk>* Chunks,
+            array<footer_chunk>* ExpChunks)
+{
+  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+  idx2_ReturnErrorIf(!Fp, idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
+  idx2_FSeek(Fp, 0, SEEK_END);
+  i64 FileSize = idx2_FTell(Fp);
+
+  /* the exponent information */
+  int ExponentSize = 0;
+  ReadBackwardPOD(Fp, &ExponentSize);
+  int NExpChunks = 0;
+  ReadBackwardPOD(Fp, &NExpChunks);
+  int ExpAddrsSz = 0;
+  ReadBackwardPOD(Fp, &ExpAddrsSz);
+  idx2_ScopeBuffer(CpresExpAddrs, ExpAddrsSz);
+  ReadBackwardBuffer(Fp, &CpresExpAddrs, ExpAddrsSz);
+  idx2_ScopeBuffer(ExpAddrsBuf, NExpChunks * sizeof(u64));
+  DecompressBufZstd(CpresExpAddrs, &ExpAddrsBuf);
+  int ExpSizesSz = 0;
+  ReadBackwardPOD(Fp, &ExpSizesSz);
+  idx2_ScopeBuffer(ExpSizesBuf, ExpSizesSz);
+  ReadBackwardBuffer(Fp, &ExpSizesBuf, ExpSizesSz);
+  bitstream ExpSizesStream;
+  InitRead(&ExpSizesStream, ExpSizesBuf);
+  File->ExponentBeginOffset = FileSize - ExponentSize;
+  File->FirstExpChunk = Size(*ExpChunks);
+  File->NExpChunks = NExpChunks;
+  i64 EndOffset = 0;
+  idx2_For (int, I, 0, NExpChunks)
+  {
+    EndOffset += ReadVarByte(&ExpSizesStream);
+    PushBack(ExpChunks, footer_chunk{ *((u64*)ExpAddrsBuf.Data + I), EndOffset });
+  }
+  if (Size(ExpSizesStream) != ExpSizesSz)
+    return idx2_Error(idx2_err_code::SizeMismatched, "File: %s\n", FileId.Name.ConstPtr);
+
+  /* the bit plane information, which is right before the exponent information */
+  idx2_FSeek(Fp, FileSize - ExponentSize, SEEK_SET);
+  int NChunks = 0;
+  ReadBackwardPOD(Fp, &NChunks);
+  int ChunkAddrsSz = 0;
+  ReadBackwardPOD(Fp, &ChunkAddrsSz);
+  idx2_ScopeBuffer(CpresChunkAddrs, ChunkAddrsSz);
+  ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
+  idx2_ScopeBuffer(ChunkAddrsBuf, NChunks * sizeof(u64));
+  DecompressBufZstd(CpresChunkAddrs, &ChunkAddrsBuf);
+  int ChunkSizesSz = 0;
+  ReadBackwardPOD(Fp, &ChunkSizesSz);
+  idx2_ScopeBuffer(ChunkSizesBuf, ChunkSizesSz);
+  ReadBackwardBuffer(Fp, &ChunkSizesBuf, ChunkSizesSz);
+  bitstream ChunkSizesStream;
+  InitRead(&ChunkSizesStream, ChunkSizesBuf);
+  File->FirstChunk = Size(*Chunks);
+  File->NChunks = NChunks;
+  EndOffset = 0;
+  idx2_For (int, I, 0, NChunks)
+  {
+    EndOffset += ReadVarByte(&ChunkSizesStream);
+    PushBack(Chunks, footer_chunk{ *((u64*)ChunkAddrsBuf.Data + I), EndOffset });
+  }
+  if (Size(ChunkSizesStream) != ChunkSizesSz)
+    return idx2_Error(idx2_err_code::SizeMismatched, "File: %s\n", FileId.Name.ConstPtr);
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+/* Go through all the files that a dataset can have on each level, skipping the ones that do not exist */
+error<idx2_err_code>
+BuildFooterIndex(const idx2_file& Idx2)
+{
+  idx2_RAII(array<footer_file>, Files, , Dealloc(&Files));
+  idx2_RAII(array<footer_chunk>, Chunks, , Dealloc(&Chunks));
+  idx2_RAII(array<footer_chunk>, ExpChunks, , Dealloc(&ExpChunks));
+  idx2_For (i8, Level, 0, Idx2.NLevels)
+  {
+    int BrickShift = Log2Ceil(Idx2.BricksPerFile[Level]);
+    int FileBits = Max(Idx2.BricksOrderStr[Level].Len - BrickShift, 0);
+    for (u64 F = 0; F < (u64(1) << FileBits); ++F)
+    {
+      file_id FileId = ConstructFilePath(Idx2, F << BrickShift, Level, 0, 0);
+      if (GetFileSize(FileId.Name) < 0)
+        continue;
+      footer_file File;
+      File.FileId = FileId.Id;
+      idx2_PropagateIfError(ReadFooters(FileId, &File, &Chunks, &ExpChunks));
+      PushBack(&Files, File);
+    }
+  }
+  std::sort(Begin(Files), End(Files), [](const footer_file& A, const footer_file& B) {
+    return A.FileId < B.FileId;
+  });
+
+  char IndexPath[512];
+  FooterIndexPath(Idx2, IndexPath, sizeof(IndexPath));
+  idx2_RAII(FILE*, Fp = fopen(IndexPath, "wb"), , if (Fp) fclose(Fp));
+  idx2_ReturnErrorIf(!Fp, idx2_err_code::FileNotFound, "File: %s", IndexPath);
+  footer_index_header Header;
+  memcpy(Header.Magic, FooterIndexMagic_, sizeof(Header.Magic));
+  Header.NFiles = Size(Files);
+  Header.NChunks = Size(Chunks);
+  Header.NExpChunks = Size(ExpChunks);
+  WritePOD(Fp, Header);
+  fwrite(Files.Buffer.Data, sizeof(footer_file), Size(Files), Fp);
+  fwrite(Chunks.Buffer.Data, sizeof(footer_chunk), Size(Chunks), Fp);
+  fwrite(ExpChunks.Buffer.Data, sizeof(footer_chunk), Size(ExpChunks), Fp);
+  printf("footer index: %" PRIi64 " files, %" PRIi64 " chunks, %" PRIi64 " exponent chunks\n",
+         Header.NFiles, Header.NChunks, Header.NExpChunks);
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+error<idx2_err_code>
+Load(footer_index* Index, const idx2_file& Idx2)
+{
+  char IndexPath[512];
+  FooterIndexPath(Idx2, IndexPath, sizeof(IndexPath));
+  if (GetFileSize(IndexPath) < (i64)sizeof(footer_index_header))
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s", IndexPath);
+  if (!OpenFile(&Index->File, IndexPath, map_mode::Read))
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s", IndexPath);
+  if (!MapFile(&Index->File))
+  {
+    CloseFile(&Index->File);
+    Index->File.Buf = buffer();
+    return idx2_Error(idx2_err_code::FileNotFound, "Cannot map file: %s", IndexPath);
+  }
+
+  const byte* Data = Index->File.Buf.Data;
+  footer_index_header Header;
+  memcpy(&Header, Data, sizeof(Header));
+  i64 Bytes = sizeof(Header) + Header.NFiles * sizeof(footer_file) +
+              (Header.NChunks + Header.NExpChunks) * sizeof(footer_chunk);
+  if (memcmp(Header.Magic, FooterIndexMagic_, sizeof(Header.Magic)) != 0 ||
+      Bytes != Size(Index->File.Buf))
+  {
+    Dealloc(Index);
+    return idx2_Error(idx2_err_code::SizeMismatched, "File: %s", IndexPath);
+  }
+  Index->NFiles = Header.NFiles;
+  Index->NChunks = Header.NChunks;
+  Index->NExpChunks = Header.NExpChunks;
+  Index->Files = (const footer_file*)(Data + sizeof(Header));
+  Index->Chunks = (const footer_chunk*)(Index->Files + Index->NFiles);
+  Index->ExpChunks = Index->Chunks + Index->NChunks;
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+void
+Dealloc(footer_index* Index)
+{
+  if (Index->File.Buf.Data)
+  {
+    UnmapFile(&Index->File);
+    CloseFile(&Index->File);
+  }
+  *Index = footer_index();
+}
+
+
+const footer_file*
+Lookup(const footer_index& Index, u64 FileId)
+{
+  i64 Beg = 0, End = Index.NFiles;
+  while (Beg < End)
+  {
+    i64 Mid = Beg + (End - Beg) / 2;
+    if (Index.Files[Mid].FileId < FileId)
+      Beg = Mid + 1;
+    else
+      End = Mid;
+  }
+  return (Beg < Index.NFiles && Index.Files[Beg].FileId == FileId) ? &Index.Files[Beg] : nullptr;
+}
+
+
+} // namespace idx2
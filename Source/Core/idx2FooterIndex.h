@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Common.h"
+#include "Error.h"
+#include "MemoryMap.h"
+#include "idx2Common.h"
+
+
+namespace idx2
+{
+
+
+/* Where the chunks of one data file are in the footer index */
+struct footer_file
+{
+  u64 FileId = 0;
+  i64 ExponentBeginOffset = 0; // where in the file the exponent information begins
+  i64 FirstChunk = 0;          // first bit plane chunk of the file in footer_index::Chunks
+  i64 FirstExpChunk = 0;       // first exponent chunk of the file in footer_index::ExpChunks
+  i32 NChunks = 0;
+  i32 NExpChunks = 0;
+};
+
+
+/* A chunk and where it ends in its file (relative to ExponentBeginOffset for exponent chunks) */
+struct footer_chunk
+{
+  u64 Address = 0;
+  i64 EndOffset = 0;
+};
+
+
+/*
+The footers (chunk addresses and sizes) of all the data files of a dataset, so that the decoders do
+not have to read them from the data files. BuildFooterIndex writes the index to one file in the
+directory of the dataset, which holds a header followed by three tables: the files sorted by id, the
+bit plane chunks of each file in file order, and the exponent chunks of each file in file order. The
+index file is memory mapped and used in place.
+*/
+struct footer_index
+{
+  mmap_file File;
+  const footer_file* Files = nullptr;
+  const footer_chunk* Chunks = nullptr;
+  const footer_chunk* ExpChunks = nullptr;
+  i64 NFiles = 0;
+  i64 NChunks = 0;
+  i64 NExpChunks = 0;
+};
+
+
+/* Read the footers of all the data files of a dataset and write them to its footer index */
+error<idx2_err_code>
+BuildFooterIndex(const idx2_file& Idx2);
+
+/* Map the footer index of a dataset (FileNotFound if the index has not been built) */
+error<idx2_err_code>
+Load(footer_index* Index, const idx2_file& Idx2);
+
+void
+Dealloc(footer_index* Index);
+
+/* Return the entry of a file, or nullptr if the file is not in the index */
+const footer_file*
+Lookup(const footer_index& Index, u64 FileId);
+
+
+} // namespace idx2
@@ -69,7 +69,7 @@ GetSpatialBrick(const idx2_file& Idx2, int Level, u64 LinearBrick);
 
 
 extent
-ChunkAddressToSpatial(const idx2_file& Idx2, int Level, u64 LinearBrick);
+ChunkAddressToSpatial(const idx2_file& Idx2, u64 ChunkAddress);
 
 
 file_id
@@ -27,7 +27,71 @@ error<idx2_err_code>
 ParallelDecode(const idx2_file& Idx2, const params& P, buffer* OutBuf);
 
 
-/* decode the subband of a brick */
+/* Release the chunks read by ParallelDecodeSubband */
+static void
+ReleaseChunks(array<shared_chunk<chunk_cache>*>* Chunks)
+{
+  idx2_ForEach (ChunkIt, *Chunks)
+    Release(*ChunkIt);
+  Clear(Chunks);
+}
+
+
+/* Bricks of at least this many samples have their subbands, and the blocks within, decoded in parallel */
+static constexpr i64 MinSamplesToSplitBrick = 32 * 32 * 32;
+/* The number of blocks per inverse zfp transform task (when splitting a brick) */
+static constexpr i64 BlocksPerTask = 64;
+
+
+/* A block whose bit planes are decoded, but that is not yet inverse transformed */
+struct decoded_block
+{
+  u64 UInts[4 * 4 * 4] = {};
+  v3i D3;         // position of the block in the subband
+  v3i BlockDims3;
+  i16 EMax = 0;
+  i8 NBps = 0;
+  bool Transpose = false; // the bit planes were decoded by DecodeTest and still need a transpose
+};
+
+
+/* Inverse zfp transform a block and put its samples in the brick */
+static void
+InverseTransformBlock(decode_data* D, const grid& SbGrid, decoded_block* Block, volume* Vol)
+{
+  const int NDims = NumDims(Block->BlockDims3);
+  const int NVals = 1 << (2 * NDims);
+  const int Prec = idx2_BitSizeOf(u64) - 1 - NDims;
+  f64 BlockFloats[4 * 4 * 4];
+  buffer_t BufFloats(BlockFloats, NVals);
+  buffer_t BufInts((i64*)BlockFloats, NVals);
+  if (Block->Transpose)
+    TransposeRecursive(Block->UInts, Block->NBps);
+  InverseShuffle(Block->UInts, (i64*)BlockFloats, NDims);
+  InverseZfp((i64*)BlockFloats, NDims);
+  Dequantize(Block->EMax, Prec, BufInts, &BufFloats);
+  v3i S3;
+  int J = 0;
+  v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
+  timer DataTimer;
+  StartTimer(&DataTimer);
+  idx2_Assert(Vol->Buffer);
+#define Body(type)                                                                                 \
+  idx2_BeginFor3 (S3, v3i(0), Block->BlockDims3, v3i(1))                                           \
+  { /* sample loop */                                                                              \
+    Vol->At<type>(From3, Strd3, Block->D3 + S3) = type(BlockFloats[J++]);                          \
+  }                                                                                                \
+  idx2_EndFor3; /* end sample loop */
+  idx2_DispatchOnFloat(Vol->Type);
+#undef Body
+  D->DataMovementTime_ += ElapsedTime(&DataTimer);
+}
+
+
+/*
+Decode the subband of a brick. The bit planes of the blocks follow one another in the chunk streams,
+so they are decoded in order, but with Split the blocks are then inverse transformed in parallel.
+*/
 // TODO: we can detect the precision and switch to the avx2 version that uses float for better
 // performance
 // TODO: if a block does not decode any bit plane, no need to copy data afterwards
@@ -38,7 +102,9 @@ ParallelDecodeSubband(const idx2_file& Idx2,
                       f64 Tolerance,      // TODO: move to decode_state
                       const grid& SbGrid, // TODO: move to decode_state
                       hash_table<i16, bitstream>* StreamsPtr,
-                      brick_volume* BrickVol)       // TODO: move to decode_states
+                      array<shared_chunk<chunk_cache>*>* ChunksPtr, // chunks that StreamsPtr read from
+                      brick_volume* BrickVol,       // TODO: move to decode_states
+                      bool Split)
 {
   u64 Brick = Ds.Brick;
   v3i SbDims3 = Dims(SbGrid);
@@ -54,14 +120,18 @@ ParallelDecodeSubband(const idx2_file& Idx2,
   if (!ReadChunkExpResult)
     return Error(ReadChunkExpResult);
 
-  chunk_exp_cache ChunkExpCache = Value(ReadChunkExpResult); // make a copy to avoid data race
+  shared_chunk<chunk_exp_cache>* ChunkExp = Value(ReadChunkExpResult);
+  idx2_CleanUp(Release(ChunkExp));
   i32 BrickExpOffset = (Ds.BrickInChunk * BlockCount) * (SizeOf(Idx2.DType) > 4 ? 2 : 1);
-  bitstream BrickExpsStream = ChunkExpCache.ChunkExpStream;
+  bitstream BrickExpsStream = ChunkExp->Chunk.ChunkExpStream;
   SeekToByte(&BrickExpsStream, BrickExpOffset);
   u32 LastBlock = EncodeMorton3(v3<u32>(NBlocks3 - 1));
   const i8 NBitPlanes = idx2_BitSizeOf(u64);
   Clear(StreamsPtr);
+  idx2_CleanUp(ReleaseChunks(ChunksPtr));
 
+  idx2_RAII(array<decoded_block>, DecodedBlocks, if (Split) Reserve(&DecodedBlocks, BlockCount),
+            Dealloc(&DecodedBlocks));
   bool SubbandSignificant = false; // whether there is any significant block on this subband
   idx2_InclusiveFor (u32, Block, 0, LastBlock)
   { // zfp block loop
@@ -71,12 +141,10 @@ ParallelDecodeSubband(const idx2_file& Idx2,
     v3i BlockDims3 = Min(Idx2.BlockDims3, SbDims3 - D3);
     const int NDims = NumDims(BlockDims3);
     const int NVals = 1 << (2 * NDims);
-    const int Prec = NBitPlanes - 1 - NDims;
-    f64 BlockFloats[4 * 4 * 4];
-    buffer_t BufFloats(BlockFloats, NVals);
-    buffer_t BufInts((i64*)BlockFloats, NVals);
-    u64 BlockUInts[4 * 4 * 4] = {};
-    buffer_t BufUInts(BlockUInts, Prod(BlockDims3));
+    decoded_block Decoded;
+    Decoded.D3 = D3;
+    Decoded.BlockDims3 = BlockDims3;
+    u64* BlockUInts = Decoded.UInts;
 
     bool CodedInNextLevel =
       Ds.Subband == 0 && Ds.Level + 1 < Idx2.NLevels && BlockDims3 == Idx2.BlockDims3;
@@ -112,7 +180,9 @@ ParallelDecodeSubband(const idx2_file& Idx2,
         if (!ReadChunkResult)
           return Error(ReadChunkResult);
 
-        chunk_cache ChunkCache = Value(ReadChunkResult); // making a copy to avoid data race
+        shared_chunk<chunk_cache>* Chunk = Value(ReadChunkResult);
+        PushBack(ChunksPtr, Chunk);
+        const chunk_cache& ChunkCache = Chunk->Chunk;
         u64* BrickPos = BinarySearch(idx2_Range(ChunkCache.Bricks), Brick);
         idx2_Assert(BrickPos != End(ChunkCache.Bricks));
         //idx2_Assert(*BrickPos == Brick);
@@ -144,33 +214,27 @@ ParallelDecodeSubband(const idx2_file& Idx2,
     /* do inverse zfp transform but only if any bit plane is decoded */
     if (NBps > 0)
     {
-      if (NBitPlanesDecoded > 8)
-        TransposeRecursive(BlockUInts, NBps);
-
       // if the subband is not 0 or if this is the last level, we count this block
       // as significant, otherwise it is not significant
       bool CurrBlockSignificant = (Ds.Subband > 0 || Ds.Level + 1 == Idx2.NLevels);
       SubbandSignificant = SubbandSignificant || CurrBlockSignificant;
       ++D->NSignificantBlocks;
-      InverseShuffle(BlockUInts, (i64*)BlockFloats, NDims);
-      InverseZfp((i64*)BlockFloats, NDims);
-      Dequantize(EMax, Prec, BufInts, &BufFloats);
-      v3i S3;
-      int J = 0;
-      v3i From3 = From(SbGrid), Strd3 = Strd(SbGrid);
-      timer DataTimer;
-      StartTimer(&DataTimer);
-      volume& Vol = BrickVol->Vol;
-      idx2_Assert(Vol.Buffer);
-      idx2_BeginFor3 (S3, v3i(0), BlockDims3, v3i(1))
-      { // sample loop
-        idx2_Assert(D3 + S3 < SbDims3);
-        Vol.At<f64>(From3, Strd3, D3 + S3) = BlockFloats[J++];
-      }
-      idx2_EndFor3; // end sample loop
-      D->DataMovementTime_ += ElapsedTime(&DataTimer);
+      Decoded.EMax = EMax;
+      Decoded.NBps = NBps;
+      Decoded.Transpose = NBitPlanesDecoded > 8;
+      if (Split)
+        PushBack(&DecodedBlocks, Decoded);
+      else
+        InverseTransformBlock(D, SbGrid, &Decoded, &BrickVol->Vol);
     }
   }
+  if (Split)
+  {
+    ParallelFor(&D->ThreadPool, 0, Size(DecodedBlocks), BlocksPerTask, [&](i64 From, i64 To) {
+      idx2_For (i64, I, From, To)
+        InverseTransformBlock(D, SbGrid, &DecodedBlocks[I], &BrickVol->Vol);
+    });
+  }
   D->NInsignificantSubbands += (SubbandSignificant == false);
   // printf("%d\n", AnyBlockDecoded);
 
@@ -181,7 +245,6 @@ ParallelDecodeSubband(const idx2_file& Idx2,
 
 static expected<brick_volume, idx2_err_code>
 ParallelDecodeBrick(const idx2_file& Idx2,
-                    const params& P,
                     decode_data* D,
                     decode_state Ds,
                     f64 Tolerance)
@@ -189,14 +252,17 @@ ParallelDecodeBrick(const idx2_file& Idx2,
   i8 Level = Ds.Level;
   brick_volume BrickVol;
   volume& Vol = BrickVol.Vol;
-  Resize(&Vol, Idx2.BrickDimsExt3, dtype::float64, D->Alloc);
-  Fill(idx2_Range(f64, Vol), 0.0); // TODO: use memset
+  Resize(&Vol, Idx2.BrickDimsExt3, D->BrickType, D->Alloc);
+  memset(Vol.Buffer.Data, 0, Size(Vol.Buffer));
+  u64 BrickKey = GetBrickKey(Level, Ds.Brick);
+  bool Cached = Idx2.BrickLruCache && LookupBrick(Idx2.BrickLruCache, Idx2, BrickKey, Tolerance, &BrickVol);
 
   idx2_Assert(Size(Idx2.Subbands) <= 8);
 
-  bool Significant = false;
-  using stream_cache = hash_table<i16, bitstream>;
-  idx2_RAII(stream_cache, Streams, Init(&Streams, 7), Dealloc(&Streams));
+  /* the subbands are independent (they are in different chunks), except that subband 0 starts from
+  the parent's data */
+  i8 Subbands[8];
+  int NSubbands = 0;
   idx2_For (i8, Sb, 0, (i8)Size(Idx2.Subbands))
   {
     if (!BitSet(Idx2.DecodeSubbandMasks[Level], Sb))
@@ -211,43 +277,65 @@ ParallelDecodeBrick(const idx2_file& Idx2,
     {
       /* find the parent */
       v3i Brick3 = Ds.Brick3;
-      v3i PBrick3 = Brick3 / Idx2.GroupBrick3;
-      u64 PBrick = GetLinearBrick(Idx2, NextLevel, PBrick3);
-      u64 PKey = GetBrickKey(NextLevel, PBrick);
       brick_volume& Pb = Ds.ParentBrick;
       /* copy data from the parent to the current brick for subband 0 */
       v3i LocalBrickPos3 = Brick3 % Idx2.GroupBrick3;
       grid SbGridNonExt = S.Grid;
       SetDims(&SbGridNonExt, SbDimsNonExt3);
       extent PGrid(LocalBrickPos3 * SbDimsNonExt3, SbDimsNonExt3); // parent grid
-      CopyExtentGrid<f64, f64>(PGrid, Pb.Vol, SbGridNonExt, &Vol);
-      // if last child, delete the parent if needed
-      if (Brick3 == v3i(0)) // last child (the stack traversal goes backward)
+      if (!Cached)
       {
-        bool DeleteBrick = true;
-        if (P.OutMode == params::out_mode::HashMap)
-          DeleteBrick = !Pb.Significant;
-        if (DeleteBrick)
-        { // TODO: cannot delete the brick because we don't know if the last child is run last
-          // need a "cleanup" function to delete the brick later
-          Dealloc(&Pb.Vol);
-        }
-      } // end last child
+#define Body(type) CopyExtentGrid<type, type>(PGrid, Pb.Vol, SbGridNonExt, &Vol);
+        idx2_DispatchOnFloat(Vol.Type);
+#undef Body
+      }
+      // the parent is released by DecodeBrickTask once all its children have copied from it
     } // end subband 0
 
-    /* now we decode the subband */
-    Ds.Subband = Sb;
-    auto Result = ParallelDecodeSubband(Idx2, D, Ds, Tolerance, S.Grid, &Streams, &BrickVol);
-    if (!Result)
-      return Error(Result);
-    Significant = Significant || Value(Result);
+    Subbands[NSubbands++] = Sb;
   } // end subband loop
 
+  /* now we decode the subbands, in parallel if the brick is large enough */
+  bool Split = Prod<i64>(Idx2.BrickDims3) >= MinSamplesToSplitBrick;
+  expected<bool, idx2_err_code> Results[8];
+  auto DecodeSubbands = [&](i64 From, i64 To) {
+    using stream_cache = hash_table<i16, bitstream>;
+    idx2_RAII(stream_cache, Streams, Init(&Streams, 7), Dealloc(&Streams));
+    idx2_RAII(array<shared_chunk<chunk_cache>*>, Chunks, Reserve(&Chunks, 16), Dealloc(&Chunks));
+    idx2_For (i64, I, From, To)
+    {
+      decode_state SbDs = Ds;
+      SbDs.Subband = Subbands[I];
+      const grid& SbGrid = Idx2.Subbands[Subbands[I]].Grid;
+      Results[I] =
+        ParallelDecodeSubband(Idx2, D, SbDs, Tolerance, SbGrid, &Streams, &Chunks, &BrickVol, Split);
+    }
+  };
+  if (Cached)
+    NSubbands = 0;
+  else if (Split)
+    ParallelFor(&D->ThreadPool, 0, NSubbands, 1, DecodeSubbands);
+  else
+    DecodeSubbands(0, NSubbands);
+
+  bool Significant = false;
+  idx2_For (int, I, 0, NSubbands)
+  {
+    if (!Results[I])
+      return Error(Results[I]);
+    Significant = Significant || Value(Results[I]);
+  }
+
+  BrickVol.DoneDecoding = true;
+  if (Cached)
+    return BrickVol;
+
   bool CoarsestLevel = Level + 1 == Idx2.NLevels;
   InverseCdf53(Idx2.BrickDimsExt3, Ds.Level, Idx2.Subbands, Idx2.TransformDetails, &Vol, CoarsestLevel);
 
-  BrickVol.DoneDecoding = true;
   BrickVol.Significant = Significant;
+  if (Idx2.BrickLruCache)
+    Insert(Idx2.BrickLruCache, Idx2, BrickKey, Tolerance, BrickVol);
 
   return BrickVol;
 }
@@ -265,7 +353,7 @@ DecodeTask(const idx2_file& Idx2,
 {
   v3i B3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Ds.Level);
   /* --------------- Decode the brick --------------- */
-  auto Result = ParallelDecodeBrick(Idx2, P, D, Ds, Tolerance);
+  auto Result = ParallelDecodeBrick(Idx2, D, Ds, Tolerance);
   if (!Result)
     return Error(Result);
   // Copy the samples out to the output buffer (or file)
@@ -282,8 +370,10 @@ DecodeTask(const idx2_file& Idx2,
     {
       auto OutputVol =
         P.OutMode == params::out_mode::RegularGridFile ? &OutVol->Vol : OutVolMem;
-      auto CopyFunc = OutputVol->Type == dtype::float32 ? (CopyGridGrid<f64, f32>)
-                                                        : (CopyGridGrid<f64, f64>);
+      bool F32Out = OutputVol->Type == dtype::float32;
+      auto CopyFunc = BVol.Vol.Type == dtype::float32
+                        ? (F32Out ? CopyGridGrid<f32, f32> : CopyGridGrid<f32, f64>)
+                        : (F32Out ? CopyGridGrid<f64, f32> : CopyGridGrid<f64, f64>);
       CopyFunc(BrickGridLocal, BVol.Vol, Relative(OutBrickGrid, OutGrid), OutputVol);
       Dealloc(&BVol); // TODO: dealloc here or outside?
     }
@@ -322,99 +412,138 @@ DecodeTask(const idx2_file& Idx2,
 }
 
 
-error<idx2_err_code>
-TraverseSecondLevel(const idx2_file& Idx2,
-                    const params& P,
-                    decode_data* D,
-                    decode_state First,
-                    const extent& Extent,
-                    const grid& OutGrid,
-                    mmap_volume* OutVolFile,
-                    volume* OutVolMem)
+/* A decoded brick whose children copy their subband 0 from it, in any order and on any thread */
+struct parent_brick
+{
+  brick_volume Brick;
+  std::atomic<i64> NChildrenLeft = 0;
+};
+
+
+/* Free a brick that no child needs anymore (unless it is kept in the brick pool) */
+static void
+DeallocUnusedBrick(const params& P, brick_volume* Brick)
+{
+  bool DeleteBrick = true;
+  if (P.OutMode == params::out_mode::HashMap)
+    DeleteBrick = !Brick->Significant;
+  if (DeleteBrick)
+    Dealloc(&Brick->Vol);
+}
+
+
+static void
+ReleaseParent(const params& P, parent_brick* Parent)
+{
+  if (--Parent->NChildrenLeft > 0)
+    return;
+
+  DeallocUnusedBrick(P, &Parent->Brick);
+  delete Parent;
+}
+
+
+/*
+Decode one brick, then schedule its children, which become ready now that their parent (whose subband
+0 they need) is decoded. The children are pushed on the queue of the current worker, which runs the
+newest tasks first, so each worker walks its part of the tree depth first while the idle workers
+steal the oldest (i.e., coarsest) bricks from the others.
+*/
+static void
+DecodeBrickTask(const idx2_file& Idx2,
+                const params& P,
+                decode_data* D,
+                decode_state Ds,
+                parent_brick* Parent,
+                const grid& OutGrid,
+                mmap_volume* OutVolFile,
+                volume* OutVolMem)
 {
-  // then decode the subtree
   f64 Tolerance = Max(Idx2.Tolerance, P.DecodeTolerance);
-  int LastIndex = 0;
-  idx2_RAII(array<decode_state>, BrickStack, Reserve(&BrickStack, 128), Dealloc(&BrickStack));
-  PushBack(&BrickStack, First);
-  expected<brick_volume, idx2_err_code> Result;
-  while (Size(BrickStack) > 0)
+  if (Parent)
+    Ds.ParentBrick = Parent->Brick;
+  auto Result = DecodeTask(Idx2, P, D, Ds, OutGrid, Tolerance, OutVolFile, OutVolMem);
+  if (Parent)
+    ReleaseParent(P, Parent);
+  if (!Result)
   {
-    decode_state Current = Back(BrickStack);
-    //printf("level %d current " idx2_PrStrV3i "\n", Current.Level, idx2_PrV3i(Current.Brick3));
-    PopBack(&BrickStack);
-    i8 NextLevel = Current.Level - 1;
-    // TODO: check for error
-    v3i B3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Current.Level);
-    extent ExtentInBricks, ExtentInChunks, ExtentInFiles;
-    extent VolExtentInBricks, VolExtentInChunks, VolExtentInFiles;
-    extent CurrentExtent = extent(Current.Brick3 * B3, B3);
-    extent CurrentExtentCrop = Crop(CurrentExtent, P.DecodeExtent);
-    //printf("  extent     " idx2_PrStrExt "\n", idx2_PrExt(CurrentExtent));
-    //printf("  extent crop" idx2_PrStrExt "\n", idx2_PrExt(CurrentExtentCrop));
-    if (Prod<i64>(Dims(CurrentExtentCrop)) == 0)
-      continue;
-    Result = DecodeTask(Idx2, P, D, Current, OutGrid, Tolerance, OutVolFile, OutVolMem);
-    if (!Result)
-      goto EXIT;
+    std::unique_lock<std::mutex> Lock(D->Mutex);
+    if (!ErrorExists(D->TaskError))
+      D->TaskError = Error(Result);
+    return;
+  }
 
-    if (NextLevel < 0 || Idx2.DecodeSubbandMasks[NextLevel] == 0)
-      continue;
+  i8 NextLevel = Ds.Level - 1;
+  if (NextLevel < 0 || Idx2.DecodeSubbandMasks[NextLevel] == 0)
+    return; // DecodeTask has already copied the brick out
 
-    ComputeExtentsForTraversal(Idx2,
-                               CurrentExtent,
-                               NextLevel,
-                               &ExtentInBricks,
-                               &ExtentInChunks,
-                               &ExtentInFiles,
-                               &VolExtentInBricks,
-                               &VolExtentInChunks,
-                               &VolExtentInFiles);
-    idx2_FileTraverse(
-      idx2_ChunkTraverse(
-        idx2_BrickTraverse(
-          decode_state Ds;
-          Ds.BrickInChunk = Top.BrickInChunk;
-          Ds.Level = NextLevel;
-          Ds.Brick3 = Top.BrickFrom3;
-          Ds.Brick = GetLinearBrick(Idx2, NextLevel, Top.BrickFrom3);
-          Ds.ParentBrick = Value(Result);
-          PushBack(&BrickStack, Ds);
-          ,
-          64,
-          Idx2.BricksOrderInChunk[NextLevel],
-          ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[NextLevel],
-          Idx2.BricksPerChunk3s[NextLevel],
-          ExtentInBricks,
-          VolExtentInBricks);
+  /* collect the children that intersect the decode extent */
+  v3i B3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Ds.Level);
+  v3i ChildB3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, NextLevel);
+  extent ExtentInBricks, ExtentInChunks, ExtentInFiles;
+  extent VolExtentInBricks, VolExtentInChunks, VolExtentInFiles;
+  ComputeExtentsForTraversal(Idx2,
+                             extent(Ds.Brick3 * B3, B3),
+                             NextLevel,
+                             &ExtentInBricks,
+                             &ExtentInChunks,
+                             &ExtentInFiles,
+                             &VolExtentInBricks,
+                             &VolExtentInChunks,
+                             &VolExtentInFiles);
+  idx2_RAII(array<decode_state>, Children, Reserve(&Children, 8), Dealloc(&Children));
+  idx2_FileTraverse(
+    idx2_ChunkTraverse(
+      idx2_BrickTraverse(
+        extent ChildExtentCrop = Crop(extent(Top.BrickFrom3 * ChildB3, ChildB3), P.DecodeExtent);
+        if (Prod<i64>(Dims(ChildExtentCrop)) > 0)
+        {
+          decode_state Child;
+          Child.BrickInChunk = Top.BrickInChunk;
+          Child.Level = NextLevel;
+          Child.Brick3 = Top.BrickFrom3;
+          Child.Brick = GetLinearBrick(Idx2, NextLevel, Top.BrickFrom3);
+          PushBack(&Children, Child);
+          PrefetchBrickChunks(Idx2, D, Child.Brick, Child.Level);
+        }
         ,
         64,
-        Idx2.ChunksOrderInFile[NextLevel],
-        FileTop.FileFrom3 * Idx2.ChunksPerFile3s[NextLevel],
-        Idx2.ChunksPerFile3s[NextLevel],
-        ExtentInChunks,
-        VolExtentInChunks);
-      , 64, Idx2.FilesOrder[NextLevel], v3i(0), Idx2.NFiles3[NextLevel], ExtentInFiles, VolExtentInFiles);
-
+        Idx2.BricksOrderInChunk[NextLevel],
+        ChunkTop.ChunkFrom3 * Idx2.BricksPerChunk3s[NextLevel],
+        Idx2.BricksPerChunk3s[NextLevel],
+        ExtentInBricks,
+        VolExtentInBricks);
+      ,
+      64,
+      Idx2.ChunksOrderInFile[NextLevel],
+      FileTop.FileFrom3 * Idx2.ChunksPerFile3s[NextLevel],
+      Idx2.ChunksPerFile3s[NextLevel],
+      ExtentInChunks,
+      VolExtentInChunks);
+    , 64, Idx2.FilesOrder[NextLevel], v3i(0), Idx2.NFiles3[NextLevel], ExtentInFiles, VolExtentInFiles);
 
+  if (Size(Children) == 0)
+  {
+    DeallocUnusedBrick(P, &Value(Result));
+    return;
   }
 
-  EXIT:
+  parent_brick* NewParent = new parent_brick;
+  NewParent->Brick = Value(Result);
+  NewParent->NChildrenLeft = Size(Children);
+  /* push backward so that the worker decodes the children in traversal (and prefetch) order */
+  idx2_InclusiveForBackward (i64, I, Size(Children) - 1, 0)
   {
-    std::unique_lock<std::mutex> Lock(D->Mutex);
-    --D->NTasks;
+    decode_state Child = Children[I];
+    Push(&D->ThreadPool, [&Idx2, &P, D, Child, NewParent, &OutGrid, OutVolFile, OutVolMem]() {
+      DecodeBrickTask(Idx2, P, D, Child, NewParent, OutGrid, OutVolFile, OutVolMem);
+    });
   }
-  if (D->NTasks == 0)
-    D->AllTasksDone.notify_all();
-
-  if (!Result)
-    return Error(Result);
-
-  return idx2_Error(idx2_err_code::NoError);
 }
 
 
-error<idx2_err_code>
+/* Schedule one task per brick on the coarsest level, each of which schedules its children */
+static void
 TraverseFirstLevel(const idx2_file& Idx2,
                    const params& P,
                    decode_data* D,
@@ -435,30 +564,22 @@ TraverseFirstLevel(const idx2_file& Idx2,
                              &VolExtentInChunks,
                              &VolExtentInFiles);
   v3i B3 = Idx2.BrickDims3 * Pow(Idx2.GroupBrick3, Level); // dimension of bricks on this level
-  decode_state Ds;
   idx2_FileTraverse(
     idx2_ChunkTraverse(
       idx2_BrickTraverse(
-        extent BrickExtent = extent(Top.BrickFrom3 * B3, B3);
-        extent BrickExtentCrop = Crop(BrickExtent, P.DecodeExtent);
+        extent BrickExtentCrop = Crop(extent(Top.BrickFrom3 * B3, B3), P.DecodeExtent);
+        if (Prod<i64>(Dims(BrickExtentCrop)) > 0)
         {
-          std::unique_lock<std::mutex> Lock(D->Mutex);
-          ++D->NTasks;
+          decode_state First;
+          First.BrickInChunk = Top.BrickInChunk;
+          First.Level = Level;
+          First.Brick3 = Top.BrickFrom3;
+          First.Brick = GetLinearBrick(Idx2, Level, Top.BrickFrom3);
+          PrefetchBrickChunks(Idx2, D, First.Brick, Level);
+          Push(&D->ThreadPool, [&Idx2, &P, D, First, &OutGrid, OutVolFile, OutVolMem]() {
+            DecodeBrickTask(Idx2, P, D, First, nullptr, OutGrid, OutVolFile, OutVolMem);
+          });
         }
-        decode_state First;
-        First.BrickInChunk = Top.BrickInChunk;
-        First.Level = Level;
-        First.Brick3 = Top.BrickFrom3;
-        First.Brick = GetLinearBrick(Idx2, Level, Top.BrickFrom3);
-        D->ThreadPool.push_task([&, First, BrickExtentCrop]() {
-          TraverseSecondLevel(Idx2, P, D, First, BrickExtentCrop, OutGrid, OutVolFile, OutVolMem);
-        });
-        //auto Task = stlab::async(stlab::default_executor,
-        //  [&, First, BrickExtentCrop]()
-        //  {
-        //    TraverseSecondLevel(Idx2, P, D, First, BrickExtentCrop, OutGrid, OutVolFile, OutVolMem);
-        //  });
-        //Task.detach();
         ,
         64,
         Idx2.BricksOrderInChunk[Level],
@@ -474,8 +595,6 @@ TraverseFirstLevel(const idx2_file& Idx2,
       ExtentInChunks,
       VolExtentInChunks);
     , 64, Idx2.FilesOrder[Level], v3i(0), Idx2.NFiles3[Level], ExtentInFiles, VolExtentInFiles);
-
-  return idx2_Error(idx2_err_code::NoError);
 }
 
 
@@ -515,15 +634,20 @@ ParallelDecode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
     OutVolMem.Type = Idx2.DType;
   }
 
-  const int BrickBytes = Prod(Idx2.BrickDimsExt3) * sizeof(f64);
-  // for now the allocator seems not a bottleneck
-  idx2_RAII(decode_data, D, Init(&D, &Idx2, &Mallocator()));
+  idx2_RAII(decode_data, D, Init(&D, &Idx2));
+  SetReadParams(&D, Idx2, P);
+  if (P.IOThreads > 0)
+    D.IOThreadPool.reset(new BS::thread_pool(P.IOThreads));
+
+  Init(&D.ThreadPool);
 
   TraverseFirstLevel(Idx2, P, &D, OutGrid, &OutVolFile, &OutVolMem);
 
-  std::unique_lock<std::mutex> Lock(D.Mutex);
-  D.AllTasksDone.wait(Lock, [&D]{ return D.NTasks == 0; });
-  //stlab::pre_exit();
+  WaitForTasks(&D.ThreadPool);
+  if (D.IOThreadPool) // the remaining reads are not needed, but they refer to D
+    D.IOThreadPool->wait_for_tasks();
+  if (ErrorExists(D.TaskError))
+    return D.TaskError;
 
   if (P.OutMode == params::out_mode::HashMap)
   {
@@ -542,6 +666,10 @@ ParallelDecode(const idx2_file& Idx2, const params& P, buffer* OutBuf)
   printf("final size of brick hashmap = %" PRIi64 "\n", Size(D.BrickPool.BrickTable));
   printf("number of significant blocks = %" PRIi64 "\n", D.NSignificantBlocks.load());
   printf("number of insignificant subbands = %" PRIi64 "\n", D.NInsignificantSubbands.load());
+  if (Idx2.ChunkLruCache)
+    PrintStatistics(Idx2.ChunkLruCache);
+  if (Idx2.BrickLruCache)
+    PrintStatistics(Idx2.BrickLruCache);
 
   return idx2_Error(err_code::NoError);
 }
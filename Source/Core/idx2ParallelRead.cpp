@@ -34,22 +34,14 @@ namespace idx2
  * M : H buffers, whose sizes are encoded in L, each being one bit plane chunk
  */
 static error<idx2_err_code>
-ParallelReadFile(const idx2_file& Idx2,
-                 decode_data* D,
-                 file_cache_table::iterator* FileCacheIt,
-                 const file_id& FileId)
+ParallelReadFile(const idx2_file& Idx2, decode_data* D, const file_id& FileId, file_cache* FileCache)
 {
-#if VISUS_IDX2
-  if (Idx2.external_read)
-    return idx2_Error(idx2_err_code::NoError);
-#endif
+  if (Idx2.FooterIndex)
+    return ReadFooterIndex(Idx2, FileId, FileCache, false);
 
   timer IOTimer;
   StartTimer(&IOTimer);
 
-  if (*FileCacheIt && FileCacheIt->Val->DataCached)
-    return idx2_Error(idx2_err_code::NoError);
-
   idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
   idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
   idx2_FSeek(Fp, 0, SEEK_END);
@@ -83,104 +75,28 @@ ParallelReadFile(const idx2_file& Idx2,
   InitRead(&ChunkSizeStream, ChunkSizesBuf);
 
   /* parse the chunk addresses and cache in memory */
-  file_cache FileCache;
   i64 AccumSize = 0;
-  Init(&FileCache.ChunkCaches, 10);
   idx2_For (int, I, 0, NChunks)
   {
     i64 ChunkSize = ReadVarByte(&ChunkSizeStream); // TODO: use i32 for chunk size
     u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + I);
     chunk_cache ChunkCache;
     ChunkCache.ChunkPos = I;
-    Insert(&FileCache.ChunkCaches, ChunkAddr, ChunkCache);
+    Insert(&FileCache->ChunkCaches, ChunkAddr, ChunkCache);
+    u64 Brick;
+    i8 Level, Subband;
+    i16 BpKey;
+    UnpackChunkAddress(Idx2, ChunkAddr, &Brick, &Level, &Subband, &BpKey);
+    FileCache->MaxBpKey = Max(FileCache->MaxBpKey, BpKey);
     // printf("chunk %llu size = %lld\n", ChunkAddr, ChunkSize);
-    PushBack(&FileCache.ChunkOffsets, AccumSize += ChunkSize);
+    PushBack(&FileCache->ChunkOffsets, AccumSize += ChunkSize);
   }
   idx2_Assert(Size(ChunkSizeStream) == ChunkSizesSz);
 
-  if (!*FileCacheIt) // the file cache does not exist
-  {                  // insert a new file cache
-    Insert(FileCacheIt, FileId.Id, FileCache);
-  }
-  else // the file cache exists
-  {    // modify the chunk caches portion of the file cache
-    idx2_Assert(Size(FileCacheIt->Val->ChunkCaches) == 0);
-    FileCacheIt->Val->ChunkCaches = FileCache.ChunkCaches;
-    FileCacheIt->Val->ChunkOffsets = FileCache.ChunkOffsets;
-  }
-  FileCacheIt->Val->DataCached = true;
-
   return idx2_Error(idx2_err_code::NoError);
 }
 
 
-/* Given a brick address, read the chunk associated with the brick and cache the chunk */
-expected<chunk_cache, idx2_err_code>
-ParallelReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband, i16 BpKey)
-{
-#if VISUS_IDX2
-  if (Idx2.external_read)
-  {
-    std::unique_lock<std::mutex> Lock(D->FileCacheMutex);
-    u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
-    auto ChunkCacheIt = Lookup(D->FileCache.ChunkCaches, ChunkAddress);
-    if (ChunkCacheIt)
-      return *ChunkCacheIt.Val;
-
-    bitstream ChunkStream;
-    bool Result = Idx2.external_read(Idx2, ChunkStream.Stream, ChunkAddress).get();
-    idx2_ReturnErrorIf(!Result, idx2_err_code::ChunkNotFound);
-
-    // decompress part
-    chunk_cache ChunkCache;
-    DecompressChunk(&ChunkStream, &ChunkCache, ChunkAddress, Log2Ceil(Idx2.BricksPerChunk[Level]));
-    Insert(&ChunkCacheIt, ChunkAddress, ChunkCache);
-    return *ChunkCacheIt.Val;
-  }
-#endif
-
-  std::unique_lock<std::mutex> Lock(D->FileCacheMutex);
-  file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, BpKey);
-  // TODO: lock and be careful about invalidated pointer
-  auto FileCacheIt = Lookup(D->FileCacheTable, FileId.Id);
-  auto Result = ParallelReadFile(Idx2, D, &FileCacheIt, FileId);
-  if (!Result || !FileCacheIt)
-    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
-
-  /* find the appropriate chunk */
-  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
-  const file_cache* FileCache = FileCacheIt.Val;
-  decltype(FileCache->ChunkCaches)::iterator ChunkCacheIt;
-  // TODO: lock and be careful about invalidated pointer
-  ChunkCacheIt = Lookup(FileCache->ChunkCaches, ChunkAddress);
-  if (!ChunkCacheIt)
-    return idx2_Error(idx2_err_code::ChunkNotFound);
-  chunk_cache* ChunkCache = ChunkCacheIt.Val;
-  if (Size(ChunkCache->ChunkStream.Stream) == 0) // chunk has not been loaded
-  {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    if (!Fp)
-      return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
-    i32 ChunkPos = ChunkCache->ChunkPos;
-    i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkOffsets[ChunkPos - 1] : 0;
-    i64 ChunkSize = FileCache->ChunkOffsets[ChunkPos] - ChunkOffset;
-    idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
-    bitstream ChunkStream;
-    // NOTE: not a memory leak since we will keep track of this in ChunkCache
-    InitWrite(&ChunkStream, ChunkSize);
-    ReadBuffer(Fp, &ChunkStream.Stream);
-    D->BytesData_ += Size(ChunkStream.Stream);
-    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
-    // TODO: check for error
-    DecompressChunk(&ChunkStream, ChunkCache, ChunkAddress, Log2Ceil(Idx2.BricksPerChunk[Level]));
-  }
-
-  return *ChunkCache;
-}
-
-
 /* Read and decode the sizes of the compressed exponent chunks in a file */
 /* Structure of a file
  * -------- beginning of file --------
@@ -209,21 +125,15 @@ ParallelReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8
 static error<idx2_err_code>
 ParallelReadFileExponents(const idx2_file& Idx2,
                           decode_data* D,
-                          i8 Level,
-                          file_cache_table::iterator* FileCacheIt,
-                          const file_id& FileId)
+                          const file_id& FileId,
+                          file_cache* FileCache)
 {
-#if VISUS_IDX2
-  if (Idx2.external_read)
-    return idx2_Error(idx2_err_code::NoError);
-#endif
+  if (Idx2.FooterIndex)
+    return ReadFooterIndex(Idx2, FileId, FileCache, true);
 
   timer IOTimer;
   StartTimer(&IOTimer);
 
-  if (*FileCacheIt && FileCacheIt->Val->ExpCached)
-    return idx2_Error(idx2_err_code::NoError);
-
   idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
   idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
   idx2_FSeek(Fp, 0, SEEK_END);
@@ -253,22 +163,20 @@ ParallelReadFileExponents(const idx2_file& Idx2,
   bitstream ChunkExpSizesStream;
   InitRead(&ChunkExpSizesStream, ChunkExpSizesBuf);
 
-  file_cache FileCache;
-  Init(&FileCache.ChunkExpCaches, 10);
-  FileCache.ExponentBeginOffset = FileSize - ExponentSize;
-  Reserve(&FileCache.ChunkExpOffsets, S);
+  FileCache->ExponentBeginOffset = FileSize - ExponentSize;
+  Reserve(&FileCache->ChunkExpOffsets, S);
   i32 CeSz = 0;
   // we compute a "prefix sum" of the sizes to get the offsets
   int NChunks2 = 0;
   while (Size(ChunkExpSizesStream) < S)
   {
-    PushBack(&FileCache.ChunkExpOffsets, CeSz += (i32)ReadVarByte(&ChunkExpSizesStream));
+    PushBack(&FileCache->ChunkExpOffsets, CeSz += (i32)ReadVarByte(&ChunkExpSizesStream));
     u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + NChunks2);
     chunk_exp_cache ChunkExpCache;
     ChunkExpCache.ChunkPos = NChunks2;
     // NOTE: here we rely on the fact that the exponent chunks are sorted by increasing subband in
     // each file
-    Insert(&FileCache.ChunkExpCaches, ChunkAddr, ChunkExpCache);
+    Insert(&FileCache->ChunkExpCaches, ChunkAddr, ChunkExpCache);
     ++NChunks2;
   }
 
@@ -286,26 +194,205 @@ ParallelReadFileExponents(const idx2_file& Idx2,
   // Resize(&FileCache.ChunkCaches, Size(FileCache.ChunkExpOffsets));
   idx2_Assert(Size(ChunkExpSizesStream) == S);
 
-  if (!*FileCacheIt) // file cache exists
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+/*
+Return the cache of a file, making sure that its chunk information (or exponent chunk information if
+Exponents is true) has been read. The lock on the shard of the file must be held when calling this
+function. It is released while the file is being read, so the returned pointer is only valid until
+the lock is released again.
+*/
+static expected<file_cache*, idx2_err_code>
+ParallelLoadFileCache(const idx2_file& Idx2,
+                      decode_data* D,
+                      file_cache_shard* Shard,
+                      std::unique_lock<std::mutex>* Lock,
+                      const file_id& FileId,
+                      bool Exponents)
+{
+  while (true)
   {
-    Insert(FileCacheIt, FileId.Id, FileCache);
+    auto FileCacheIt = Lookup(Shard->FileCaches, FileId.Id);
+    if (!FileCacheIt)
+    {
+      file_cache FileCache;
+      Init(&FileCache);
+      Insert(&FileCacheIt, FileId.Id, FileCache);
+    }
+    file_cache* FileCache = FileCacheIt.Val;
+    if (Exponents ? FileCache->ExpCached : FileCache->DataCached)
+      return FileCache;
+    bool& Loading = Exponents ? FileCache->ExpLoading : FileCache->DataLoading;
+    if (Loading) // wait for the other thread, then look again since the table may have grown
+    {
+      Shard->Loaded.wait(*Lock);
+      continue;
+    }
+
+    Loading = true;
+    Lock->unlock();
+    file_cache NewCache;
+    Init(&NewCache);
+    auto Result = Exponents ? ParallelReadFileExponents(Idx2, D, FileId, &NewCache)
+                            : ParallelReadFile(Idx2, D, FileId, &NewCache);
+    Lock->lock();
+
+    FileCache = Lookup(Shard->FileCaches, FileId.Id).Val;
+    if (Exponents)
+    {
+      FileCache->ExpLoading = false;
+      if (Result)
+      {
+        FileCache->ExponentBeginOffset = NewCache.ExponentBeginOffset;
+        Swap(&FileCache->ChunkExpOffsets, &NewCache.ChunkExpOffsets);
+        Swap(&FileCache->ChunkExpCaches, &NewCache.ChunkExpCaches);
+        FileCache->ExpCached = true;
+      }
+    }
+    else
+    {
+      FileCache->DataLoading = false;
+      if (Result)
+      {
+        Swap(&FileCache->ChunkOffsets, &NewCache.ChunkOffsets);
+        Swap(&FileCache->ChunkCaches, &NewCache.ChunkCaches);
+        FileCache->MaxBpKey = NewCache.MaxBpKey;
+        FileCache->DataCached = true;
+      }
+    }
+    Dealloc(&NewCache);
+    Shard->Loaded.notify_all();
+    if (!Result)
+      return Result;
+    return FileCache;
   }
-  else // file cache does not exist
+}
+
+
+idx2_Inline file_cache_shard*
+GetFileCacheShard(decode_data* D, u64 FileId)
+{
+  return &D->FileCacheShards[Hash(FileId) & (D->NFileCacheShards - 1)];
+}
+
+
+/* Given a brick address, read the chunk associated with the brick and cache the chunk */
+expected<shared_chunk<chunk_cache>*, idx2_err_code>
+ParallelReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband, i16 BpKey)
+{
+#if VISUS_IDX2
+  if (Idx2.external_read)
   {
-    idx2_Assert(Size(FileCacheIt->Val->ChunkExpCaches) == 0);
-    FileCacheIt->Val->ExponentBeginOffset = FileCache.ExponentBeginOffset;
-    FileCacheIt->Val->ChunkExpOffsets = FileCache.ChunkExpOffsets;
-    FileCacheIt->Val->ChunkExpCaches = FileCache.ChunkExpCaches;
+    std::unique_lock<std::mutex> Lock(D->FileCacheMutex);
+    u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
+    auto ChunkCacheIt = Lookup(D->FileCache.ChunkCaches, ChunkAddress);
+    if (ChunkCacheIt)
+      return Acquire(ChunkCacheIt.Val->Shared);
+
+    bitstream ChunkStream;
+    bool Result = Idx2.external_read(Idx2, ChunkStream.Stream, ChunkAddress).get();
+    idx2_ReturnErrorIf(!Result, idx2_err_code::ChunkNotFound);
+
+    // decompress part
+    chunk_cache ChunkCache;
+    ChunkCache.Shared = new shared_chunk<chunk_cache>;
+    DecompressChunk(&ChunkStream, &ChunkCache.Shared->Chunk, ChunkAddress, Log2Ceil(Idx2.BricksPerChunk[Level]));
+    ChunkCache.Ready = true;
+    Insert(&ChunkCacheIt, ChunkAddress, ChunkCache);
+    return Acquire(ChunkCache.Shared);
   }
-  FileCacheIt->Val->ExpCached = true;
+#endif
 
-  return idx2_Error(idx2_err_code::NoError);
+  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
+  if (Idx2.ChunkLruCache)
+  {
+    if (auto Cached = LookupChunk(Idx2.ChunkLruCache, ChunkAddress))
+      return Cached;
+  }
+
+  file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, BpKey);
+  file_cache_shard* Shard = GetFileCacheShard(D, FileId.Id);
+  std::unique_lock<std::mutex> Lock(Shard->Mutex);
+  auto FileCacheResult = ParallelLoadFileCache(Idx2, D, Shard, &Lock, FileId, false);
+  if (!FileCacheResult)
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+
+  /* find the appropriate chunk */
+  file_cache* FileCache = Value(FileCacheResult);
+  auto ChunkCacheIt = Lookup(FileCache->ChunkCaches, ChunkAddress);
+  if (!ChunkCacheIt)
+    return idx2_Error(idx2_err_code::ChunkNotFound);
+  // no chunk cache is inserted once the file is cached, so this pointer stays valid without the lock
+  chunk_cache* ChunkCache = ChunkCacheIt.Val;
+  while (ChunkCache->Loading)
+    Shard->Loaded.wait(Lock);
+  if (ChunkCache->Ready)
+    return Acquire(ChunkCache->Shared);
+
+  /* the chunk has not been loaded, load it without holding the lock */
+  ChunkCache->Loading = true;
+  i32 ChunkPos = ChunkCache->ChunkPos;
+  i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkOffsets[ChunkPos - 1] : 0;
+  i64 ChunkSize = FileCache->ChunkOffsets[ChunkPos] - ChunkOffset;
+  const byte* MappedChunk = nullptr; // the mapping lives as long as the file cache
+  if (D->MapFiles && MapFileCache(FileCache, FileId) &&
+      ChunkOffset + ChunkSize <= Size(FileCache->MappedFile.Buf))
+    MappedChunk = FileCache->MappedFile.Buf.Data + ChunkOffset;
+  Lock.unlock();
+
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  auto Shared = new shared_chunk<chunk_cache>;
+  bool Loaded = false;
+  FILE* Fp = D->MapFiles ? nullptr : fopen(FileId.Name.ConstPtr, "rb");
+  if (MappedChunk || Fp)
+  {
+    bitstream ChunkStream;
+    if (MappedChunk)
+    { // the chunk stream points directly into the mapping
+      InitRead(&ChunkStream, buffer(MappedChunk, ChunkSize));
+    }
+    else
+    {
+      idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
+      // NOTE: not a memory leak since we will keep track of this in ChunkCache
+      InitWrite(&ChunkStream, ChunkSize);
+      ReadBuffer(Fp, &ChunkStream.Stream);
+      fclose(Fp);
+    }
+    D->BytesData_ += Size(ChunkStream.Stream);
+    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
+    // TODO: check for error
+    DecompressChunk(&ChunkStream, &Shared->Chunk, ChunkAddress, Log2Ceil(Idx2.BricksPerChunk[Level]));
+    Loaded = true;
+  }
+
+  Lock.lock();
+  ChunkCache->Loading = false;
+  if (Loaded)
+  {
+    ChunkCache->Shared = Shared; // the cache keeps the first reference
+    ChunkCache->Ready = true;
+  }
+  Shard->Loaded.notify_all();
+  if (!Loaded)
+  {
+    Release(Shared);
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+  }
+  Lock.unlock();
+  if (Idx2.ChunkLruCache)
+    Insert(Idx2.ChunkLruCache, ChunkAddress, Shared);
+
+  return Acquire(Shared);
 }
 
 
 /* Given a brick address, read the exponent chunk associated with the brick and cache it */
 // TODO: remove the last two params (already stored in D)
-expected<chunk_exp_cache, idx2_err_code>
+expected<shared_chunk<chunk_exp_cache>*, idx2_err_code>
 ParallelReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband)
 {
 #if VISUS_IDX2
@@ -315,7 +402,7 @@ ParallelReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8
     u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, ExponentBitPlane_);
     auto ChunkExpCacheIt = Lookup(D->FileCache.ChunkExpCaches, ChunkAddress);
     if (ChunkExpCacheIt)
-      return *ChunkExpCacheIt.Val;
+      return Acquire(ChunkExpCacheIt.Val->Shared);
 
     // here we release he lock and read the chunk
     // read the block
@@ -325,58 +412,162 @@ ParallelReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8
 
     // decompress the block
     chunk_exp_cache ChunkExpCache;
-    bitstream& ChunkExpStream = ChunkExpCache.ChunkExpStream;
+    ChunkExpCache.Shared = new shared_chunk<chunk_exp_cache>;
+    bitstream& ChunkExpStream = ChunkExpCache.Shared->Chunk.ChunkExpStream;
     DecompressBufZstd(buff, &ChunkExpStream);
-    InitRead(&ChunkExpCache.ChunkExpStream, ChunkExpStream.Stream);
+    InitRead(&ChunkExpStream, ChunkExpStream.Stream);
+    ChunkExpCache.Ready = true;
     Insert(&ChunkExpCacheIt, ChunkAddress, ChunkExpCache);
-    return *ChunkExpCacheIt.Val;
+    return Acquire(ChunkExpCache.Shared);
   }
 #endif
-  std::unique_lock<std::mutex> Lock(D->FileCacheMutex);
+  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, ExponentBitPlane_);
+  if (Idx2.ChunkLruCache)
+  {
+    if (auto Cached = LookupChunkExp(Idx2.ChunkLruCache, ChunkAddress))
+      return Cached;
+  }
+
   file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, ExponentBitPlane_);
-  auto FileCacheIt = Lookup(D->FileCacheTable, FileId.Id);
-  auto Result = ParallelReadFileExponents(Idx2, D, Level, &FileCacheIt, FileId);
-  if (!Result || !FileCacheIt)
+  file_cache_shard* Shard = GetFileCacheShard(D, FileId.Id);
+  std::unique_lock<std::mutex> Lock(Shard->Mutex);
+  auto FileCacheResult = ParallelLoadFileCache(Idx2, D, Shard, &Lock, FileId, true);
+  if (!FileCacheResult)
     return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
 
   /* find the appropriate chunk */
-  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, ExponentBitPlane_);
-  file_cache* FileCache = FileCacheIt.Val;
-  decltype(FileCache->ChunkExpCaches)::iterator ChunkCacheIt;
-  // TODO: lock and be careful about invalidated pointer
-  ChunkCacheIt = Lookup(FileCache->ChunkExpCaches, ChunkAddress);
+  file_cache* FileCache = Value(FileCacheResult);
+  auto ChunkCacheIt = Lookup(FileCache->ChunkExpCaches, ChunkAddress);
   if (!ChunkCacheIt)
     return idx2_Error(idx2_err_code::ChunkNotFound);
-
+  // no chunk cache is inserted once the file is cached, so this pointer stays valid without the lock
   chunk_exp_cache* ChunkExpCache = ChunkCacheIt.Val;
-  if (Size(ChunkExpCache->ChunkExpStream.Stream) == 0) // chunk has not been loaded
+  while (ChunkExpCache->Loading)
+    Shard->Loaded.wait(Lock);
+  if (ChunkExpCache->Ready)
+    return Acquire(ChunkExpCache->Shared);
+
+  /* the chunk has not been loaded, load it without holding the lock */
+  ChunkExpCache->Loading = true;
+  i32 ChunkPos = ChunkExpCache->ChunkPos;
+  i64 ChunkExpOffset = FileCache->ExponentBeginOffset;
+  i32 ChunkExpSize = FileCache->ChunkExpOffsets[ChunkPos];
+  if (ChunkPos > 0)
+  {
+    i32 PrevChunkOffset = FileCache->ChunkExpOffsets[ChunkPos - 1];
+    ChunkExpOffset += PrevChunkOffset;
+    ChunkExpSize -= PrevChunkOffset;
+  }
+  const byte* MappedChunk = nullptr; // the mapping lives as long as the file cache
+  if (D->MapFiles && MapFileCache(FileCache, FileId) &&
+      ChunkExpOffset + ChunkExpSize <= Size(FileCache->MappedFile.Buf))
+    MappedChunk = FileCache->MappedFile.Buf.Data + ChunkExpOffset;
+  Lock.unlock();
+
+  timer IOTimer;
+  StartTimer(&IOTimer);
+  auto Shared = new shared_chunk<chunk_exp_cache>;
+  bitstream& ChunkExpStream = Shared->Chunk.ChunkExpStream;
+  bool Loaded = false;
+  FILE* Fp = D->MapFiles ? nullptr : fopen(FileId.Name.ConstPtr, "rb");
+  if (MappedChunk)
+  { // decompress straight from the mapping
+    DecompressBufZstd(buffer(MappedChunk, ChunkExpSize), &ChunkExpStream);
+  }
+  else if (Fp)
   {
-    timer IOTimer;
-    StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    if (!Fp)
-      return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
-    i32 ChunkPos = ChunkExpCache->ChunkPos;
-    i64 ChunkExpOffset = FileCache->ExponentBeginOffset;
-    i32 ChunkExpSize = FileCache->ChunkExpOffsets[ChunkPos];
-    if (ChunkPos > 0)
-    {
-      i32 PrevChunkOffset = FileCache->ChunkExpOffsets[ChunkPos - 1];
-      ChunkExpOffset += PrevChunkOffset;
-      ChunkExpSize -= PrevChunkOffset;
-    }
     idx2_FSeek(Fp, ChunkExpOffset, SEEK_SET);
-    bitstream& ChunkExpStream = ChunkExpCache->ChunkExpStream;
     idx2_ScopeBuffer(CompressedChunkExpsBuf, ChunkExpSize);
     ReadBuffer(Fp, &CompressedChunkExpsBuf, ChunkExpSize);
+    fclose(Fp);
     DecompressBufZstd(CompressedChunkExpsBuf, &ChunkExpStream);
+  }
+  if (MappedChunk || Fp)
+  {
     D->BytesDecoded_ += ChunkExpSize;
     D->BytesExps_ += ChunkExpSize;
     D->DecodeIOTime_ += ElapsedTime(&IOTimer);
     InitRead(&ChunkExpStream, ChunkExpStream.Stream);
+    Loaded = true;
+  }
+
+  Lock.lock();
+  ChunkExpCache->Loading = false;
+  if (Loaded)
+  {
+    ChunkExpCache->Shared = Shared; // the cache keeps the first reference
+    ChunkExpCache->Ready = true;
   }
+  Shard->Loaded.notify_all();
+  if (!Loaded)
+  {
+    Release(Shared);
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+  }
+  Lock.unlock();
+  if (Idx2.ChunkLruCache)
+    Insert(Idx2.ChunkLruCache, ChunkAddress, Shared);
 
-  return *ChunkCacheIt.Val;
+  return Acquire(Shared);
+}
+
+
+/* Load the chunks of one subband of a brick, from the highest bit plane down to D->MinBpKey */
+static void
+PrefetchSubbandChunks(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband)
+{
+  auto ChunkExpResult = ParallelReadChunkExponents(Idx2, D, Brick, Level, Subband);
+  if (!ChunkExpResult)
+    return; // the decoder will report the error
+  Release(Value(ChunkExpResult));
+
+  i16 MaxBpKey = 0;
+  {
+    file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, 0);
+    file_cache_shard* Shard = GetFileCacheShard(D, FileId.Id);
+    std::unique_lock<std::mutex> Lock(Shard->Mutex);
+    auto FileCacheResult = ParallelLoadFileCache(Idx2, D, Shard, &Lock, FileId, false);
+    if (!FileCacheResult)
+      return;
+    MaxBpKey = Value(FileCacheResult)->MaxBpKey;
+  }
+  idx2_InclusiveForBackward (i16, BpKey, MaxBpKey, D->MinBpKey)
+  {
+    auto ChunkResult = ParallelReadChunk(Idx2, D, Brick, Level, Subband, BpKey);
+    if (ChunkResult) // not every bit plane has a chunk
+      Release(Value(ChunkResult));
+  }
+}
+
+
+void
+PrefetchBrickChunks(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level)
+{
+#if VISUS_IDX2
+  if (Idx2.external_read)
+    return;
+#endif
+  if (!D->IOThreadPool)
+    return;
+
+  /* the bricks of a chunk share the same chunks, so the loads are started once per chunk */
+  u64 Chunk = Brick >> Log2Ceil(Idx2.BricksPerChunk[Level]);
+  {
+    std::unique_lock<std::mutex> Lock(D->PrefetchMutex);
+    u64 ChunkKey = GetBrickKey(Level, Chunk);
+    auto It = Lookup(D->PrefetchedChunks, ChunkKey);
+    if (It)
+      return;
+    Insert(&It, ChunkKey, true);
+  }
+  idx2_For (i8, Sb, 0, (i8)Size(Idx2.Subbands))
+  {
+    if (!BitSet(Idx2.DecodeSubbandMasks[Level], Sb))
+      continue;
+    D->IOThreadPool->push_task([&Idx2, D, Brick, Level, Sb]() {
+      PrefetchSubbandChunks(Idx2, D, Brick, Level, Sb);
+    });
+  }
 }
 
 
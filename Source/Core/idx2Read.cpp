@@ -7,6 +7,8 @@
 #include "idx2Lookup.h"
 #include "idx2Read.h"
 #include "idx2Decode.h"
+#include "idx2FooterIndex.h"
+#include <algorithm>
 
 namespace idx2
 {
@@ -16,7 +18,10 @@ Dealloc(chunk_cache* ChunkCache)
 {
   Dealloc(&ChunkCache->Bricks);
   Dealloc(&ChunkCache->BrickOffsets);
-  Dealloc(&ChunkCache->ChunkStream);
+  if (ChunkCache->ChunkStream.Stream.Alloc) // otherwise the stream points into a file mapping
+    Dealloc(&ChunkCache->ChunkStream);
+  if (ChunkCache->Shared)
+    Release(ChunkCache->Shared);
 }
 
 
@@ -24,6 +29,8 @@ void
 Dealloc(chunk_exp_cache* ChunkExpCache)
 {
   Dealloc(&ChunkExpCache->ChunkExpStream);
+  if (ChunkExpCache->Shared)
+    Release(ChunkExpCache->Shared);
 }
 
 void
@@ -38,13 +45,88 @@ void
 Dealloc(file_cache* FileCache)
 {
   Dealloc(&FileCache->ChunkOffsets);
-  idx2_ForEach (CIt, FileCache->ChunkCaches)
-    Dealloc(&*CIt);
+  // a file may have had only its exponent chunks (or only its bit plane chunks) read
+  if (FileCache->ChunkCaches.Alloc)
+  {
+    idx2_ForEach (CIt, FileCache->ChunkCaches)
+      Dealloc(&*CIt);
+  }
   Dealloc(&FileCache->ChunkCaches);
-  idx2_ForEach (CeIt, FileCache->ChunkExpCaches)
-    Dealloc(&*CeIt);
+  if (FileCache->ChunkExpCaches.Alloc)
+  {
+    idx2_ForEach (CeIt, FileCache->ChunkExpCaches)
+      Dealloc(&*CeIt);
+  }
   Dealloc(&FileCache->ChunkExpCaches);
   Dealloc(&FileCache->ChunkExpOffsets);
+  idx2_ForEach (BufIt, FileCache->RunBufs)
+    DeallocBuf(BufIt);
+  Dealloc(&FileCache->RunBufs);
+  if (FileCache->MappedFile.Buf.Data)
+  {
+    UnmapFile(&FileCache->MappedFile);
+    CloseFile(&FileCache->MappedFile);
+  }
+}
+
+
+error<idx2_err_code>
+MapFileCache(file_cache* FileCache, const file_id& FileId)
+{
+  mmap_file& MappedFile = FileCache->MappedFile;
+  if (MappedFile.Buf.Data)
+    return idx2_Error(idx2_err_code::NoError);
+
+  if (!OpenFile(&MappedFile, FileId.Name.ConstPtr, map_mode::Read))
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+  if (!MapFile(&MappedFile))
+  {
+    CloseFile(&MappedFile);
+    MappedFile.Buf = buffer();
+    return idx2_Error(idx2_err_code::FileNotFound, "Cannot map file: %s\n", FileId.Name.ConstPtr);
+  }
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+error<idx2_err_code>
+ReadFooterIndex(const idx2_file& Idx2, const file_id& FileId, file_cache* FileCache, bool Exponents)
+{
+  const footer_file* File = Lookup(*Idx2.FooterIndex, FileId.Id);
+  idx2_ReturnErrorIf(!File, idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
+  if (Exponents)
+  {
+    FileCache->ExponentBeginOffset = File->ExponentBeginOffset;
+    Reserve(&FileCache->ChunkExpOffsets, File->NExpChunks);
+    idx2_For (i32, I, 0, File->NExpChunks)
+    {
+      const footer_chunk& Chunk = Idx2.FooterIndex->ExpChunks[File->FirstExpChunk + I];
+      PushBack(&FileCache->ChunkExpOffsets, (i32)Chunk.EndOffset);
+      chunk_exp_cache ChunkExpCache;
+      ChunkExpCache.ChunkPos = I;
+      Insert(&FileCache->ChunkExpCaches, Chunk.Address, ChunkExpCache);
+    }
+  }
+  else
+  {
+    Reserve(&FileCache->ChunkOffsets, File->NChunks);
+    idx2_For (i32, I, 0, File->NChunks)
+    {
+      const footer_chunk& Chunk = Idx2.FooterIndex->Chunks[File->FirstChunk + I];
+      PushBack(&FileCache->ChunkOffsets, Chunk.EndOffset);
+      chunk_cache ChunkCache;
+      ChunkCache.ChunkPos = I;
+      Insert(&FileCache->ChunkCaches, Chunk.Address, ChunkCache);
+      u64 Brick;
+      i8 Level, Subband;
+      i16 BpKey;
+      UnpackChunkAddress(Idx2, Chunk.Address, &Brick, &Level, &Subband, &BpKey);
+      FileCache->MaxBpKey = Max(FileCache->MaxBpKey, BpKey);
+    }
+  }
+
+  return idx2_Error(idx2_err_code::NoError);
 }
 
 
@@ -57,6 +139,232 @@ DeallocFileCacheTable(file_cache_table* FileCacheTable)
 }
 
 
+void
+Init(chunk_lru_cache* Cache, i64 MaxBytes)
+{
+  Init(&Cache->Chunks, 10);
+  Init(&Cache->ChunkExps, 10);
+  Cache->MaxBytes = MaxBytes;
+}
+
+
+void
+Dealloc(chunk_lru_cache* Cache)
+{
+  idx2_ForEach (It, Cache->Chunks)
+    Release(It.Val->Shared);
+  Dealloc(&Cache->Chunks);
+  idx2_ForEach (It, Cache->ChunkExps)
+    Release(It.Val->Shared);
+  Dealloc(&Cache->ChunkExps);
+  Cache->Bytes = 0;
+}
+
+
+template <typename t> static shared_chunk<t>*
+LookupLru(chunk_lru_cache* Cache, hash_table<u64, lru_chunk<t>>* Table, u64 ChunkAddress)
+{
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  auto It = Lookup(*Table, ChunkAddress);
+  if (!It)
+  {
+    ++Cache->NMisses;
+    return nullptr;
+  }
+  ++Cache->NHits;
+  It.Val->LastUse = ++Cache->Clock;
+  return Acquire(It.Val->Shared);
+}
+
+
+shared_chunk<chunk_cache>*
+LookupChunk(chunk_lru_cache* Cache, u64 ChunkAddress)
+{
+  return LookupLru(Cache, &Cache->Chunks, ChunkAddress);
+}
+
+
+shared_chunk<chunk_exp_cache>*
+LookupChunkExp(chunk_lru_cache* Cache, u64 ChunkAddress)
+{
+  return LookupLru(Cache, &Cache->ChunkExps, ChunkAddress);
+}
+
+
+/* Evict the least recently used chunks of a table, until the cache is within 7/8 of its budget */
+template <typename t> static void
+EvictLru(chunk_lru_cache* Cache, hash_table<u64, lru_chunk<t>>* Table, i64 TargetBytes)
+{
+  using use = t2<u64, u64>; // (last use, chunk address)
+  idx2_RAII(array<use>, ByLastUse, Reserve(&ByLastUse, Size(*Table)), Dealloc(&ByLastUse));
+  idx2_ForEach (It, *Table)
+    PushBack(&ByLastUse, use{ It.Val->LastUse, *It.Key });
+  std::sort(Begin(ByLastUse), End(ByLastUse));
+  idx2_ForEach (It, ByLastUse)
+  {
+    if (Cache->Bytes <= TargetBytes)
+      break;
+    auto ChunkIt = Lookup(*Table, It->Second);
+    Cache->Bytes -= ChunkIt.Val->Bytes;
+    Release(ChunkIt.Val->Shared);
+    Delete(Table, It->Second);
+    ++Cache->NEvictions;
+  }
+}
+
+
+/* A copy of a chunk that owns all its memory */
+static shared_chunk<chunk_cache>*
+CloneChunk(const chunk_cache& Src)
+{
+  auto Copy = new shared_chunk<chunk_cache>;
+  Copy->Chunk.ChunkPos = Src.ChunkPos;
+  Clone(Src.Bricks, &Copy->Chunk.Bricks);
+  Clone(Src.BrickOffsets, &Copy->Chunk.BrickOffsets);
+  Clone(Src.ChunkStream.Stream, &Copy->Chunk.ChunkStream.Stream);
+  InitRead(&Copy->Chunk.ChunkStream, Copy->Chunk.ChunkStream.Stream);
+  Copy->Chunk.Ready = true;
+  return Copy;
+}
+
+
+static shared_chunk<chunk_exp_cache>*
+CloneChunk(const chunk_exp_cache& Src)
+{
+  auto Copy = new shared_chunk<chunk_exp_cache>;
+  Copy->Chunk.ChunkPos = Src.ChunkPos;
+  Clone(Src.ChunkExpStream.Stream, &Copy->Chunk.ChunkExpStream.Stream);
+  InitRead(&Copy->Chunk.ChunkExpStream, Copy->Chunk.ChunkExpStream.Stream);
+  Copy->Chunk.Ready = true;
+  return Copy;
+}
+
+
+idx2_Inline bool
+OwnsStream(const chunk_cache& C) { return C.ChunkStream.Stream.Alloc != nullptr; }
+
+
+idx2_Inline bool
+OwnsStream(const chunk_exp_cache& C) { return C.ChunkExpStream.Stream.Alloc != nullptr; }
+
+
+template <typename t> static void
+InsertLru(chunk_lru_cache* Cache, hash_table<u64, lru_chunk<t>>* Table, u64 ChunkAddress, shared_chunk<t>* Shared)
+{
+  // the cache outlives the file mappings and buffers that a chunk stream may point into
+  Shared = OwnsStream(Shared->Chunk) ? Acquire(Shared) : CloneChunk(Shared->Chunk);
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  auto It = Lookup(*Table, ChunkAddress);
+  if (It) // another decoder has inserted the same chunk
+  {
+    Release(Shared);
+    return;
+  }
+  lru_chunk<t> Entry;
+  Entry.Shared = Shared;
+  Entry.Bytes = Size(Shared->Chunk);
+  Entry.LastUse = ++Cache->Clock;
+  Insert(Table, ChunkAddress, Entry);
+  Cache->Bytes += Entry.Bytes;
+  if (Cache->Bytes > Cache->MaxBytes)
+  {
+    i64 TargetBytes = Cache->MaxBytes - Cache->MaxBytes / 8;
+    EvictLru(Cache, &Cache->ChunkExps, TargetBytes); // exponent chunks are small and cheap to read
+    EvictLru(Cache, &Cache->Chunks, TargetBytes);
+  }
+}
+
+
+void
+Insert(chunk_lru_cache* Cache, u64 ChunkAddress, shared_chunk<chunk_cache>* Shared)
+{
+  InsertLru(Cache, &Cache->Chunks, ChunkAddress, Shared);
+}
+
+
+void
+Insert(chunk_lru_cache* Cache, u64 ChunkAddress, shared_chunk<chunk_exp_cache>* Shared)
+{
+  InsertLru(Cache, &Cache->ChunkExps, ChunkAddress, Shared);
+}
+
+
+/*
+Put a copy of a chunk loaded by Decode in the chunk LRU cache, and keep it (in Pinned) until the
+decode ends, since the chunk may be evicted while the decode still uses it
+*/
+template <typename t> static t*
+CacheLoadedChunk(const idx2_file& Idx2, hash_table<u64, shared_chunk<t>*>* Pinned, u64 ChunkAddress, const t& Chunk)
+{
+  auto Copy = CloneChunk(Chunk);
+  Insert(Idx2.ChunkLruCache, ChunkAddress, Copy);
+  Insert(Pinned, ChunkAddress, Copy);
+  return &Copy->Chunk;
+}
+
+
+/* Return the chunk if it is in the chunk LRU cache, pinning it until the decode ends */
+template <typename t> static t*
+LookupPinnedChunk(const idx2_file& Idx2, hash_table<u64, shared_chunk<t>*>* Pinned, u64 ChunkAddress)
+{
+  auto PinnedIt = Lookup(*Pinned, ChunkAddress);
+  if (PinnedIt)
+    return &(*PinnedIt.Val)->Chunk;
+  shared_chunk<t>* Cached = nullptr;
+  if constexpr (is_same_type<t, chunk_cache>::Value)
+    Cached = LookupChunk(Idx2.ChunkLruCache, ChunkAddress);
+  else
+    Cached = LookupChunkExp(Idx2.ChunkLruCache, ChunkAddress);
+  if (!Cached)
+    return nullptr;
+  Insert(Pinned, ChunkAddress, Cached);
+  return &Cached->Chunk;
+}
+
+
+/*
+Read a chunk through the thread-safe file caches of the parallel decoder, which Decode uses while the
+I/O threads read chunks ahead (see params::PrefetchBricks), keeping it (in Pinned) until the decode ends
+*/
+template <typename t, typename read_func> static expected<const t*, idx2_err_code>
+ReadSharedChunk(hash_table<u64, shared_chunk<t>*>* Pinned, u64 ChunkAddress, const read_func& Read)
+{
+  auto PinnedIt = Lookup(*Pinned, ChunkAddress);
+  if (PinnedIt)
+    return &(*PinnedIt.Val)->Chunk;
+  auto Result = Read();
+  if (!Result)
+    return Error(Result);
+  Insert(Pinned, ChunkAddress, Value(Result));
+  return &Value(Result)->Chunk;
+}
+
+
+void
+PrintStatistics(chunk_lru_cache* Cache)
+{
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  printf("chunk cache hits    = %" PRIi64 "\n", Cache->NHits);
+  printf("chunk cache misses  = %" PRIi64 "\n", Cache->NMisses);
+  printf("chunk cache evictions = %" PRIi64 "\n", Cache->NEvictions);
+  printf("chunk cache bytes   = %" PRIi64 " (max %" PRIi64 ")\n", Cache->Bytes, Cache->MaxBytes);
+}
+
+
+void
+Init(file_cache_shard* Shard)
+{
+  Init(&Shard->FileCaches, 4);
+}
+
+
+void
+Dealloc(file_cache_shard* Shard)
+{
+  DeallocFileCacheTable(&Shard->FileCaches);
+}
+
+
 /* Given a brick address, open the file associated with the brick and cache its chunk information */
 /* Structure of a file
 * -------- beginning of file --------
@@ -95,53 +403,60 @@ ReadFile(const idx2_file& Idx2,
   if (*FileCacheIt && FileCacheIt->Val->DataCached)
     return idx2_Error(idx2_err_code::NoError);
 
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-  idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
-  idx2_FSeek(Fp, 0, SEEK_END);
-  i64 FileSize = idx2_FTell(Fp);
-  int S = 0; // total number of bytes used to store exponents info
-  ReadBackwardPOD(Fp, &S);
-  idx2_FSeek(Fp, (FileSize - S), SEEK_SET); // skip the exponents info at the end
-  int NChunks = 0;
-  ReadBackwardPOD(Fp, &NChunks);
-  // TODO: check if there are too many NChunks
-
-  /* read and decompress chunk addresses */
-  int ChunkAddrsSz;
-  ReadBackwardPOD(Fp, &ChunkAddrsSz);
-  idx2_ScopeBuffer(CpresChunkAddrs, ChunkAddrsSz);
-  ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
-  D->BytesData_ += ChunkAddrsSz;
-  D->DecodeIOTime_ += ElapsedTime(&IOTimer);
-  idx2_ScopeBuffer(ChunkAddrsBuf, NChunks * sizeof(u64));
-  DecompressBufZstd(CpresChunkAddrs, &ChunkAddrsBuf);
-
-  /* read chunk sizes */
-  ResetTimer(&IOTimer);
-  int ChunkSizesSz = 0;
-  ReadBackwardPOD(Fp, &ChunkSizesSz);
-  idx2_ScopeBuffer(ChunkSizesBuf, ChunkSizesSz);
-  bitstream ChunkSizeStream;
-  ReadBackwardBuffer(Fp, &ChunkSizesBuf, ChunkSizesSz);
-  D->BytesData_ += ChunkSizesSz;
-  D->DecodeIOTime_ += ElapsedTime(&IOTimer);
-  InitRead(&ChunkSizeStream, ChunkSizesBuf);
-
-  /* parse the chunk addresses and cache in memory */
   file_cache FileCache;
-  i64 AccumSize = 0;
   Init(&FileCache.ChunkCaches, 10);
-  idx2_For (int, I, 0, NChunks)
+  if (Idx2.FooterIndex)
   {
-    i64 ChunkSize = ReadVarByte(&ChunkSizeStream); // TODO: use i32 for chunk size
-    u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + I);
-    chunk_cache ChunkCache;
-    ChunkCache.ChunkPos = I;
-    Insert(&FileCache.ChunkCaches, ChunkAddr, ChunkCache);
-    //printf("chunk %llu size = %lld\n", ChunkAddr, ChunkSize);
-    PushBack(&FileCache.ChunkOffsets, AccumSize += ChunkSize);
+    idx2_PropagateIfError(ReadFooterIndex(Idx2, FileId, &FileCache, false));
+  }
+  else
+  {
+    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+    idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
+    idx2_FSeek(Fp, 0, SEEK_END);
+    i64 FileSize = idx2_FTell(Fp);
+    int S = 0; // total number of bytes used to store exponents info
+    ReadBackwardPOD(Fp, &S);
+    idx2_FSeek(Fp, (FileSize - S), SEEK_SET); // skip the exponents info at the end
+    int NChunks = 0;
+    ReadBackwardPOD(Fp, &NChunks);
+    // TODO: check if there are too many NChunks
+
+    /* read and decompress chunk addresses */
+    int ChunkAddrsSz;
+    ReadBackwardPOD(Fp, &ChunkAddrsSz);
+    idx2_ScopeBuffer(CpresChunkAddrs, ChunkAddrsSz);
+    ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
+    D->BytesData_ += ChunkAddrsSz;
+    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
+    idx2_ScopeBuffer(ChunkAddrsBuf, NChunks * sizeof(u64));
+    DecompressBufZstd(CpresChunkAddrs, &ChunkAddrsBuf);
+
+    /* read chunk sizes */
+    ResetTimer(&IOTimer);
+    int ChunkSizesSz = 0;
+    ReadBackwardPOD(Fp, &ChunkSizesSz);
+    idx2_ScopeBuffer(ChunkSizesBuf, ChunkSizesSz);
+    bitstream ChunkSizeStream;
+    ReadBackwardBuffer(Fp, &ChunkSizesBuf, ChunkSizesSz);
+    D->BytesData_ += ChunkSizesSz;
+    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
+    InitRead(&ChunkSizeStream, ChunkSizesBuf);
+
+    /* parse the chunk addresses and cache in memory */
+    i64 AccumSize = 0;
+    idx2_For (int, I, 0, NChunks)
+    {
+      i64 ChunkSize = ReadVarByte(&ChunkSizeStream); // TODO: use i32 for chunk size
+      u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + I);
+      chunk_cache ChunkCache;
+      ChunkCache.ChunkPos = I;
+      Insert(&FileCache.ChunkCaches, ChunkAddr, ChunkCache);
+      //printf("chunk %llu size = %lld\n", ChunkAddr, ChunkSize);
+      PushBack(&FileCache.ChunkOffsets, AccumSize += ChunkSize);
+    }
+    idx2_Assert(Size(ChunkSizeStream) == ChunkSizesSz);
   }
-  idx2_Assert(Size(ChunkSizeStream) == ChunkSizesSz);
 
   if (!*FileCacheIt) // the file cache does not exist
   { // insert a new file cache
@@ -159,6 +474,96 @@ ReadFile(const idx2_file& Idx2,
 }
 
 
+/*
+Read all the chunks of a file that the decoder may need, i.e., the chunks whose subband is decoded,
+whose bricks intersect the decode extent, and whose bit planes are above the tolerance. Needed chunks
+that are at most D->MaxReadGap bytes apart in the file are read with a single read.
+*/
+static error<idx2_err_code>
+ReadChunkRuns(const idx2_file& Idx2, decode_data* D, file_cache* FileCache, const file_id& FileId)
+{
+  FileCache->RunsRead = true;
+  i64 NChunks = Size(FileCache->ChunkOffsets);
+  // the chunk caches and addresses of the needed chunks, by position in the file
+  idx2_RAII(array<chunk_cache*>, Needed, Resize(&Needed, NChunks), Dealloc(&Needed));
+  idx2_RAII(array<u64>, NeededAddrs, Resize(&NeededAddrs, NChunks), Dealloc(&NeededAddrs));
+  Fill(Begin(Needed), End(Needed), (chunk_cache*)nullptr);
+  bool AnyNeeded = false;
+  idx2_ForEach (ChunkCacheIt, FileCache->ChunkCaches)
+  {
+    u64 Brick;
+    i8 Level, Subband;
+    i16 BpKey;
+    UnpackChunkAddress(Idx2, *ChunkCacheIt.Key, &Brick, &Level, &Subband, &BpKey);
+    if (!BitSet(Idx2.DecodeSubbandMasks[Level], Subband) || BpKey < D->MinBpKey)
+      continue;
+    extent ChunkExtent = ChunkAddressToSpatial(Idx2, *ChunkCacheIt.Key);
+    if (Prod(Dims(Crop(ChunkExtent, D->DecodeExtent))) == 0)
+      continue;
+    if (Size(ChunkCacheIt.Val->ChunkStream.Stream) == 0) // not already loaded
+    {
+      Needed[ChunkCacheIt.Val->ChunkPos] = ChunkCacheIt.Val;
+      NeededAddrs[ChunkCacheIt.Val->ChunkPos] = *ChunkCacheIt.Key;
+      AnyNeeded = true;
+    }
+  }
+  if (!AnyNeeded)
+    return idx2_Error(idx2_err_code::NoError);
+
+  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+  if (!Fp)
+    return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+  i64 First = 0;
+  while (First < NChunks)
+  {
+    if (!Needed[First])
+    {
+      ++First;
+      continue;
+    }
+    /* extend the run while the gap to the next needed chunk is small enough */
+    i64 Last = First, Next = First + 1;
+    while (Next < NChunks)
+    {
+      if (Needed[Next])
+        Last = Next;
+      else if (FileCache->ChunkOffsets[Next] - FileCache->ChunkOffsets[Last] > D->MaxReadGap)
+        break;
+      ++Next;
+    }
+    timer IOTimer;
+    StartTimer(&IOTimer);
+    i64 RunBegin = First > 0 ? FileCache->ChunkOffsets[First - 1] : 0;
+    i64 RunEnd = FileCache->ChunkOffsets[Last];
+    buffer RunBuf;
+    AllocBuf(&RunBuf, RunEnd - RunBegin);
+    PushBack(&FileCache->RunBufs, RunBuf);
+    idx2_FSeek(Fp, RunBegin, SEEK_SET);
+    ReadBuffer(Fp, &RunBuf);
+    D->BytesData_ += Size(RunBuf);
+    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
+    idx2_InclusiveFor (i64, I, First, Last)
+    {
+      if (!Needed[I])
+        continue;
+      i64 ChunkOffset = I > 0 ? FileCache->ChunkOffsets[I - 1] : 0;
+      i64 ChunkSize = FileCache->ChunkOffsets[I] - ChunkOffset;
+      // the chunk stream points into the run buffer, which the file cache owns
+      bitstream ChunkStream;
+      InitRead(&ChunkStream, buffer(RunBuf.Data + (ChunkOffset - RunBegin), ChunkSize));
+      u64 Brick;
+      i8 Level, Subband;
+      i16 BpKey;
+      UnpackChunkAddress(Idx2, NeededAddrs[I], &Brick, &Level, &Subband, &BpKey);
+      DecompressChunk(&ChunkStream, Needed[I], NeededAddrs[I], Log2Ceil(Idx2.BricksPerChunk[Level]));
+    }
+    First = Last + 1;
+  }
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
 /* Given a brick address, read the chunk associated with the brick and cache the chunk */
 expected<const chunk_cache*, idx2_err_code>
 ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband, i16 BpKey)
@@ -183,6 +588,19 @@ ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband
   }
 #endif
 
+  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
+  if (D->IOThreadPool)
+  {
+    return ReadSharedChunk(&D->PinnedChunks, ChunkAddress, [&]() {
+      return ParallelReadChunk(Idx2, D, Brick, Level, Subband, BpKey);
+    });
+  }
+  if (Idx2.ChunkLruCache)
+  {
+    if (chunk_cache* Cached = LookupPinnedChunk(Idx2, &D->PinnedChunks, ChunkAddress))
+      return Cached;
+  }
+
   file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, BpKey);
   auto FileCacheIt = Lookup(D->FileCacheTable, FileId.Id);
   idx2_PropagateIfError(ReadFile(Idx2, D, &FileCacheIt, FileId));
@@ -190,34 +608,53 @@ ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband
     return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
 
   /* find the appropriate chunk */
-  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, BpKey);
   //printf("chunk %llu\n", ChunkAddress);
-  const file_cache* FileCache = FileCacheIt.Val;
+  file_cache* FileCache = FileCacheIt.Val;
   decltype(FileCache->ChunkCaches)::iterator ChunkCacheIt;
   ChunkCacheIt = Lookup(FileCache->ChunkCaches, ChunkAddress);
   if (!ChunkCacheIt)
     return idx2_Error(idx2_err_code::ChunkNotFound);
   chunk_cache* ChunkCache = ChunkCacheIt.Val;
+  // when refining a previous decode, only the chunks the blocks ask for are new, so we read those alone
+  bool Refining = Idx2.DecodeProgress && Size(Idx2.DecodeProgress->Bricks) > 0;
+  if (Size(ChunkCache->ChunkStream.Stream) == 0 && !D->MapFiles && D->MaxReadGap >= 0 &&
+      !FileCache->RunsRead && !Refining)
+  { // read all the chunks this decode needs from the file, then check again
+    idx2_PropagateIfError(ReadChunkRuns(Idx2, D, FileCache, FileId));
+  }
   if (Size(ChunkCache->ChunkStream.Stream) == 0) // chunk has not been loaded
   {
     timer IOTimer;
     StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    if (!Fp)
-      return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
     i32 ChunkPos = ChunkCache->ChunkPos;
     i64 ChunkOffset = ChunkPos > 0 ? FileCache->ChunkOffsets[ChunkPos - 1] : 0;
     i64 ChunkSize = FileCache->ChunkOffsets[ChunkPos] - ChunkOffset;
-    idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
     bitstream ChunkStream;
-    // NOTE: not a memory leak since we will keep track of this in ChunkCache
-    InitWrite(&ChunkStream, ChunkSize);
-    ReadBuffer(Fp, &ChunkStream.Stream);
+    if (D->MapFiles)
+    { // the chunk stream points directly into the mapping
+      idx2_PropagateIfError(MapFileCache(FileCache, FileId));
+      const buffer& FileBuf = FileCache->MappedFile.Buf;
+      if (ChunkOffset + ChunkSize > Size(FileBuf))
+        return idx2_Error(idx2_err_code::SizeMismatched, "File: %s\n", FileId.Name.ConstPtr);
+      InitRead(&ChunkStream, buffer(FileBuf.Data + ChunkOffset, ChunkSize));
+    }
+    else
+    {
+      idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+      if (!Fp)
+        return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+      idx2_FSeek(Fp, ChunkOffset, SEEK_SET);
+      // NOTE: not a memory leak since we will keep track of this in ChunkCache
+      InitWrite(&ChunkStream, ChunkSize);
+      ReadBuffer(Fp, &ChunkStream.Stream);
+    }
     D->BytesData_ += Size(ChunkStream.Stream);
     D->DecodeIOTime_ += ElapsedTime(&IOTimer);
     // TODO: check for error
     DecompressChunk(&ChunkStream, ChunkCache, ChunkAddress, Log2Ceil(Idx2.BricksPerChunk[Level]));
   }
+  if (Idx2.ChunkLruCache)
+    return CacheLoadedChunk(Idx2, &D->PinnedChunks, ChunkAddress, *ChunkCache);
 
   return ChunkCacheIt.Val;
 }
@@ -266,64 +703,71 @@ ReadFileExponents(const idx2_file& Idx2,
   if (*FileCacheIt && FileCacheIt->Val->ExpCached)
     return idx2_Error(idx2_err_code::NoError);
 
-  idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-  idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
-  idx2_FSeek(Fp, 0, SEEK_END);
-  i64 FileSize = idx2_FTell(Fp);
-  int ExponentSize = 0; // total bytes of the encoded chunk sizes
-  ReadBackwardPOD(Fp, &ExponentSize); // total size of the exponent info
-
-
-  /* read addresses of the exponent chunks */
-  int NChunks = 0;
-  ReadBackwardPOD(Fp, &NChunks);
-  int ChunkAddrsSz;
-  ReadBackwardPOD(Fp, &ChunkAddrsSz);
-  idx2_ScopeBuffer(CpresChunkAddrs, ChunkAddrsSz);
-  ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
-  D->BytesData_ += ChunkAddrsSz;
-  idx2_ScopeBuffer(ChunkAddrsBuf, NChunks * sizeof(u64));
-  DecompressBufZstd(CpresChunkAddrs, &ChunkAddrsBuf);
-
-  // TODO: the exponent sizes can be compressed further
-  int S = 0; // size (in bytes) of the compressed exponent sizes
-  ReadBackwardPOD(Fp, &S);
-  idx2_ScopeBuffer(ChunkExpSizesBuf, S);
-  ReadBackwardBuffer(Fp, &ChunkExpSizesBuf, S);
-  D->BytesExps_ += sizeof(int) + S;
-  D->DecodeIOTime_ += ElapsedTime(&IOTimer);
-  bitstream ChunkExpSizesStream;
-  InitRead(&ChunkExpSizesStream, ChunkExpSizesBuf);
-
   file_cache FileCache;
   Init(&FileCache.ChunkExpCaches, 10);
-  FileCache.ExponentBeginOffset = FileSize - ExponentSize;
-  Reserve(&FileCache.ChunkExpOffsets, S);
-  i32 CeSz = 0;
-  // we compute a "prefix sum" of the sizes to get the offsets
-  int NChunks2 = 0;
-  while (Size(ChunkExpSizesStream) < S)
+  if (Idx2.FooterIndex)
   {
-    PushBack(&FileCache.ChunkExpOffsets, CeSz += (i32)ReadVarByte(&ChunkExpSizesStream));
-    u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + NChunks2);
-    chunk_exp_cache ChunkExpCache;
-    ChunkExpCache.ChunkPos = NChunks2;
-    // NOTE: here we rely on the fact that the exponent chunks are sorted by increasing subband in each file
-    Insert(&FileCache.ChunkExpCaches, ChunkAddr, ChunkExpCache);
-    ++NChunks2;
+    idx2_PropagateIfError(ReadFooterIndex(Idx2, FileId, &FileCache, true));
   }
+  else
+  {
+    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+    idx2_ReturnErrorIf(!Fp, idx2::idx2_err_code::FileNotFound, "File: %s", FileId.Name.ConstPtr);
+    idx2_FSeek(Fp, 0, SEEK_END);
+    i64 FileSize = idx2_FTell(Fp);
+    int ExponentSize = 0; // total bytes of the encoded chunk sizes
+    ReadBackwardPOD(Fp, &ExponentSize); // total size of the exponent info
+
+
+    /* read addresses of the exponent chunks */
+    int NChunks = 0;
+    ReadBackwardPOD(Fp, &NChunks);
+    int ChunkAddrsSz;
+    ReadBackwardPOD(Fp, &ChunkAddrsSz);
+    idx2_ScopeBuffer(CpresChunkAddrs, ChunkAddrsSz);
+    ReadBackwardBuffer(Fp, &CpresChunkAddrs, ChunkAddrsSz);
+    D->BytesData_ += ChunkAddrsSz;
+    idx2_ScopeBuffer(ChunkAddrsBuf, NChunks * sizeof(u64));
+    DecompressBufZstd(CpresChunkAddrs, &ChunkAddrsBuf);
+
+    // TODO: the exponent sizes can be compressed further
+    int S = 0; // size (in bytes) of the compressed exponent sizes
+    ReadBackwardPOD(Fp, &S);
+    idx2_ScopeBuffer(ChunkExpSizesBuf, S);
+    ReadBackwardBuffer(Fp, &ChunkExpSizesBuf, S);
+    D->BytesExps_ += sizeof(int) + S;
+    D->DecodeIOTime_ += ElapsedTime(&IOTimer);
+    bitstream ChunkExpSizesStream;
+    InitRead(&ChunkExpSizesStream, ChunkExpSizesBuf);
+
+    FileCache.ExponentBeginOffset = FileSize - ExponentSize;
+    Reserve(&FileCache.ChunkExpOffsets, S);
+    i32 CeSz = 0;
+    // we compute a "prefix sum" of the sizes to get the offsets
+    int NChunks2 = 0;
+    while (Size(ChunkExpSizesStream) < S)
+    {
+      PushBack(&FileCache.ChunkExpOffsets, CeSz += (i32)ReadVarByte(&ChunkExpSizesStream));
+      u64 ChunkAddr = *((u64*)ChunkAddrsBuf.Data + NChunks2);
+      chunk_exp_cache ChunkExpCache;
+      ChunkExpCache.ChunkPos = NChunks2;
+      // NOTE: here we rely on the fact that the exponent chunks are sorted by increasing subband in each file
+      Insert(&FileCache.ChunkExpCaches, ChunkAddr, ChunkExpCache);
+      ++NChunks2;
+    }
 
-  if (NChunks != NChunks2)
-    return idx2_Error(idx2_err_code::SizeMismatched,
-                      "number of chunks is either %d or %d\n", NChunks, NChunks2);
+    if (NChunks != NChunks2)
+      return idx2_Error(idx2_err_code::SizeMismatched,
+                        "number of chunks is either %d or %d\n", NChunks, NChunks2);
 
-  // NOTE: this should no longer be true if a file stores more than one level
-  if (NChunks % Size(Idx2.Subbands) != 0)
-    return idx2_Error(idx2_err_code::SizeMismatched,
-                      "number of chunks = %d is not divisible by number of subbands which is %d\n", NChunks, (int)Size(Idx2.Subbands));
+    // NOTE: this should no longer be true if a file stores more than one level
+    if (NChunks % Size(Idx2.Subbands) != 0)
+      return idx2_Error(idx2_err_code::SizeMismatched,
+                        "number of chunks = %d is not divisible by number of subbands which is %d\n", NChunks, (int)Size(Idx2.Subbands));
 
-  //Resize(&FileCache.ChunkCaches, Size(FileCache.ChunkExpOffsets));
-  idx2_Assert(Size(ChunkExpSizesStream) == S);
+    //Resize(&FileCache.ChunkCaches, Size(FileCache.ChunkExpOffsets));
+    idx2_Assert(Size(ChunkExpSizesStream) == S);
+  }
 
   if (!*FileCacheIt) // file cache exists
   {
@@ -373,6 +817,19 @@ ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i
   }
 #endif
 
+  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, ExponentBitPlane_);
+  if (D->IOThreadPool)
+  {
+    return ReadSharedChunk(&D->PinnedChunkExps, ChunkAddress, [&]() {
+      return ParallelReadChunkExponents(Idx2, D, Brick, Level, Subband);
+    });
+  }
+  if (Idx2.ChunkLruCache)
+  {
+    if (chunk_exp_cache* Cached = LookupPinnedChunk(Idx2, &D->PinnedChunkExps, ChunkAddress))
+      return Cached;
+  }
+
   file_id FileId = ConstructFilePath(Idx2, Brick, Level, Subband, ExponentBitPlane_);
   auto FileCacheIt = Lookup(D->FileCacheTable, FileId.Id);
   idx2_PropagateIfError(ReadFileExponents(Idx2, D, Level, &FileCacheIt, FileId));
@@ -380,7 +837,6 @@ ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i
     return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
 
   /* find the appropriate chunk */
-  u64 ChunkAddress = GetChunkAddress(Idx2, Brick, Level, Subband, ExponentBitPlane_);
   file_cache* FileCache = FileCacheIt.Val;
   decltype(FileCache->ChunkExpCaches)::iterator ChunkCacheIt;
   ChunkCacheIt = Lookup(FileCache->ChunkExpCaches, ChunkAddress);
@@ -392,9 +848,6 @@ ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i
   {
     timer IOTimer;
     StartTimer(&IOTimer);
-    idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
-    if (!Fp)
-      return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
     i32 ChunkPos = ChunkExpCache->ChunkPos;
     i64 ChunkExpOffset = FileCache->ExponentBeginOffset;
     i32 ChunkExpSize = FileCache->ChunkExpOffsets[ChunkPos];
@@ -404,16 +857,32 @@ ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i
       ChunkExpOffset += PrevChunkOffset;
       ChunkExpSize -= PrevChunkOffset;
     }
-    idx2_FSeek(Fp, ChunkExpOffset, SEEK_SET);
     bitstream& ChunkExpStream = ChunkExpCache->ChunkExpStream;
-    idx2_ScopeBuffer(CompressedChunkExpsBuf, ChunkExpSize);
-    ReadBuffer(Fp, &CompressedChunkExpsBuf, ChunkExpSize);
-    DecompressBufZstd(CompressedChunkExpsBuf, &ChunkExpStream);
+    if (D->MapFiles)
+    { // decompress straight from the mapping
+      idx2_PropagateIfError(MapFileCache(FileCache, FileId));
+      const buffer& FileBuf = FileCache->MappedFile.Buf;
+      if (ChunkExpOffset + ChunkExpSize > Size(FileBuf))
+        return idx2_Error(idx2_err_code::SizeMismatched, "File: %s\n", FileId.Name.ConstPtr);
+      DecompressBufZstd(buffer(FileBuf.Data + ChunkExpOffset, ChunkExpSize), &ChunkExpStream);
+    }
+    else
+    {
+      idx2_RAII(FILE*, Fp = fopen(FileId.Name.ConstPtr, "rb"), , if (Fp) fclose(Fp));
+      if (!Fp)
+        return idx2_Error(idx2_err_code::FileNotFound, "File: %s\n", FileId.Name.ConstPtr);
+      idx2_FSeek(Fp, ChunkExpOffset, SEEK_SET);
+      idx2_ScopeBuffer(CompressedChunkExpsBuf, ChunkExpSize);
+      ReadBuffer(Fp, &CompressedChunkExpsBuf, ChunkExpSize);
+      DecompressBufZstd(CompressedChunkExpsBuf, &ChunkExpStream);
+    }
     D->BytesDecoded_ += ChunkExpSize;
     D->BytesExps_ += ChunkExpSize;
     D->DecodeIOTime_ += ElapsedTime(&IOTimer);
     InitRead(&ChunkExpStream, ChunkExpStream.Stream);
   }
+  if (Idx2.ChunkLruCache)
+    return CacheLoadedChunk(Idx2, &D->PinnedChunkExps, ChunkAddress, *ChunkExpCache);
 
   return ChunkCacheIt.Val;
 }
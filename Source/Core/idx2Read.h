@@ -3,13 +3,19 @@
 
 #include "Expected.h"
 #include "HashTable.h"
+#include "MemoryMap.h"
 #include "idx2Common.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 
 namespace idx2
 {
 
 
+template <typename t> struct shared_chunk;
+
 struct chunk_cache
 {
   i32 ChunkPos; // chunk position in the offset array (also chunk order in the file)
@@ -17,6 +23,8 @@ struct chunk_cache
   array<i32> BrickOffsets;
   bitstream ChunkStream;
   bool Ready = false;
+  bool Loading = false; // a thread is reading the chunk (used by ParallelReadChunk)
+  shared_chunk<chunk_cache>* Shared = nullptr; // the loaded chunk (used by ParallelReadChunk)
 };
 
 void
@@ -28,11 +36,96 @@ struct chunk_exp_cache
   i32 ChunkPos; // chunk position in the offset array
   bitstream ChunkExpStream;
   bool Ready = false;
+  bool Loading = false; // a thread is reading the chunk (used by ParallelReadChunkExponents)
+  shared_chunk<chunk_exp_cache>* Shared = nullptr; // the loaded chunk (used by ParallelReadChunkExponents)
 };
 
 void
 Dealloc(chunk_exp_cache* ChunkExpCache);
 
+
+/*
+A chunk loaded by the parallel decoder, shared by the cache and the decode threads without being
+copied. It is never modified once loaded, and is deallocated when its last reference is released.
+*/
+template <typename t> struct shared_chunk
+{
+  t Chunk;
+  std::atomic<i32> NRefs = 1; // the creator holds the first reference
+};
+
+
+template <typename t> idx2_Inline shared_chunk<t>*
+Acquire(shared_chunk<t>* Shared)
+{
+  Shared->NRefs.fetch_add(1, std::memory_order_relaxed);
+  return Shared;
+}
+
+
+template <typename t> void
+Release(shared_chunk<t>* Shared)
+{
+  if (Shared->NRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    Dealloc(&Shared->Chunk);
+    delete Shared;
+  }
+}
+
+
+template <typename t> struct lru_chunk
+{
+  shared_chunk<t>* Shared = nullptr;
+  i64 Bytes = 0;
+  u64 LastUse = 0;
+};
+
+
+/*
+A size-bounded cache of decoded chunks that outlives the decode calls, so that repeated queries on a
+dataset (attached with SetChunkLruCache) do not read the same chunks again. When the chunks take more
+than MaxBytes, the least recently used ones are evicted (an evicted chunk stays alive until the
+decoders using it release it). All functions are thread safe.
+*/
+struct chunk_lru_cache
+{
+  hash_table<u64, lru_chunk<chunk_cache>> Chunks;        // [chunk address] -> bit plane chunk
+  hash_table<u64, lru_chunk<chunk_exp_cache>> ChunkExps; // [chunk address] -> exponent chunk
+  i64 MaxBytes = i64(1) << 30;
+  i64 Bytes = 0;
+  u64 Clock = 0;
+  i64 NHits = 0;
+  i64 NMisses = 0;
+  i64 NEvictions = 0;
+  std::mutex Mutex;
+};
+
+void
+Init(chunk_lru_cache* Cache, i64 MaxBytes);
+
+void
+Dealloc(chunk_lru_cache* Cache);
+
+/* Return the cached chunk (acquired for the caller, who must Release it), or nullptr */
+shared_chunk<chunk_cache>*
+LookupChunk(chunk_lru_cache* Cache, u64 ChunkAddress);
+
+shared_chunk<chunk_exp_cache>*
+LookupChunkExp(chunk_lru_cache* Cache, u64 ChunkAddress);
+
+/* Add a chunk to the cache, which takes its own reference (or a copy if the chunk does not own its
+stream, e.g., if it points into a file mapping) */
+void
+Insert(chunk_lru_cache* Cache, u64 ChunkAddress, shared_chunk<chunk_cache>* Shared);
+
+void
+Insert(chunk_lru_cache* Cache, u64 ChunkAddress, shared_chunk<chunk_exp_cache>* Shared);
+
+/* Print the hits, misses, evictions, and memory usage of the cache */
+void
+PrintStatistics(chunk_lru_cache* Cache);
+
 // TODO: we just need a single cache table addressed by chunk id
 struct file_cache
 {
@@ -41,8 +134,14 @@ struct file_cache
   hash_table<u64, chunk_exp_cache> ChunkExpCaches;
   array<i32> ChunkExpOffsets;
   i64 ExponentBeginOffset = 0;              // where in the file the exponent information begins
+  mmap_file MappedFile; // the whole file, if the chunks are read through a memory mapping
+  array<buffer> RunBufs; // runs of chunks read together, which the chunk streams point into
+  bool RunsRead = false;
+  i16 MaxBpKey = 0; // the highest bit plane key of the chunks in the file
   bool ExpCached = false;
   bool DataCached = false;
+  bool ExpLoading = false;  // a thread is reading the exponent information of the file
+  bool DataLoading = false; // a thread is reading the chunk information of the file
 };
 
 
@@ -55,6 +154,24 @@ Dealloc(file_cache* FileCache);
 // [file address] -> file cache
 using file_cache_table = hash_table<u64, file_cache>;
 
+/* Fill in the chunk information (or the exponent chunk information) of a file from Idx2.FooterIndex */
+error<idx2_err_code>
+ReadFooterIndex(const idx2_file& Idx2, const file_id& FileId, file_cache* FileCache, bool Exponents);
+
+
+/*
+One shard of the file cache used by the parallel decoder. Files are distributed to shards by their
+ids, and the mutex of a shard is only held while the cache entries are looked up or updated, never
+while reading from disk. A thread that finds a file or chunk being loaded by another thread waits on
+Loaded instead of loading it again.
+*/
+struct file_cache_shard
+{
+  file_cache_table FileCaches;
+  std::mutex Mutex;
+  std::condition_variable Loaded;
+};
+
 
 struct decode_data;
 
@@ -62,20 +179,33 @@ struct decode_data;
 void
 DeallocFileCacheTable(file_cache_table* FileCacheTable);
 
+/* Map the file into memory (if not already mapped), so that chunks can be read without copying */
+error<idx2_err_code>
+MapFileCache(file_cache* FileCache, const file_id& FileId);
+
+void
+Init(file_cache_shard* Shard);
+
+void
+Dealloc(file_cache_shard* Shard);
+
 
 // TODO: not quite exhaustive
-idx2_Inline i64
+// (plain inline: these recurse into the shared chunk, which the compiler cannot always inline)
+inline i64
 Size(const chunk_cache& C)
 {
   return Size(C.Bricks) * sizeof(C.Bricks[0]) + Size(C.BrickOffsets) * sizeof(C.BrickOffsets[0]) +
          sizeof(C.ChunkPos) +
-         Size(C.ChunkStream.Stream);
+         Size(C.ChunkStream.Stream) + (C.Shared ? Size(C.Shared->Chunk) : 0);
 }
 
 
-idx2_Inline i64
+inline i64
 Size(const chunk_exp_cache& C)
-{ return Size(C.ChunkExpStream.Stream) + sizeof(C.ChunkPos); }
+{
+  return Size(C.ChunkExpStream.Stream) + sizeof(C.ChunkPos) + (C.Shared ? Size(C.Shared->Chunk) : 0);
+}
 
 
 idx2_Inline i64
@@ -99,11 +229,19 @@ ReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i
 expected<const chunk_cache*, idx2_err_code>
 ReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband, i16 BitPlane);
 
-expected<chunk_cache, idx2_err_code>
+/* The returned chunk has been acquired for the caller, who must Release it */
+expected<shared_chunk<chunk_cache>*, idx2_err_code>
 ParallelReadChunk(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband, i16 BpKey);
 
-expected<chunk_exp_cache, idx2_err_code>
+expected<shared_chunk<chunk_exp_cache>*, idx2_err_code>
 ParallelReadChunkExponents(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level, i8 Subband);
 
+/*
+Start loading (on the I/O threads of D, if any) the exponent and bit plane chunks that the decoding of
+a brick will need, so that a decode thread that asks for them later finds them loaded or loading.
+*/
+void
+PrefetchBrickChunks(const idx2_file& Idx2, decode_data* D, u64 Brick, i8 Level);
+
 } // namespace idx2
 
@@ -3,6 +3,7 @@
 #include "idx2SparseBricks.h"
 #include "idx2Common.h"
 #include "idx2Lookup.h"
+#include <algorithm>
 //#include <unordered_set>
 
 namespace idx2
@@ -36,6 +37,109 @@ Dealloc(brick_pool* Bp)
 }
 
 
+void
+Init(brick_lru_cache* Cache, i64 MaxBytes)
+{
+  Init(&Cache->Bricks, 8);
+  Cache->MaxBytes = MaxBytes;
+}
+
+
+void
+Dealloc(brick_lru_cache* Cache)
+{
+  idx2_ForEach (It, Cache->Bricks)
+    Dealloc(&It.Val->Brick);
+  Dealloc(&Cache->Bricks);
+  Cache->Bytes = 0;
+}
+
+
+bool
+LookupBrick(brick_lru_cache* Cache, const idx2_file& Idx2, u64 BrickKey, f64 Tolerance, brick_volume* BrickVol)
+{
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  auto It = Lookup(Cache->Bricks, BrickKey);
+  if (!It || It.Val->Tolerance > Tolerance || It.Val->DownsamplingFactor3 != Idx2.DownsamplingFactor3 ||
+      It.Val->Brick.Vol.Type != BrickVol->Vol.Type) // bricks are float32 or float64 (see BrickType)
+  {
+    ++Cache->NMisses;
+    return false;
+  }
+  ++Cache->NHits;
+  It.Val->LastUse = ++Cache->Clock;
+  const brick_volume& Cached = It.Val->Brick;
+  idx2_Assert(Size(Cached) == Size(*BrickVol));
+  memcpy(BrickVol->Vol.Buffer.Data, Cached.Vol.Buffer.Data, Size(Cached));
+  BrickVol->Significant = Cached.Significant;
+  return true;
+}
+
+
+/* Evict the least recently used bricks, until the cache is within 7/8 of its budget */
+static void
+EvictLru(brick_lru_cache* Cache)
+{
+  i64 TargetBytes = Cache->MaxBytes - Cache->MaxBytes / 8;
+  using use = t2<u64, u64>; // (last use, brick key)
+  idx2_RAII(array<use>, ByLastUse, Reserve(&ByLastUse, Size(Cache->Bricks)), Dealloc(&ByLastUse));
+  idx2_ForEach (It, Cache->Bricks)
+    PushBack(&ByLastUse, use{ It.Val->LastUse, *It.Key });
+  std::sort(Begin(ByLastUse), End(ByLastUse));
+  idx2_ForEach (It, ByLastUse)
+  {
+    if (Cache->Bytes <= TargetBytes)
+      break;
+    auto BrickIt = Lookup(Cache->Bricks, It->Second);
+    Cache->Bytes -= Size(BrickIt.Val->Brick);
+    Dealloc(&BrickIt.Val->Brick);
+    Delete(&Cache->Bricks, It->Second);
+    ++Cache->NEvictions;
+  }
+}
+
+
+void
+Insert(brick_lru_cache* Cache, const idx2_file& Idx2, u64 BrickKey, f64 Tolerance, const brick_volume& BrickVol)
+{
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  auto It = Lookup(Cache->Bricks, BrickKey);
+  if (It)
+  {
+    bool SameFactor = It.Val->DownsamplingFactor3 == Idx2.DownsamplingFactor3;
+    bool SameType = It.Val->Brick.Vol.Type == BrickVol.Vol.Type;
+    if (SameFactor && SameType && It.Val->Tolerance <= Tolerance) // the cached brick is at least as precise
+      return;
+    Cache->Bytes -= Size(It.Val->Brick);
+    Dealloc(&It.Val->Brick);
+  }
+  cached_brick Entry;
+  Clone(BrickVol.Vol, &Entry.Brick.Vol);
+  Entry.Brick.Significant = BrickVol.Significant;
+  Entry.Tolerance = Tolerance;
+  Entry.DownsamplingFactor3 = Idx2.DownsamplingFactor3;
+  Entry.LastUse = ++Cache->Clock;
+  if (It)
+    *It.Val = Entry;
+  else
+    Insert(&It, BrickKey, Entry);
+  Cache->Bytes += Size(Entry.Brick);
+  if (Cache->Bytes > Cache->MaxBytes)
+    EvictLru(Cache);
+}
+
+
+void
+PrintStatistics(brick_lru_cache* Cache)
+{
+  std::unique_lock<std::mutex> Lock(Cache->Mutex);
+  printf("brick cache hits      = %" PRIi64 "\n", Cache->NHits);
+  printf("brick cache misses    = %" PRIi64 "\n", Cache->NMisses);
+  printf("brick cache evictions = %" PRIi64 "\n", Cache->NEvictions);
+  printf("brick cache bytes     = %" PRIi64 " (max %" PRIi64 ")\n", Cache->Bytes, Cache->MaxBytes);
+}
+
+
 struct stack_item
 {
   v3i Brick3 = v3i(0);
@@ -5,6 +5,7 @@
 #include "HashTable.h"
 #include "Volume.h"
 #include "idx2Common.h"
+#include <mutex>
 
 
 namespace idx2
@@ -100,5 +101,52 @@ Size(const brick_volume& B)
 }
 
 
+struct cached_brick
+{
+  brick_volume Brick;
+  f64 Tolerance = 0;              // the tolerance the brick was decoded with
+  v3i DownsamplingFactor3 = v3i(0); // the downsampling factor the brick was decoded with
+  u64 LastUse = 0;
+};
+
+
+/*
+A size-bounded cache of decoded bricks (after the inverse transform of their level, i.e., what the
+children of a brick take their subband 0 from) that outlives the decode calls (attached with
+SetBrickLruCache). A brick is reused by a decode whose tolerance is not smaller than the one it was
+decoded with, which skips reading, decoding, and inverse transforming the brick. When the bricks take
+more than MaxBytes, the least recently used ones are evicted. All functions are thread safe.
+*/
+struct brick_lru_cache
+{
+  hash_table<u64, cached_brick> Bricks; // [brick key] -> brick
+  i64 MaxBytes = i64(1) << 30;
+  i64 Bytes = 0;
+  u64 Clock = 0;
+  i64 NHits = 0;
+  i64 NMisses = 0;
+  i64 NEvictions = 0;
+  std::mutex Mutex;
+};
+
+void
+Init(brick_lru_cache* Cache, i64 MaxBytes);
+
+void
+Dealloc(brick_lru_cache* Cache);
+
+/* Copy the cached brick to BrickVol (whose volume has the same dimensions), if it can be reused */
+bool
+LookupBrick(brick_lru_cache* Cache, const idx2_file& Idx2, u64 BrickKey, f64 Tolerance, brick_volume* BrickVol);
+
+/* Add (a copy of) a decoded brick to the cache, replacing a less precise copy of the same brick */
+void
+Insert(brick_lru_cache* Cache, const idx2_file& Idx2, u64 BrickKey, f64 Tolerance, const brick_volume& BrickVol);
+
+/* Print the hits, misses, evictions, and memory usage of the cache */
+void
+PrintStatistics(brick_lru_cache* Cache);
+
+
 } // namespace idx2
 
@@ -1,6 +1,7 @@
 #include "idx2Common.h"
 #include "idx2Encode.h"
 #include "idx2Lookup.h"
+#include "idx2Write.h"
 #include "InputOutput.h"
 #include "FileSystem.h"
 #include "Statistics.h"
@@ -167,10 +168,10 @@ FlushChunkExponents(const idx2_file& Idx2, encode_data* E)
   {
     chunk_exp_info* Ce = CeIt.Val;
     bitstream* ChunkExpSizes = &Ce->ExpSizes;
-    file_id FileId = ConstructFilePath(Idx2, *CeIt.Key);
-    idx2_Assert(FileId.Id == *CeIt.Key);
     /* write chunk emax sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
+    FILE* Fp = OpenFileForAppend(Idx2, &E->Writer.FileCache, *CeIt.Key);
+    if (!Fp)
+      return idx2_Error(idx2_err_code::FileCreateFailed);
     Flush(ChunkExpSizes);
     ExpChunkSizesStat.Add((f64)Size(*ChunkExpSizes));
     int TotalExpBytes = 0;
@@ -199,6 +200,7 @@ FlushChunkExponents(const idx2_file& Idx2, encode_data* E)
     WritePOD(Fp, (int)TotalExpBytes);
     Dealloc(&CeIt.Val->FileExpBuffer);
   }
+  CloseFiles(&E->Writer.FileCache);
 
   return idx2_Error(idx2_err_code::NoError);
 }
@@ -267,10 +269,9 @@ WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Level, i8 Subba
   Rewind(&C->BrickSizeStream);
   Rewind(&C->BrickStream);
 
-  /* write to file */
+  /* write to file (on the writer thread) */
   file_id FileId = ConstructFilePath(Idx2, C->LastBrick, Level, Subband, BitPlane);
-  idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
-  WriteBuffer(Fp, ToBuffer(E->ChunkStream));
+  PushWrite(Idx2, &E->Writer, FileId.Id, ToBuffer(E->ChunkStream));
   /* keep track of the chunk addresses and sizes */
   auto ChunkMetaIt = Lookup(E->ChunkMeta, FileId.Id);
   if (!ChunkMetaIt)
@@ -353,20 +354,17 @@ FlushChunks(const idx2_file& Idx2, encode_data* E)
     //printf("key %llu level %d subband %d bitplane %d\n", Ch->First, Level, Subband, BitPlane);
     WriteChunk(Idx2, E, Ch->Second, Level, Subband, BitPlane);
   }
+  /* the metadata goes after the chunks, so wait for the chunks to be written first */
+  idx2_PropagateIfError(WaitForWrites(&E->Writer));
 
   /* write the chunk metadata */
   idx2_ForEach (CmIt, E->ChunkMeta)
   {
     chunk_meta_info* Cm = CmIt.Val;
-    file_id FileId = ConstructFilePath(Idx2, *CmIt.Key);
-    if (FileId.Id != *CmIt.Key)
-    {
-      FileId = ConstructFilePath(Idx2, *CmIt.Key);
-    }
-    //printf("%llu %s\n", FileId.Id, FileId.Name.ConstPtr);
-    idx2_Assert(FileId.Id == *CmIt.Key);
     /* compress and write chunk sizes */
-    idx2_OpenMaybeExistingFile(Fp, FileId.Name.ConstPtr, "ab");
+    FILE* Fp = OpenFileForAppend(Idx2, &E->Writer.FileCache, *CmIt.Key);
+    if (!Fp)
+      return idx2_Error(idx2_err_code::FileCreateFailed);
     Flush(&Cm->Sizes);
     WriteBuffer(Fp, ToBuffer(Cm->Sizes));
     ChunkSizesStat.Add((f64)Size(Cm->Sizes));
@@ -385,6 +383,147 @@ FlushChunks(const idx2_file& Idx2, encode_data* E)
 }
 
 
+FILE*
+OpenFileForAppend(const idx2_file& Idx2, open_file_cache* Cache, u64 FileId)
+{
+  ++Cache->Clock;
+  auto It = Lookup(Cache->Files, FileId);
+  if (It)
+  {
+    It.Val->LastUse = Cache->Clock;
+    return It.Val->Fp;
+  }
+
+  /* close the least recently used file if there are too many open files */
+  if (Size(Cache->Files) >= Cache->MaxOpenFiles)
+  {
+    u64 LruKey = 0, LruUse = traits<u64>::Max;
+    idx2_ForEach (FileIt, Cache->Files)
+    {
+      if (FileIt.Val->LastUse < LruUse)
+      {
+        LruKey = *FileIt.Key;
+        LruUse = FileIt.Val->LastUse;
+      }
+    }
+    auto LruIt = Lookup(Cache->Files, LruKey);
+    fclose(LruIt.Val->Fp);
+    Delete(&Cache->Files, LruKey);
+  }
+
+  file_id Id = ConstructFilePath(Idx2, FileId);
+  idx2_Assert(Id.Id == FileId);
+  FILE* Fp = fopen(Id.Name.ConstPtr, "ab");
+  if (!Fp)
+  {
+    CreateFullDir(GetParentPath(Id.Name));
+    Fp = fopen(Id.Name.ConstPtr, "ab");
+  }
+  if (Fp)
+    Insert(&Cache->Files, FileId, open_file{ Fp, Cache->Clock });
+
+  return Fp;
+}
+
+
+void
+CloseFiles(open_file_cache* Cache)
+{
+  idx2_ForEach (FileIt, Cache->Files)
+    fclose(FileIt.Val->Fp);
+  Clear(&Cache->Files);
+}
+
+
+static void
+WriterLoop(chunk_writer* W)
+{
+  while (true)
+  {
+    write_request Req;
+    {
+      std::unique_lock<std::mutex> Lock(W->Mutex);
+      W->CanPop.wait(Lock, [W] { return Size(W->Queue) > 0 || W->Stop; });
+      if (Size(W->Queue) == 0) // stopping, and nothing left to write
+        return;
+      Req = PopFront(&W->Queue);
+      W->Busy = true;
+    }
+
+    FILE* Fp = OpenFileForAppend(*W->Idx2, &W->FileCache, Req.FileId);
+    bool Ok = Fp && fwrite(Req.Buf.Data, Size(Req.Buf), 1, Fp) == 1;
+    i64 Bytes = Size(Req.Buf);
+    DeallocBuf(&Req.Buf);
+
+    {
+      std::unique_lock<std::mutex> Lock(W->Mutex);
+      W->QueuedBytes -= Bytes;
+      W->Busy = false;
+      W->Failed = W->Failed || !Ok;
+      if (Size(W->Queue) == 0)
+        W->Idle.notify_all();
+    }
+    W->CanPush.notify_one();
+  }
+}
+
+
+void
+PushWrite(const idx2_file& Idx2, chunk_writer* W, u64 FileId, const buffer& Buf)
+{
+  write_request Req;
+  Req.FileId = FileId;
+  AllocBuf(&Req.Buf, Size(Buf));
+  MemCopy(Buf, &Req.Buf);
+
+  std::unique_lock<std::mutex> Lock(W->Mutex);
+  if (!W->Thread.joinable())
+  {
+    W->Idx2 = &Idx2;
+    W->Thread = std::thread(WriterLoop, W);
+  }
+  idx2_Assert(W->Idx2 == &Idx2);
+  /* back pressure: wait until the writer catches up */
+  W->CanPush.wait(Lock, [W, &Req] {
+    return !IsFull(W->Queue) &&
+           (W->QueuedBytes == 0 || W->QueuedBytes + Size(Req.Buf) <= W->MaxQueuedBytes);
+  });
+  PushBack(&W->Queue, Req);
+  W->QueuedBytes += Size(Req.Buf);
+  Lock.unlock();
+  W->CanPop.notify_one();
+}
+
+
+error<idx2_err_code>
+WaitForWrites(chunk_writer* W)
+{
+  std::unique_lock<std::mutex> Lock(W->Mutex);
+  W->Idle.wait(Lock, [W] { return Size(W->Queue) == 0 && !W->Busy; });
+  if (W->Failed)
+    return idx2_Error(idx2_err_code::FileWriteFailed);
+
+  return idx2_Error(idx2_err_code::NoError);
+}
+
+
+void
+Dealloc(chunk_writer* W)
+{
+  if (W->Thread.joinable())
+  {
+    {
+      std::unique_lock<std::mutex> Lock(W->Mutex);
+      W->Stop = true;
+    }
+    W->CanPop.notify_one();
+    W->Thread.join();
+  }
+  CloseFiles(&W->FileCache);
+  Dealloc(&W->FileCache.Files);
+}
+
+
 void
 PrintStats(cstr MetaFileName)
 {
@@ -413,5 +552,18 @@ PrintStats(cstr MetaFileName)
 }
 
 
+/* Clear the stats printed by PrintStats, so that each encode reports only its own chunks */
+void
+ResetStats()
+{
+  BlockStat = BlockEMaxStat = stat();
+  UncompressedExpChunksStat = CompressedExpChunksStat = ExpChunkSizesStat = stat();
+  CompressedExpChunkAddressesStat = UncompressedExpChunkAddressesStat = stat();
+  BrickDeltasStat = BrickSizesStat = stat();
+  BitPlaneChunksStat = CompressedChunkAddressesStat = UncompressedChunkAddressesStat = stat();
+  ChunkSizesStat = stat();
+}
+
+
 } // namespace idx2
 
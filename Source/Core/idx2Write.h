@@ -13,6 +13,8 @@ namespace idx2
 struct encode_data;
 struct channel;
 struct sub_channel;
+struct chunk_writer;
+struct open_file_cache;
 struct idx2_file;
 struct params;
 
@@ -26,6 +28,25 @@ WriteChunkExponents(const idx2_file& Idx2, encode_data* E, sub_channel* Sc, i8 L
 error<idx2_err_code>
 FlushChunks(const idx2_file& Idx2, encode_data* E);
 
+/* Return the file with the given id opened for appending (it stays open, owned by the cache) */
+FILE*
+OpenFileForAppend(const idx2_file& Idx2, open_file_cache* Cache, u64 FileId);
+
+void
+CloseFiles(open_file_cache* Cache);
+
+/* Queue a copy of Buf to be appended to the file with the given id (starting the writer if needed) */
+void
+PushWrite(const idx2_file& Idx2, chunk_writer* W, u64 FileId, const buffer& Buf);
+
+/* Wait until all the queued buffers have been written */
+error<idx2_err_code>
+WaitForWrites(chunk_writer* W);
+
+/* Write the remaining buffers and stop the writer thread */
+void
+Dealloc(chunk_writer* W);
+
 void
 WriteChunk(const idx2_file& Idx2, encode_data* E, channel* C, i8 Iter, i8 Level, i16 BitPlane);
 
@@ -50,6 +71,9 @@ FlushChunks_v2(const idx2_file& Idx2, encode_data* E);
 void
 PrintStats(cstr MetaFileName);
 
+void
+ResetStats();
+
 void
 PrintStats_v2(cstr MetaFileName);
 